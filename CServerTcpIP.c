@@ -28,17 +28,24 @@
  * 
  *	08 september 2009 - Initial commit from biblos (v3)
  */
+#define _GNU_SOURCE		/* accept4 */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
 #include <poll.h>
 #include <errno.h>
 
 #include "debug.h"
 #include "CServerTcpIP.h"
+#include "lathist.h"
 
 #ifndef CSERVERTCPIP_RX_BUFFER_SIZE
 	#define CSERVERTCPIP_RX_BUFFER_SIZE	(10*1024)
@@ -48,11 +55,37 @@
 	#define CSERVERTCPIP_LISTEN_QUEUE_SIZE	(512)
 #endif
 
+#ifndef CSERVERTCPIP_MAX_EVENTS
+	#define CSERVERTCPIP_MAX_EVENTS	(64)
+#endif
+
+#ifndef CSERVERTCPIP_TX_QUEUE_SIZE
+	#define CSERVERTCPIP_TX_QUEUE_SIZE	(64*1024)
+#endif
+
+#ifndef CSERVERTCPIP_TX_QUEUE_POLICY
+	#define CSERVERTCPIP_TX_QUEUE_POLICY	CSERVERTCPIP_QUEUE_DISCONNECT
+#endif
+
+#ifndef CSERVERTCPIP_MAX_WORKERS
+	#define CSERVERTCPIP_MAX_WORKERS	(64)
+#endif
+
+
+static void TxQueue_Free (TxQueue *q);
+static void CServerTcpIP_Flush (CServerTcpIP *this, Client *client);
+
 
 static int
 CServerTcpIP_GetNbClientsConnected (CServerTcpIP *this)
 {
-	return this->m_iClientNumber;
+	unsigned int i;
+	int nb = 0;
+
+	for (i = 0; i < this->m_uiNbWorkers; i++)
+		nb += this->m_workers[i].m_iClientNumber;
+
+	return nb;
 }
 
 /*
@@ -62,21 +95,18 @@ CServerTcpIP_GetNbClientsConnected (CServerTcpIP *this)
  */
 Client *CServerTcpIP_FindClient (CServerTcpIP* this, int fd)
 {
-	if (fd < 0)
-		return (Client *) NULL;
+	unsigned int i;
+	Client *curseur;
 
-	if (this->m_clistClients == (Client *) NULL) {
+	if (fd < 0)
 		return (Client *) NULL;
-	} else {
-		Client *curseur = this->m_clistClients;
 
-		do {
+	for (i = 0; i < this->m_uiNbWorkers; i++) {
+		for (curseur = this->m_workers[i].m_clistClients; curseur != (Client *) NULL; curseur = curseur->next) {
 			if (curseur->fd == fd) {
 				return curseur;
 			}
-
-			curseur = curseur->next;
-		} while (curseur != (Client *) NULL);
+		}
 	}
 
 	return (Client *) NULL;
@@ -87,6 +117,7 @@ void CServerTcpIP_FreeClient (Client *client)
 	shutdown (client->fd, SHUT_RDWR);
 	DEBUG ("Close fd=%d\n", client->fd);
 	close (client->fd);
+	TxQueue_Free (&client->txq);
 	free (client->adresseIP);
 	free (client);
 }
@@ -94,6 +125,8 @@ void CServerTcpIP_FreeClient (Client *client)
 
 void CServerTcpIP_AddClient (CServerTcpIP *this, Client *client)
 {
+	CServerTcpIP_Worker *worker;
+
 	/*
 	 *	Vérification des paramètres
 	 */
@@ -104,31 +137,25 @@ void CServerTcpIP_AddClient (CServerTcpIP *this, Client *client)
 		return;
 
 	/*
-	 *	Recherche du dernier maillon
+	 *	Insertion en tête de la liste du worker : O(1)
 	 */
-	if (this->m_clistClients == (Client *) NULL) {
-		this->m_clistClients = client;
-	} else {
-		Client *curseur = this->m_clistClients;
-
-		while (curseur->next != (Client *) NULL) {
-			curseur = curseur->next;
-		}
-
-		curseur->next = client;
-	}
+	worker = client->worker;
+	client->prev = NULL;
+	client->next = worker->m_clistClients;
+	if (worker->m_clistClients != (Client *) NULL)
+		worker->m_clistClients->prev = client;
+	worker->m_clistClients = client;
 
 	/*
 	 *	Incrémente le nombre de client connecté
 	 */
-	this->m_iClientNumber = this->m_iClientNumber + 1;
+	worker->m_iClientNumber = worker->m_iClientNumber + 1;
 }
 
 
 void CServerTcpIP_DelClient (CServerTcpIP *this, Client *client)
 {
-	Client *curseur;
-	Client *curseur_prec = NULL;
+	CServerTcpIP_Worker *worker;
 
 	/*
 	 *	Vérification des paramètres
@@ -139,57 +166,56 @@ void CServerTcpIP_DelClient (CServerTcpIP *this, Client *client)
 	if (client == (Client *) NULL)
 		return;
 
-	/*
-	 *	Recherche du client dans la liste
-	 */
 	/* Cas de la liste vide */
-	if (this->m_clistClients == (Client *) NULL) {
+	worker = client->worker;
+	if (worker->m_clistClients == (Client *) NULL) {
 		DEBUG ("Client fantome !\n");
 		return;
 	}
 
-	/* Cas particulier pour le 1er de la liste */
-	if (this->m_clistClients == client) {
-		CServerTcpIP_FreeClient (client);
-		this->m_clistClients = client->next;
-		this->m_iClientNumber = this->m_iClientNumber - 1;
-		return;
-	}
+	/*
+	 *	Retrait du maillon grâce au chaînage double : O(1)
+	 */
+	if (client->prev != (Client *) NULL)
+		client->prev->next = client->next;
+	else
+		worker->m_clistClients = client->next;
 
-	curseur = this->m_clistClients->next;
-	while (curseur != client) {
-		curseur_prec = curseur;
-		curseur = curseur->next;
-		if (curseur == (Client *) NULL){
-			DEBUG ("Client fantome !\n");
-			return;
-		}
+	if (client->next != (Client *) NULL)
+		client->next->prev = client->prev;
+
+	worker->m_iClientNumber = worker->m_iClientNumber - 1;
+	worker->m_ulDisconnects[client->closing ? client->reason : CSERVERTCPIP_DISCONNECT_STOP]++;
+
+	if (this->m_disconnect_callback != (CServerTcpIP_connect_t) NULL) {
+		this->m_disconnect_callback (this, client, this->m_pvPrivateData);
 	}
-	curseur_prec->next = curseur->next;
-	this->m_iClientNumber = this->m_iClientNumber - 1;
-	CServerTcpIP_FreeClient (curseur);
+
+	/* La fermeture du fd le retire aussi de l'instance epoll */
+	CServerTcpIP_FreeClient (client);
 }
 
 
 
-static int
-CServerTcpIP_Stop (CServerTcpIP *this)
+/*
+ *	Fonction	: worker stop
+ *	Description	: Arrête le thread d'un worker, ferme sa socket d'écoute et tous ses clients
+ */
+static void
+CServerTcpIP_WorkerStop (CServerTcpIP_Worker *worker)
 {
 	int ret;
-	
-	/* Check for unstarted listen socket */
-	if (this->m_fdListen < 0) {
-		DEBUG ("Warning listen socket may be not started !\n");
-		return -1;
-	}
+	uint64_t wake = 1;
 
-	/* Stop Runtime */
-	ret = pthread_cancel (this->m_threadListen);
-	if (ret < 0) {
-		DEBUG ("No thread to stop !\n");
-	} else {
-		ret = pthread_join (this->m_threadListen, NULL);
-		if (ret == 0 || ret == -ESRCH) {
+	/* Stop Runtime : le thread est réveillé par l'eventfd et sort de sa boucle */
+	if (worker->m_iRunning) {
+		worker->m_iRunning = 0;
+		if (write (worker->m_fdWake, &wake, sizeof (wake)) != sizeof (wake)) {
+			DEBUG ("Can't wake the Reception thread !\n");
+		}
+
+		ret = pthread_join (worker->m_thread, NULL);
+		if (ret == 0 || ret == ESRCH) {
 			DEBUG ("Reception thread stopped\n");
 		} else {
 			DEBUG ("Can't join the Reception thread !\n");
@@ -197,169 +223,589 @@ CServerTcpIP_Stop (CServerTcpIP *this)
 	}
 
 	/* Stop the listen socket */
-	shutdown (this->m_fdListen, SHUT_RDWR);
-	close (this->m_fdListen);
-	this->m_fdListen = -1;
-	
+	if (worker->m_fdListen >= 0) {
+		shutdown (worker->m_fdListen, SHUT_RDWR);
+		close (worker->m_fdListen);
+		worker->m_fdListen = -1;
+	}
+
+	if (worker->m_fdEpoll >= 0) {
+		close (worker->m_fdEpoll);
+		worker->m_fdEpoll = -1;
+	}
+	if (worker->m_fdWake >= 0) {
+		close (worker->m_fdWake);
+		worker->m_fdWake = -1;
+	}
+
 	/* Stop all active connection */
-	while (this->m_clistClients != (Client *)NULL) {
-		DEBUG_FLOOD ("this->m_clistClients = %d\n", this->m_clistClients);
-		CServerTcpIP_DelClient (this, this->m_clistClients);
+	pthread_mutex_lock (&worker->m_mutex);
+	while (worker->m_clistClients != (Client *)NULL) {
+		DEBUG_FLOOD ("worker->m_clistClients = %p\n", worker->m_clistClients);
+		CServerTcpIP_DelClient (worker->m_server, worker->m_clistClients);
 	}
+	pthread_mutex_unlock (&worker->m_mutex);
+}
+
+static int
+CServerTcpIP_Stop (CServerTcpIP *this)
+{
+	unsigned int i;
+
+	/* Check for unstarted listen socket */
+	if (!this->m_iStarted) {
+		DEBUG ("Warning listen socket may be not started !\n");
+		return -1;
+	}
+
+	for (i = 0; i < this->m_uiNbWorkers; i++)
+		CServerTcpIP_WorkerStop (&this->m_workers[i]);
+	this->m_iStarted = 0;
 
 	return 0;
 }
 
 
+/*
+ *	Fonction	: welcome
+ *	Description	: Enregistre un nouveau client connecté sur 'fd' dans l'instance epoll et la liste d'un worker.
+ *			  Le pointeur sur le Client est conservé dans epoll_data : aucune recherche n'est nécessaire
+ *			  lorsque son fd devient prêt.
+ *			  Le callback de connexion est appelé avant l'enregistrement ; si celui-ci échoue, le
+ *			  callback de déconnexion est appelé pour libérer les données privées du client.
+ *	Retour		: Le client, NULL si erreur (le fd n'est alors pas fermé)
+ */
+static Client *
+CServerTcpIP_Welcome (CServerTcpIP_Worker *worker, int fd, const char *adresseIP, unsigned int port)
+{
+	CServerTcpIP *this = worker->m_server;
+	Client *welcome;
+	struct epoll_event ev;
+
+	welcome = (Client *) calloc (1, sizeof (Client));
+	if (welcome == (Client *) NULL) {
+		DEBUG ("Erreur critique sur l'allocation d'un client\n");
+		return NULL;
+	}
+
+	/* Connection ok */
+	welcome->fd = fd;
+	welcome->worker = worker;
+	welcome->next = NULL;
+	welcome->prev = NULL;
+	welcome->adresseIP = strdup(adresseIP);
+	welcome->port = port;
+
+	if (welcome->adresseIP == NULL) {
+		DEBUG ("Erreur critique sur l'allocation d'un client\n");
+		free (welcome);
+		return NULL;
+	}
+
+	/*
+	 *	Le callback de connexion est appelé avant que le fd ne soit surveillé : le worker ne peut pas
+	 *	servir ce client (réception, broadcast) avant que ses données privées ne soient en place.
+	 */
+	if (this->m_connect_callback != (CServerTcpIP_connect_t) NULL) {
+		this->m_connect_callback (this, welcome, this->m_pvPrivateData);
+	}
+
+	ev.events = EPOLLIN | EPOLLPRI | EPOLLRDHUP;
+	ev.data.ptr = welcome;
+	pthread_mutex_lock (&worker->m_mutex);
+	if (epoll_ctl (worker->m_fdEpoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		pthread_mutex_unlock (&worker->m_mutex);
+		DEBUG ("Erreur sur epoll_ctl pour fd=%d\n", fd);
+		if (this->m_disconnect_callback != (CServerTcpIP_connect_t) NULL) {
+			this->m_disconnect_callback (this, welcome, this->m_pvPrivateData);
+		}
+		free (welcome->adresseIP);
+		free (welcome);
+		return NULL;
+	}
+	CServerTcpIP_AddClient (this, welcome);
+	pthread_mutex_unlock (&worker->m_mutex);
+
+	DEBUG_INFO ("Connection de IP=%s:%d\n", welcome->adresseIP, welcome->port);
+	return welcome;
+}
+
+
+/*
+ *	Fonction	: accept
+ *	Description	: Accepte une demande de connexion sur la socket d'écoute d'un worker.
+ */
+static void
+CServerTcpIP_Accept (CServerTcpIP_Worker *worker)
+{
+	struct sockaddr_in addr_client;			/* Information sur un client lors de sa connection */
+	socklen_t size_addr_client = sizeof(struct sockaddr_in);
+	int fd;
+
+	fd = accept4 (worker->m_fdListen, (struct sockaddr *) &addr_client, &size_addr_client, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0) {
+		/* Erreur lors de l'accept */
+		DEBUG ("Erreur sur l'accept\n");
+		return;
+	}
+
+	if (CServerTcpIP_Welcome (worker, fd, inet_ntoa(addr_client.sin_addr), ntohs(addr_client.sin_port)) == (Client *) NULL)
+		close (fd);
+}
+
+
+/*
+ *	Fonction	: attach
+ *	Description	: Confie au serveur un descripteur déjà connecté (socketpair, socket héritée...), servi
+ *			  comme un client accepté par le worker qui a le moins de clients.
+ *	Retour		: 0 si ok (le serveur possède alors le fd), -1 si erreur ou serveur arrêté
+ */
+static int
+CServerTcpIP_Attach (CServerTcpIP *this, int fd, const char *name)
+{
+	CServerTcpIP_Worker *worker;
+	unsigned int i;
+	int flags;
+
+	if (!this->m_iStarted || fd < 0) {
+		DEBUG ("Can't attach fd=%d\n", fd);
+		return -1;
+	}
+
+	worker = &this->m_workers[0];
+	for (i = 1; i < this->m_uiNbWorkers; i++) {
+		if (this->m_workers[i].m_iClientNumber < worker->m_iClientNumber)
+			worker = &this->m_workers[i];
+	}
+
+	flags = fcntl (fd, F_GETFL);
+	if (flags < 0 || fcntl (fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		DEBUG ("Error on fcntl for fd=%d\n", fd);
+		return -1;
+	}
+
+	return (CServerTcpIP_Welcome (worker, fd, (name != NULL) ? name : "local", 0) != (Client *) NULL) ? 0 : -1;
+}
+
+
+/*
+ *	Fonction	: retire
+ *	Description	: Retire un client de la liste depuis le thread d'écoute.
+ *			  La cause est celle de la fermeture demandée s'il y en a une, sinon 'reason'.
+ */
+static void
+CServerTcpIP_Retire (CServerTcpIP *this, Client *client, CServerTcpIP_reason_t reason)
+{
+	CServerTcpIP_Worker *worker = client->worker;
+
+	pthread_mutex_lock (&worker->m_mutex);
+	if (!client->closing) {
+		client->closing = 1;
+		client->reason = reason;
+	}
+	CServerTcpIP_DelClient (this, client);
+	pthread_mutex_unlock (&worker->m_mutex);
+}
+
+
 /*
  *	Fonction	: runtime
- *	Description	: Thread d'écoute des descripteurs de fichier des sockets (Connection et reception de donnée)
+ *	Description	: Thread d'écoute d'un worker (Connection et reception de donnée sur ses sockets)
  *
+ *	Chaque descripteur est enregistré une seule fois dans l'instance epoll du worker :
+ *		- la socket d'écoute avec data.ptr = NULL
+ *		- l'eventfd de réveil avec data.ptr = &worker->m_fdWake
+ *		- chaque client avec data.ptr = le Client lui-même
  */
 void *
 CServerTcpIP_Runtime (void *pdata)
 {
-	CServerTcpIP *this = (CServerTcpIP *)pdata;
+	CServerTcpIP_Worker *worker = (CServerTcpIP_Worker *)pdata;
+	CServerTcpIP *this = worker->m_server;
 	char buffer_rx[CSERVERTCPIP_RX_BUFFER_SIZE];
+	struct epoll_event events[CSERVERTCPIP_MAX_EVENTS];
 	int i, ret, readed;
-	int pfd_size;
-	struct pollfd *pfd = NULL;
-	Client *curseur;
-	Client *welcome;
-	struct sockaddr_in addr_client;			/* Information sur un client lors de sa connection */
-	unsigned int size_addr_client = sizeof(struct sockaddr_in);
-	int flag;								/* flag de sortie de boucle */
-
-	/*
-	 *	Configuration du thread
-	 */
-	pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
-	pthread_setcanceltype (PTHREAD_CANCEL_DEFERRED, NULL);
+	uint64_t wake;
+	Client *client;
 
 	/*
 	 *	Boucle d'écoute
 	 */
-	while (1)
+	while (worker->m_iRunning)
 	{
 		/*
-		 *	Allocation et configuration du tableau de "struct pollfd" pour le poll
+		 *	Attente d'evenement sur les descripteurs de fichier
 		 */
-		if (pfd != (struct pollfd *) NULL)
-			free (pfd);
-
-		pfd_size = 1 + this->m_iClientNumber;
-		pfd = (struct pollfd *) malloc (pfd_size * sizeof (struct pollfd));
-		if (pfd == (struct pollfd *) NULL) {
-			DEBUG ("Erreur critique sur l'allocation de pfd\n");
+		ret = epoll_wait (worker->m_fdEpoll, events, CSERVERTCPIP_MAX_EVENTS, 5000 /* ms */);
+		if (ret < 0) {
+			/* Erreur sur l'epoll */
+			if (errno != EINTR)
+				DEBUG ("Erreur sur l'epoll_wait\n");
+			continue;
+		} else if (ret == 0) {
+			/* Time-out */
+			DEBUG_FLOOD ("Timeout !\n");
 			continue;
 		}
 
-		pfd[0].fd = this->m_fdListen;
-		pfd[0].events = POLLIN | POLLPRI;
+		/* Un moins 1 fd est pret ! */
+		for (i=0; i<ret; i++) {
+			if (events[i].data.ptr == (void *) &worker->m_fdWake) {
+				/* Demande d'arrêt */
+				if (read (worker->m_fdWake, &wake, sizeof (wake)) < 0)
+					DEBUG ("Erreur de lecture de l'eventfd\n");
+				continue;
+			}
 
-		curseur = this->m_clistClients;
-		for (i=0; i<(pfd_size-1); i++) {
-			pfd[i+1].fd = curseur->fd;
-			pfd[i+1].events = POLLIN | POLLPRI;	
-			curseur = curseur->next;
-		}
+			if (events[i].data.ptr == NULL) {
+				/* Socket d'ecoute : c'est une demande de connection */
+				CServerTcpIP_Accept (worker);
+				continue;
+			}
 
-		/*
-		 *	Attente d'evenement sur les descripteurs de fichier
-		 */
-		flag = 0;
-		do {
-			pthread_testcancel ();
-			ret = poll (pfd, pfd_size, 5000 /* ms */);
-			if (ret < 0) {
-				/* Erreur sur le poll */
-				DEBUG ("Erreur sur le poll\n");
-			} else if (ret == 0) {
-				/* Time-out */
-				DEBUG_FLOOD ("Timeout !\n");
-			} else {
-				/* Un moins 1 fd est pret ! */
-				for (i=0; i<pfd_size; i++) {
-					if (pfd[i].revents & (POLLIN | POLLPRI)) {
-						if (i == 0) {
-							/* Socket d'ecoute : c'est une demande de connection */
-							welcome = (Client *) malloc (sizeof (Client));
-							welcome->fd = accept(this->m_fdListen, (struct sockaddr *) &addr_client, &size_addr_client);
-							if (welcome->fd < 0) {
-								/* Erreur lors de l'accept */
-								free (welcome);
-							} else {
-								/* Connection ok */
-								welcome->next = NULL;
-								welcome->adresseIP = strdup(inet_ntoa(addr_client.sin_addr));
-								welcome->port = ntohs(addr_client.sin_port);
-								DEBUG_INFO ("Connection de IP=%s:%d\n", welcome->adresseIP, welcome->port);
-								CServerTcpIP_AddClient (this, welcome);
-								if (this->m_connect_callback != (CServerTcpIP_connect_t) NULL) {
-									this->m_connect_callback (this, welcome, this->m_pvPrivateData);
-								}
-								flag = 1;
-							}
-						} else {
-							/* Socket client : Donnée disponible en lecture */
-							memset (buffer_rx, '\0', CSERVERTCPIP_RX_BUFFER_SIZE);
-							readed = recv (pfd[i].fd, buffer_rx, CSERVERTCPIP_RX_BUFFER_SIZE, 0);
-							if (readed <= 0) {
-								/* Erreur (-1) ou fin de connection (0) */
-								CServerTcpIP_DelClient (this, CServerTcpIP_FindClient (this, pfd[i].fd));
-								flag = 1;
-							} else {
-								if (this->m_callback != (CServerTcpIP_rx_t) NULL) {
-									Client *tmp = CServerTcpIP_FindClient (this, pfd[i].fd);
-									this->m_callback (buffer_rx, readed, this, tmp, this->m_pvPrivateData);
-								}
-							}
-						}
-					} else if (pfd[i].revents & (POLLERR | POLLHUP)) {
-						/* Connection IP perdu */
-						CServerTcpIP_DelClient (this, CServerTcpIP_FindClient (this, pfd[i].fd));
-						flag = 1;
-					}
+			client = (Client *) events[i].data.ptr;
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				/* Connection IP perdu */
+				CServerTcpIP_Retire (this, client, (events[i].events & EPOLLERR) ?
+				                     CSERVERTCPIP_DISCONNECT_ERROR : CSERVERTCPIP_DISCONNECT_PEER);
+				continue;
+			}
+
+			if (events[i].events & EPOLLOUT) {
+				/* Socket client : prête en écriture, vidage de la file d'émission */
+				pthread_mutex_lock (&worker->m_mutex);
+				CServerTcpIP_Flush (this, client);
+				pthread_mutex_unlock (&worker->m_mutex);
+			}
+
+			if (events[i].events & (EPOLLIN | EPOLLPRI | EPOLLRDHUP)) {
+				/* Socket client : Donnée disponible en lecture (non terminée par un 0) */
+				readed = recv (client->fd, buffer_rx, CSERVERTCPIP_RX_BUFFER_SIZE, 0);
+				if (readed < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+					continue;
+				} else if (readed <= 0 || client->closing) {
+					/* Erreur (-1), fin de connection (0) ou fermeture demandée */
+					CServerTcpIP_Retire (this, client, (readed < 0) ?
+					                     CSERVERTCPIP_DISCONNECT_ERROR : CSERVERTCPIP_DISCONNECT_PEER);
+				} else if (this->m_callback != (CServerTcpIP_rx_t) NULL) {
+					this->m_callback (buffer_rx, readed, this, client, this->m_pvPrivateData);
 				}
 			}
-		} while (!flag);
+		}
 	}
+
+	return NULL;
 }
 
 
 
+/*
+ *	File d'émission
+ *	Alloc / Drop oldest / Push / Consume
+ *
+ *	Toutes ces fonctions sont appelées avec le mutex du worker du client verrouillé.
+ */
 static int
-secure_send (int fd, char *buffer, unsigned int buffer_size, int flags)
+TxQueue_Alloc (TxQueue *q, unsigned int size)
 {
-	int ret, offset, size;
-	struct pollfd pfd;
-	
-	/* Init */
-	size = buffer_size;
-	offset = 0;
-	pfd.fd = fd;
-	pfd.events = POLLOUT;
-	
-	do {
-		ret = poll (&pfd, 1, 1000);
-		if (ret <= 0) {
-			/* Error or timeout */
-			return -EIO;
+	if (q->data != (char *) NULL)
+		return 0;
+
+	q->size = size;
+	q->msg_size = size / 16 + 1;
+	q->data = (char *) malloc (q->size);
+	q->msg = (unsigned int *) malloc (q->msg_size * sizeof (unsigned int));
+	q->msg_origin = (struct timeval *) malloc (q->msg_size * sizeof (struct timeval));
+	if (q->data == (char *) NULL || q->msg == (unsigned int *) NULL || q->msg_origin == (struct timeval *) NULL) {
+		DEBUG ("Erreur critique sur l'allocation d'une file d'emission\n");
+		free (q->data);
+		free (q->msg);
+		free (q->msg_origin);
+		q->data = NULL;
+		q->msg = NULL;
+		q->msg_origin = NULL;
+		return -1;
+	}
+
+	q->head = q->len = 0;
+	q->msg_head = q->msg_count = 0;
+	q->started = 0;
+	return 0;
+}
+
+static void
+TxQueue_Free (TxQueue *q)
+{
+	free (q->data);
+	free (q->msg);
+	free (q->msg_origin);
+	q->data = NULL;
+	q->msg = NULL;
+	q->msg_origin = NULL;
+	q->len = q->msg_count = 0;
+}
+
+/*
+ *	Supprime le plus ancien message qui n'a pas encore été entamé.
+ *	Si le premier message est partiellement envoyé, c'est le suivant qui est supprimé : le reste
+ *	du premier est décalé sur la place libérée afin de conserver un flux d'octets contigu.
+ *	Retourne le nombre d'octets libérés (0 si rien ne peut être supprimé).
+ */
+static unsigned int
+TxQueue_DropOldest (TxQueue *q)
+{
+	unsigned int len0, len1, k;
+	struct timeval origin;
+
+	if (q->msg_count == 0)
+		return 0;
+
+	len0 = q->msg[q->msg_head];
+	if (!q->started) {
+		q->head = (q->head + len0) % q->size;
+		q->len -= len0;
+		q->msg_head = (q->msg_head + 1) % q->msg_size;
+		q->msg_count--;
+		return len0;
+	}
+
+	if (q->msg_count < 2)
+		return 0;
+
+	len1 = q->msg[(q->msg_head + 1) % q->msg_size];
+	for (k = len0; k-- > 0;)
+		q->data[(q->head + len1 + k) % q->size] = q->data[(q->head + k) % q->size];
+	q->head = (q->head + len1) % q->size;
+	q->len -= len1;
+	origin = q->msg_origin[q->msg_head];
+	q->msg_head = (q->msg_head + 1) % q->msg_size;
+	q->msg[q->msg_head] = len0;
+	q->msg_origin[q->msg_head] = origin;
+	q->msg_count--;
+	return len1;
+}
+
+static void
+TxQueue_Push (TxQueue *q, const char *buffer, unsigned int size, int started, const struct timeval *origin)
+{
+	unsigned int tail, first;
+
+	tail = (q->head + q->len) % q->size;
+	first = q->size - tail;
+	if (first > size)
+		first = size;
+	memcpy (q->data + tail, buffer, first);
+	memcpy (q->data, buffer + first, size - first);
+	q->len += size;
+
+	q->msg[(q->msg_head + q->msg_count) % q->msg_size] = size;
+	if (origin != (const struct timeval *) NULL)
+		q->msg_origin[(q->msg_head + q->msg_count) % q->msg_size] = *origin;
+	else
+		q->msg_origin[(q->msg_head + q->msg_count) % q->msg_size].tv_sec = 0;
+	q->msg_count++;
+	if (q->msg_count == 1)
+		q->started = started;
+}
+
+/*
+ *	Retourne le nombre de messages entièrement écrits
+ */
+static unsigned int
+TxQueue_Consume (TxQueue *q, unsigned int size)
+{
+	unsigned int done = 0;
+
+	q->head = (q->head + size) % q->size;
+	q->len -= size;
+
+	while (size > 0) {
+		if (size >= q->msg[q->msg_head]) {
+			/* Message entièrement écrit sur la socket */
+			size -= q->msg[q->msg_head];
+			if (q->msg_origin[q->msg_head].tv_sec != 0)
+				lathist_record_since (&lathist_stage[LATHIST_WRITE], &q->msg_origin[q->msg_head]);
+			q->msg_head = (q->msg_head + 1) % q->msg_size;
+			q->msg_count--;
+			q->started = 0;
+			done++;
+		} else {
+			q->msg[q->msg_head] -= size;
+			q->started = 1;
+			size = 0;
 		}
-	
-		DEBUG ("fd=%d, buffer+offset=%d, size=%d\n", fd, (int)(buffer + offset), size);
-		ret = send (fd, buffer + offset, size, flags);
+	}
+	return done;
+}
+
+
+
+/*
+ *	Fonction : Drop
+ *	Description :	Coupe la connexion d'un client sans le libérer.
+ *			Le Client reste référencé par l'instance epoll : c'est le thread d'écoute qui le
+ *			retire de la liste lorsqu'il reçoit la fin de connexion (EPOLLHUP / recv = 0).
+ */
+static void
+CServerTcpIP_Drop (Client *client, CServerTcpIP_reason_t reason)
+{
+	if (!client->closing)
+		client->reason = reason;
+	client->closing = 1;
+	shutdown (client->fd, SHUT_RDWR);
+}
+
+/*
+ *	Fonction : Arm
+ *	Description :	Active ou désactive la surveillance de EPOLLOUT pour un client
+ */
+static void
+CServerTcpIP_Arm (CServerTcpIP *this, Client *client, int armed)
+{
+	struct epoll_event ev;
+
+	if (client->txarmed == armed)
+		return;
+
+	ev.events = EPOLLIN | EPOLLPRI | EPOLLRDHUP | (armed ? EPOLLOUT : 0);
+	ev.data.ptr = client;
+	if (epoll_ctl (client->worker->m_fdEpoll, EPOLL_CTL_MOD, client->fd, &ev) < 0) {
+		DEBUG ("Erreur sur epoll_ctl pour fd=%d\n", client->fd);
+		return;
+	}
+	client->txarmed = armed;
+}
+
+/*
+ *	Fonction : Flush
+ *	Description :	Vide autant que possible la file d'émission d'un client sans bloquer.
+ *			Appelée par le thread d'écoute lorsque la socket est prête en écriture.
+ *			Une fois la file vide, la callback de vidage peut à nouveau remplir la socket.
+ */
+static void
+CServerTcpIP_Flush (CServerTcpIP *this, Client *client)
+{
+	TxQueue *q = &client->txq;
+	struct iovec iov[2];
+	struct msghdr msg;
+	unsigned int first, done;
+	ssize_t ret;
+
+	while (q->len > 0) {
+		first = q->size - q->head;
+		if (first > q->len)
+			first = q->len;
+
+		iov[0].iov_base = q->data + q->head;
+		iov[0].iov_len = first;
+		iov[1].iov_base = q->data;
+		iov[1].iov_len = q->len - first;
+
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = (iov[1].iov_len > 0) ? 2 : 1;
+
+		ret = sendmsg (client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
 		if (ret < 0) {
-			perror (NULL);
-			return ret;
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+			DEBUG ("Erreur lors de l'envoie d'un message au client %s:%d\n", client->adresseIP, client->port);
+			CServerTcpIP_Drop (client, CSERVERTCPIP_DISCONNECT_ERROR);
+			return;
 		}
-			
-		offset += ret;
-		size -= ret;
-		if (size <= 0)
+
+		done = TxQueue_Consume (q, ret);
+		client->tx_bytes += ret;
+		client->tx_msgs += done;
+		client->worker->m_ulTxBytes += ret;
+		client->worker->m_ulTxMsgs += done;
+	}
+
+	CServerTcpIP_Arm (this, client, 0);
+
+	if (this->m_drain_callback != (CServerTcpIP_connect_t) NULL && !client->closing) {
+		this->m_drain_callback (this, client, this->m_pvPrivateData);
+	}
+}
+
+/*
+ *	Fonction : Enqueue
+ *	Description :	Envoie directement le message si la file est vide, puis place le reste dans la file
+ *			d'émission du client en appliquant la politique de file pleine. Ne bloque jamais.
+ *			Si origin n'est pas NULL, la latence depuis origin est mesurée à la mise en file
+ *			et à l'écriture du dernier octet.
+ *	Retour :	buffer_size si le message est envoyé ou mis en file, -1 sinon
+ */
+static int
+CServerTcpIP_Enqueue (CServerTcpIP *this, Client *to, char *buffer, unsigned int buffer_size, const struct timeval *origin)
+{
+	TxQueue *q = &to->txq;
+	unsigned int size = buffer_size;
+	int ret, started = 0;
+
+	if (to->closing)
+		return -1;
+
+	/* File vide : tentative d'envoi direct, sans attente */
+	if (q->len == 0) {
+		ret = send (to->fd, buffer, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				DEBUG ("Erreur lors de l'envoie d'un message au client %s:%d\n", to->adresseIP, to->port);
+				CServerTcpIP_Drop (to, CSERVERTCPIP_DISCONNECT_ERROR);
+				return -1;
+			}
+			ret = 0;
+		}
+		to->tx_bytes += ret;
+		to->worker->m_ulTxBytes += ret;
+		if ((unsigned int) ret == size) {
+			to->tx_msgs++;
+			to->worker->m_ulTxMsgs++;
+			if (origin != (const struct timeval *) NULL) {
+				lathist_record_since (&lathist_stage[LATHIST_ENQUEUE], origin);
+				lathist_record_since (&lathist_stage[LATHIST_WRITE], origin);
+			}
 			return buffer_size;
-			
-	} while (1);
+		}
+
+		buffer += ret;
+		size -= ret;
+		started = (ret > 0);
+	}
+
+	if (TxQueue_Alloc (q, this->m_uiTxQueueSize) < 0) {
+		CServerTcpIP_Drop (to, CSERVERTCPIP_DISCONNECT_ERROR);
+		return -1;
+	}
+
+	/* File pleine */
+	while (q->size - q->len < size || q->msg_count == q->msg_size) {
+		if (this->m_TxPolicy == CSERVERTCPIP_QUEUE_DROP_OLDEST && !started) {
+			if (TxQueue_DropOldest (q) > 0) {
+				to->drop_oldest++;
+				to->worker->m_ulDropOldest++;
+				continue;
+			}
+		}
+
+		/* Un message entamé doit être envoyé en entier : seule la déconnexion est possible */
+		if (this->m_TxPolicy != CSERVERTCPIP_QUEUE_DISCONNECT && !started) {
+			to->drop_newest++;
+			to->worker->m_ulDropNewest++;
+			return -1;
+		}
+
+		DEBUG ("File d'emission pleine pour le client %s:%d\n", to->adresseIP, to->port);
+		CServerTcpIP_Drop (to, CSERVERTCPIP_DISCONNECT_QUEUE);
+		return -1;
+	}
+
+	TxQueue_Push (q, buffer, size, started, origin);
+	CServerTcpIP_Arm (this, to, 1);
+	if (origin != (const struct timeval *) NULL)
+		lathist_record_since (&lathist_stage[LATHIST_ENQUEUE], origin);
+	return buffer_size;
 }
 
 
@@ -367,62 +813,213 @@ secure_send (int fd, char *buffer, unsigned int buffer_size, int flags)
 /*
  *	Fonction : Send
  *	Description : 	Envoie un message au client représenté par "destinataire" ou bien a tous les clients si destinataire vaut NULL
- *			Une erreur sur l'envoie provoque la fermeture du socket client, la connection est perdu
+ *			Le message est mis dans la file d'émission de chaque client, vidée par le thread d'écoute :
+ *			un client lent ne bloque jamais l'appelant.
+ *			Le broadcast parcourt les workers un par un : un seul mutex est tenu à la fois.
+ *			Une erreur sur l'envoie provoque la fermeture du socket client, la connection est perdu.
+ *			Le client est libéré par le thread de son worker, seul propriétaire de la liste.
  */
 static int
-CServerTcpIP_Send (CServerTcpIP* this, Client *to, char *buffer, unsigned int buffer_size)
+CServerTcpIP_SendFrom (CServerTcpIP* this, Client *to, char *buffer, unsigned int buffer_size, const struct timeval *origin)
 {
+	CServerTcpIP_Worker *worker;
+	unsigned int i;
 	int ret;
-	
+
 	/*
 	 *	Broadcast
 	 */
 	if (to == (Client *) NULL){
-		to = this->m_clistClients;
-		while (to != (Client *) NULL) {
-			DEBUG ("Destinataire : %p, fd = %d\n", to, to->fd);
-			if (secure_send (to->fd, buffer, buffer_size, MSG_DONTWAIT) != buffer_size) {
-				DEBUG ("Erreur lors de l'envoie d'un message au client %s:%d\n", to->adresseIP, to->port);
-				close (to->fd);
-				CServerTcpIP_DelClient (this, to);
+		for (i = 0; i < this->m_uiNbWorkers; i++) {
+			worker = &this->m_workers[i];
+			pthread_mutex_lock (&worker->m_mutex);
+			for (to = worker->m_clistClients; to != (Client *) NULL; to = to->next) {
+				DEBUG_FLOOD ("Destinataire : %p, fd = %d\n", to, to->fd);
+				CServerTcpIP_Enqueue (this, to, buffer, buffer_size, origin);
 			}
-
-			to = to->next;
+			pthread_mutex_unlock (&worker->m_mutex);
 		}
-
 		return buffer_size;
-	} else {
-		/*
-		 *	Unicast
-		 */
-		ret = secure_send (to->fd, buffer, buffer_size, MSG_DONTWAIT);
-		if (ret != buffer_size) {
-			DEBUG ("Ret = %d, buffer_size = %d\n", ret, buffer_size);
-			DEBUG ("Erreur lors de l'envoie d'un message au client %s:%d\n", to->adresseIP, to->port);
-			close (to->fd);
-			CServerTcpIP_DelClient (this, to);
-			return -1;
+	}
+
+	/*
+	 *	Unicast
+	 */
+	pthread_mutex_lock (&to->worker->m_mutex);
+	ret = CServerTcpIP_Enqueue (this, to, buffer, buffer_size, origin);
+	pthread_mutex_unlock (&to->worker->m_mutex);
+	return ret;
+}
+
+static int
+CServerTcpIP_Send (CServerTcpIP* this, Client *to, char *buffer, unsigned int buffer_size)
+{
+	return CServerTcpIP_SendFrom (this, to, buffer, buffer_size, NULL);
+}
+
+static void
+CServerTcpIP_GetStats (CServerTcpIP *this, CServerTcpIP_stats_t *stats)
+{
+	CServerTcpIP_Worker *worker;
+	Client *client;
+	unsigned int i, k;
+
+	memset (stats, 0, sizeof (*stats));
+	for (i = 0; i < this->m_uiNbWorkers; i++) {
+		worker = &this->m_workers[i];
+		pthread_mutex_lock (&worker->m_mutex);
+		stats->clients += worker->m_iClientNumber;
+		stats->tx_bytes += worker->m_ulTxBytes;
+		stats->tx_msgs += worker->m_ulTxMsgs;
+		stats->drop_oldest += worker->m_ulDropOldest;
+		stats->drop_newest += worker->m_ulDropNewest;
+		for (k = 0; k < CSERVERTCPIP_DISCONNECT_COUNT; k++)
+			stats->disconnects[k] += worker->m_ulDisconnects[k];
+		for (client = worker->m_clistClients; client != (Client *) NULL; client = client->next)
+			stats->queued += client->txq.len;
+		pthread_mutex_unlock (&worker->m_mutex);
+	}
+}
+
+static void
+CServerTcpIP_ForEach (CServerTcpIP *this, CServerTcpIP_foreach_t fn, void *arg)
+{
+	CServerTcpIP_Worker *worker;
+	Client *client;
+	unsigned int i;
+
+	for (i = 0; i < this->m_uiNbWorkers; i++) {
+		worker = &this->m_workers[i];
+		pthread_mutex_lock (&worker->m_mutex);
+		for (client = worker->m_clistClients; client != (Client *) NULL; client = client->next) {
+			if (!client->closing)
+				fn (this, client, arg);
 		}
+		pthread_mutex_unlock (&worker->m_mutex);
 	}
-	return buffer_size;
+}
+
+/*
+ *	Les réglages sont lus par les workers sous leur mutex : chacun est verrouillé tour à tour
+ */
+static void
+CServerTcpIP_SetDisconnectCallback (CServerTcpIP *this, CServerTcpIP_connect_t disconnect_callback)
+{
+	unsigned int i;
+
+	for (i = 0; i < this->m_uiNbWorkers; i++)
+		pthread_mutex_lock (&this->m_workers[i].m_mutex);
+	this->m_disconnect_callback = disconnect_callback;
+	for (i = this->m_uiNbWorkers; i-- > 0;)
+		pthread_mutex_unlock (&this->m_workers[i].m_mutex);
+}
+
+static void
+CServerTcpIP_SetDrainCallback (CServerTcpIP *this, CServerTcpIP_connect_t drain_callback)
+{
+	unsigned int i;
+
+	for (i = 0; i < this->m_uiNbWorkers; i++)
+		pthread_mutex_lock (&this->m_workers[i].m_mutex);
+	this->m_drain_callback = drain_callback;
+	for (i = this->m_uiNbWorkers; i-- > 0;)
+		pthread_mutex_unlock (&this->m_workers[i].m_mutex);
+}
+
+static void
+CServerTcpIP_SetTxQueue (CServerTcpIP *this, unsigned int size, CServerTcpIP_policy_t policy)
+{
+	unsigned int i;
+
+	for (i = 0; i < this->m_uiNbWorkers; i++)
+		pthread_mutex_lock (&this->m_workers[i].m_mutex);
+	this->m_uiTxQueueSize = size;
+	this->m_TxPolicy = policy;
+	for (i = this->m_uiNbWorkers; i-- > 0;)
+		pthread_mutex_unlock (&this->m_workers[i].m_mutex);
+}
+
+/*
+ *	Allocation des workers : mutex récursif, un callback pouvant appeler Send depuis une section
+ *	déjà verrouillée
+ */
+static CServerTcpIP_Worker *
+CServerTcpIP_WorkersNew (CServerTcpIP *this, unsigned int nb_workers)
+{
+	pthread_mutexattr_t attr;
+	CServerTcpIP_Worker *workers;
+	unsigned int i;
+
+	workers = (CServerTcpIP_Worker *) calloc (nb_workers, sizeof (CServerTcpIP_Worker));
+	if (workers == (CServerTcpIP_Worker *) NULL)
+		return NULL;
+
+	pthread_mutexattr_init (&attr);
+	pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+	for (i = 0; i < nb_workers; i++) {
+		workers[i].m_server = this;
+		workers[i].m_fdListen = -1;
+		workers[i].m_fdEpoll = -1;
+		workers[i].m_fdWake = -1;
+		pthread_mutex_init (&workers[i].m_mutex, &attr);
+	}
+	pthread_mutexattr_destroy (&attr);
+
+	return workers;
+}
+
+static void
+CServerTcpIP_WorkersFree (CServerTcpIP_Worker *workers, unsigned int nb_workers)
+{
+	unsigned int i;
+
+	for (i = 0; i < nb_workers; i++)
+		pthread_mutex_destroy (&workers[i].m_mutex);
+	free (workers);
 }
 
 static int
-CServerTcpIP_Start (CServerTcpIP *this, unsigned short port)
+CServerTcpIP_SetWorkers (CServerTcpIP *this, unsigned int nb_workers)
+{
+	CServerTcpIP_Worker *workers;
+
+	if (this->m_iStarted) {
+		DEBUG ("Workers can't be changed while the server is started\n");
+		return -1;
+	}
+
+	if (nb_workers == 0 || nb_workers > CSERVERTCPIP_MAX_WORKERS) {
+		DEBUG ("Invalid number of workers: %u\n", nb_workers);
+		return -1;
+	}
+
+	workers = CServerTcpIP_WorkersNew (this, nb_workers);
+	if (workers == (CServerTcpIP_Worker *) NULL)
+		return -1;
+
+	CServerTcpIP_WorkersFree (this->m_workers, this->m_uiNbWorkers);
+	this->m_workers = workers;
+	this->m_uiNbWorkers = nb_workers;
+	return 0;
+}
+
+/*
+ *	Fonction	: worker start
+ *	Description	: Ouvre la socket d'écoute et l'instance epoll d'un worker puis lance son thread.
+ *			  Avec plusieurs workers, chaque socket est liée au même port grâce à SO_REUSEPORT
+ *			  et le noyau répartit les connexions entre elles.
+ */
+static int
+CServerTcpIP_WorkerStart (CServerTcpIP_Worker *worker, unsigned short port, int reuseport)
 {
 	int ret;
 	int sock_opt;
 	struct sockaddr_in addr_serv;
-	
-	/* Check for multiple call */
-	if (this->m_fdListen >= 0) {
-		DEBUG ("Listen socket already opened.\n");
-		return 0;
-	}
+	struct epoll_event ev;
 
 	/* Init a socket */
-	this->m_fdListen = socket (PF_INET, SOCK_STREAM, 0);
-	if (this->m_fdListen < 0) {
+	worker->m_fdListen = socket (PF_INET, SOCK_STREAM, 0);
+	if (worker->m_fdListen < 0) {
 		DEBUG ("Can't create the socket\n");
 		return -1;
 	}
@@ -433,30 +1030,69 @@ CServerTcpIP_Start (CServerTcpIP *this, unsigned short port)
 	 *	if sock_opt = 0 - Doesn't
 	 */
 	sock_opt = 1;	
-	ret = setsockopt (this->m_fdListen, SOL_SOCKET, SO_REUSEADDR, (void *) &sock_opt, sizeof (sock_opt));
+	ret = setsockopt (worker->m_fdListen, SOL_SOCKET, SO_REUSEADDR, (void *) &sock_opt, sizeof (sock_opt));
 	if (ret != 0) {
 		DEBUG ("Error on setsockopt with command SO_REUSEADDR and arg=%d\n", sock_opt);
 	}
 
+	/* SO_REUSEPORT : une socket d'écoute par worker sur le même port */
+	if (reuseport) {
+		ret = setsockopt (worker->m_fdListen, SOL_SOCKET, SO_REUSEPORT, (void *) &sock_opt, sizeof (sock_opt));
+		if (ret != 0) {
+			DEBUG ("Error on setsockopt with command SO_REUSEPORT\n");
+			goto socket_error;
+		}
+	}
+
 	/* Bind */
 	addr_serv.sin_family = AF_INET;	 
    	addr_serv.sin_addr.s_addr = htonl(INADDR_ANY);
    	addr_serv.sin_port = htons (port);
-   	ret = bind (this->m_fdListen, (struct sockaddr *) &addr_serv, sizeof(addr_serv));
+   	ret = bind (worker->m_fdListen, (struct sockaddr *) &addr_serv, sizeof(addr_serv));
 	if (ret < 0) {
 		DEBUG ("Error on bind\n");
 		goto socket_error;
 	}
 
 	/* Listen */	
-	ret = listen (this->m_fdListen, CSERVERTCPIP_LISTEN_QUEUE_SIZE);
+	ret = listen (worker->m_fdListen, CSERVERTCPIP_LISTEN_QUEUE_SIZE);
 	if (ret < 0) {
 		DEBUG ("Error on listen\n");
 		goto socket_error;
 	}
 
+	/* Epoll : la socket d'écoute et l'eventfd de réveil sont enregistrés une fois pour toutes */
+	worker->m_fdEpoll = epoll_create1 (EPOLL_CLOEXEC);
+	if (worker->m_fdEpoll < 0) {
+		DEBUG ("Error on epoll_create1\n");
+		goto socket_error;
+	}
+
+	worker->m_fdWake = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (worker->m_fdWake < 0) {
+		DEBUG ("Error on eventfd\n");
+		goto epoll_error;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	ret = epoll_ctl (worker->m_fdEpoll, EPOLL_CTL_ADD, worker->m_fdListen, &ev);
+	if (ret < 0) {
+		DEBUG ("Error on epoll_ctl for the listen socket\n");
+		goto wake_error;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &worker->m_fdWake;
+	ret = epoll_ctl (worker->m_fdEpoll, EPOLL_CTL_ADD, worker->m_fdWake, &ev);
+	if (ret < 0) {
+		DEBUG ("Error on epoll_ctl for the wake eventfd\n");
+		goto wake_error;
+	}
+
 	/* Run listen thread */
-	ret = pthread_create(&(this->m_threadListen), NULL, CServerTcpIP_Runtime, this);
+	worker->m_iRunning = 1;
+	ret = pthread_create(&(worker->m_thread), NULL, CServerTcpIP_Runtime, worker);
 	if (ret != 0) {
 		DEBUG ("Error on pthread_create\n");
 		goto thread_error;
@@ -465,20 +1101,54 @@ CServerTcpIP_Start (CServerTcpIP *this, unsigned short port)
 	return 0;
 
 thread_error:
-	shutdown (this->m_fdListen, SHUT_RDWR);
+	worker->m_iRunning = 0;
+	shutdown (worker->m_fdListen, SHUT_RDWR);
+
+wake_error:
+	close (worker->m_fdWake);
+	worker->m_fdWake = -1;
+
+epoll_error:
+	close (worker->m_fdEpoll);
+	worker->m_fdEpoll = -1;
 	
 socket_error:
-	close (this->m_fdListen);
-	this->m_fdListen = -1;
+	close (worker->m_fdListen);
+	worker->m_fdListen = -1;
 	return -1;
 }
 
+static int
+CServerTcpIP_Start (CServerTcpIP *this, unsigned short port)
+{
+	unsigned int i;
+
+	/* Check for multiple call */
+	if (this->m_iStarted) {
+		DEBUG ("Listen socket already opened.\n");
+		return 0;
+	}
+
+	for (i = 0; i < this->m_uiNbWorkers; i++) {
+		if (CServerTcpIP_WorkerStart (&this->m_workers[i], port, this->m_uiNbWorkers > 1) < 0) {
+			/* Arrêt des workers déjà lancés */
+			while (i-- > 0)
+				CServerTcpIP_WorkerStop (&this->m_workers[i]);
+			return -1;
+		}
+	}
+
+	this->m_iStarted = 1;
+	return 0;
+}
+
 static void
 CServerTcpIP_Free (CServerTcpIP *this)
 {
 	/* Close all conections */
 	CServerTcpIP_Stop (this);
 
+	CServerTcpIP_WorkersFree (this->m_workers, this->m_uiNbWorkers);
 	free (this);
 }
 
@@ -493,19 +1163,37 @@ CServerTcpIP_New (CServerTcpIP_rx_t rx_callback, CServerTcpIP_connect_t connect_
 	/* Save data */
 	this->m_callback = rx_callback;
 	this->m_connect_callback = connect_callback;
+	this->m_disconnect_callback = NULL;
+	this->m_drain_callback = NULL;
 	this->m_pvPrivateData = pdata;
 
 	/* Methods connection */
 	this->Free = CServerTcpIP_Free;
 	this->Send = CServerTcpIP_Send;
+	this->SendFrom = CServerTcpIP_SendFrom;
+	this->SetTxQueue = CServerTcpIP_SetTxQueue;
+	this->ForEach = CServerTcpIP_ForEach;
+	this->SetDisconnectCallback = CServerTcpIP_SetDisconnectCallback;
+	this->SetDrainCallback = CServerTcpIP_SetDrainCallback;
 	this->GetNbClientsConnected = CServerTcpIP_GetNbClientsConnected;
+	this->SetWorkers = CServerTcpIP_SetWorkers;
+	this->GetStats = CServerTcpIP_GetStats;
 	this->Start = CServerTcpIP_Start;
+	this->Attach = CServerTcpIP_Attach;
 	this->Stop = CServerTcpIP_Stop;
 
 	/* Init */
-	this->m_clistClients = NULL;
-	this->m_iClientNumber = 0;
-	this->m_fdListen = -1;
+	this->m_iStarted = 0;
+	this->m_uiTxQueueSize = CSERVERTCPIP_TX_QUEUE_SIZE;
+	this->m_TxPolicy = CSERVERTCPIP_TX_QUEUE_POLICY;
+
+	/* Un seul worker par défaut : un thread d'écoute, sans SO_REUSEPORT */
+	this->m_uiNbWorkers = 1;
+	this->m_workers = CServerTcpIP_WorkersNew (this, this->m_uiNbWorkers);
+	if (this->m_workers == (CServerTcpIP_Worker *) NULL) {
+		free (this);
+		return NULL;
+	}
 
 	return this;
 }
@@ -37,23 +37,114 @@ extern "C" {
 #endif
 
 #include <pthread.h>
+#include <sys/time.h>
+
+/*
+ *	Politique appliquée lorsque la file d'émission d'un client est pleine
+ */
+typedef enum {
+	CSERVERTCPIP_QUEUE_DROP_OLDEST,		/* Supprime les plus anciens messages pas encore entamés */
+	CSERVERTCPIP_QUEUE_DROP_NEWEST,		/* Ignore le message à envoyer */
+	CSERVERTCPIP_QUEUE_DISCONNECT		/* Coupe la connexion du client */
+} CServerTcpIP_policy_t;
+
+/*
+ *	Cause de la déconnexion d'un client
+ */
+typedef enum {
+	CSERVERTCPIP_DISCONNECT_PEER,		/* Fermeture par le client */
+	CSERVERTCPIP_DISCONNECT_ERROR,		/* Erreur de lecture ou d'écriture sur la socket */
+	CSERVERTCPIP_DISCONNECT_QUEUE,		/* File d'émission pleine (politique DISCONNECT) */
+	CSERVERTCPIP_DISCONNECT_STOP,		/* Arrêt du serveur */
+	CSERVERTCPIP_DISCONNECT_COUNT
+} CServerTcpIP_reason_t;
+
+/*
+ *	Structure TxQueue
+ *	File d'émission bornée d'un client, vidée par le thread d'écoute lorsque la socket est prête (EPOLLOUT).
+ *	Les octets sont stockés dans un tampon circulaire, les longueurs des messages dans un second anneau
+ *	afin de ne jamais supprimer un message partiellement envoyé.
+ */
+typedef struct _TxQueue TxQueue;
+struct _TxQueue {
+	char *data;			/* Tampon circulaire des octets en attente (alloué au premier besoin) */
+	unsigned int size;		/* Capacité du tampon en octets */
+	unsigned int head;		/* Position du premier octet à envoyer */
+	unsigned int len;		/* Nombre d'octets en attente */
+	unsigned int *msg;		/* Longueur des messages en attente (reste à envoyer pour le premier) */
+	struct timeval *msg_origin;	/* Date d'origine de chaque message, pour la latence (tv_sec = 0 : non mesuré) */
+	unsigned int msg_size;		/* Capacité de l'anneau des longueurs */
+	unsigned int msg_head;		/* Indice du premier message */
+	unsigned int msg_count;		/* Nombre de messages en attente */
+	int started;			/* 1 si le premier message est partiellement envoyé */
+};
 
 /* 
  *	Structure Client
  *	Represente les informations d'un client TCP/IP en particulier: IP / port
  */
 typedef struct _Client Client;
+typedef struct _CServerTcpIP CServerTcpIP;
+typedef struct _CServerTcpIP_Worker CServerTcpIP_Worker;
+
 struct _Client {
 	int fd;				/* file descripteur du client */
+	CServerTcpIP_Worker *worker;	/* Worker propriétaire du client (socket d'écoute, epoll, liste) */
 	char *adresseIP;	/* Adresse IP du client connecté */
 	unsigned int port;	/* Port distant du client (different du port local du serveur) */
 	Client *next;		/* pointeur sur le client suivant: liste chaînée */
+	Client *prev;		/* pointeur sur le client précédent: retrait en O(1) */
+	TxQueue txq;		/* File d'émission du client */
+	int txarmed;		/* 1 si EPOLLOUT est surveillé pour ce client */
+	int closing;		/* 1 si la connexion doit être fermée par le thread d'écoute */
+	unsigned long drop_oldest;	/* Nombre de messages supprimés (politique DROP_OLDEST) */
+	unsigned long drop_newest;	/* Nombre de messages ignorés (politique DROP_NEWEST) */
+	unsigned long tx_bytes;		/* Nombre d'octets écrits sur la socket */
+	unsigned long tx_msgs;		/* Nombre de messages entièrement écrits sur la socket */
+	CServerTcpIP_reason_t reason;	/* Cause de la fermeture, valide si closing */
+	void *pdata;		/* Pointeur optionnel propre à l'application, associé au client */
 }; 
 
-typedef struct _CServerTcpIP CServerTcpIP;
+/*
+ *	Structure Worker
+ *	Thread d'écoute du serveur : sa propre socket d'écoute (SO_REUSEPORT lorsqu'il y a plusieurs
+ *	workers), sa propre instance epoll et sa propre liste de clients, protégée par son mutex.
+ *	Le noyau répartit les connexions entrantes entre les sockets d'écoute des workers.
+ */
+struct _CServerTcpIP_Worker {
+	CServerTcpIP *m_server;		/* Serveur propriétaire */
+	int m_fdListen;			/* Descripteur de la socket d'écoute */
+	int m_fdEpoll;			/* Instance epoll du worker */
+	int m_fdWake;			/* eventfd de réveil du worker (arrêt) */
+	volatile int m_iRunning;	/* 1 tant que le worker doit tourner */
+	pthread_t m_thread;		/* Le thread qui accepte les connexions et lit les clients du worker */
+	Client *m_clistClients;		/* Liste chainée des clients du worker */
+	int m_iClientNumber;		/* Taille de la liste chainée */
+	pthread_mutex_t m_mutex;	/* Protège la liste des clients et leurs files d'émission */
+	unsigned long m_ulDropOldest;	/* Nombre de messages supprimés (DROP_OLDEST) */
+	unsigned long m_ulDropNewest;	/* Nombre de messages ignorés (DROP_NEWEST) */
+	unsigned long m_ulTxBytes;	/* Nombre d'octets écrits, tous clients confondus */
+	unsigned long m_ulTxMsgs;	/* Nombre de messages écrits, tous clients confondus */
+	unsigned long m_ulDisconnects[CSERVERTCPIP_DISCONNECT_COUNT];	/* Déconnexions par cause */
+};
+
+/*
+ *	Compteurs du serveur, agrégés sur tous les workers depuis la création de l'objet
+ */
+typedef struct {
+	int clients;			/* Clients connectés */
+	unsigned long tx_bytes;		/* Octets écrits */
+	unsigned long tx_msgs;		/* Messages écrits */
+	unsigned long queued;		/* Octets en attente dans les files d'émission */
+	unsigned long drop_oldest;	/* Messages supprimés (DROP_OLDEST) */
+	unsigned long drop_newest;	/* Messages ignorés (DROP_NEWEST) */
+	unsigned long disconnects[CSERVERTCPIP_DISCONNECT_COUNT];	/* Déconnexions par cause */
+} CServerTcpIP_stats_t;
 
 /* 
  *	Prototype de fonction de Callback lors de la connexion d'un client IP sur l'objet CServerTcpIP
+ *	Le callback de connexion est appelé avant que le client ne soit servi : aucune donnée n'est reçue
+ *	ni envoyée vers ce client avant son retour, 'from->pdata' peut donc y être initialisé.
  *
  *  this:			Pointeur sur l'objet de type CServerTcpIP	
  *	from:			Pointeur sur objet de type Client identifiant le client IP qui s'est connecté
@@ -65,7 +156,7 @@ typedef void (*CServerTcpIP_connect_t) (CServerTcpIP *this, Client *from, void *
 /* 
  *	Prototype de fonction de Callback pour la réception de data d'un client IP sur l'objet CServerTcpIP
  *
- *	Buffer:			Pointer on received data
+ *	Buffer:			Pointer on received data (not NUL terminated, writable)
  *	Buffer_size:	Size of received data
  *  this:			Pointeur sur l'objet de type CServerTcpIP	
  *	from:			Pointeur sur objet de type Client identifiant le client IP qui a envoyé la data
@@ -74,6 +165,16 @@ typedef void (*CServerTcpIP_connect_t) (CServerTcpIP *this, Client *from, void *
 typedef void (*CServerTcpIP_rx_t) (char *buffer, unsigned int buffer_size, CServerTcpIP *this, Client *from, void *pdata);
 
 
+/* 
+ *	Prototype de fonction appelée pour chaque client connecté par la méthode ForEach
+ *
+ *  this:			Pointeur sur l'objet de type CServerTcpIP	
+ *	client:			Pointeur sur objet de type Client
+ *	arg:			Argument donné à ForEach
+ */
+typedef void (*CServerTcpIP_foreach_t) (CServerTcpIP *this, Client *client, void *arg);
+
+
 /******************************************************************************
  *
  *	Structure de donnée de la classe CServerTcpIP 
@@ -90,14 +191,44 @@ struct _CServerTcpIP {
 	void (*Free) (CServerTcpIP *this);
 
 	// Fonction d'envoi TCP/IP de données de l'objet CServerTcpIP au client 'destinataire'
+	// La donnée est placée dans la file d'émission du client : l'appel n'est jamais bloquant.
 	//	-destinataire:	pointeur sur un objet Client cible ou tous les clients connectés si NULL (BROADCAST)
 	//	-buffer:		adresse de la data à envoyer
 	//	-buffer_size:	nb d'octets de 'buffer' à envoyer
 	//	-retour:		-1 si erreur, buffer_size si ok
 	int (*Send) (CServerTcpIP *this, Client *destinataire, char *buffer, unsigned int buffer_size);
 
-	// Renvoie à tout moment le nb de clients connectés au serveur
+	// Comme Send, en mesurant la latence depuis 'origin' (date d'arrivée de la donnée) à la mise en
+	// file et à l'écriture sur la socket (histogrammes LATHIST_ENQUEUE et LATHIST_WRITE)
+	int (*SendFrom) (CServerTcpIP *this, Client *destinataire, char *buffer, unsigned int buffer_size,
+	                 const struct timeval *origin);
+
+	// Configure les files d'émission des clients (prise en compte pour les prochaines connexions)
+	//	-size:			capacité de la file en octets
+	//	-policy:		comportement lorsque la file est pleine
+	void (*SetTxQueue) (CServerTcpIP *this, unsigned int size, CServerTcpIP_policy_t policy);
+
+	// Appelle 'fn' pour chaque client connecté, liste de son worker verrouillée : 'fn' peut appeler Send
+	// sur ce client, mais pas de broadcast lorsqu'il y a plusieurs workers
+	void (*ForEach) (CServerTcpIP *this, CServerTcpIP_foreach_t fn, void *arg);
+
+	// Enregistre une callback appelée lors de la déconnexion d'un client, juste avant sa libération
+	// (liste du worker verrouillée, mêmes restrictions que ForEach)
+	void (*SetDisconnectCallback) (CServerTcpIP *this, CServerTcpIP_connect_t disconnect_callback);
+
+	// Enregistre une callback appelée lorsque la file d'émission d'un client vient d'être vidée
+	// (socket de nouveau disponible, liste du worker verrouillée) : elle peut appeler Send sur ce client
+	void (*SetDrainCallback) (CServerTcpIP *this, CServerTcpIP_connect_t drain_callback);
+
+	// Renvoie à tout moment le nb de clients connectés au serveur, tous workers confondus
 	int (*GetNbClientsConnected) (CServerTcpIP *this);
+
+	// Relève les compteurs du serveur, agrégés sur les workers
+	void (*GetStats) (CServerTcpIP *this, CServerTcpIP_stats_t *stats);
+
+	// Fixe le nombre de threads d'écoute, chacun avec sa socket SO_REUSEPORT (1 par défaut)
+	//	-retour:		-1 si erreur ou serveur démarré, 0 si ok
+	int (*SetWorkers) (CServerTcpIP *this, unsigned int nb_workers);
 	
 	// Démarre l'écoute de l'objet serveur CServerTcpIP sur le port: 'port'
 	//	-retour:		-1 si erreur, 0 si ok
@@ -107,15 +238,24 @@ struct _CServerTcpIP {
 	//	-retour:		-1 si erreur, 0 si ok
 	int (*Stop) (CServerTcpIP *this);
 
+	// Sert un descripteur déjà connecté (socketpair, socket héritée...) comme un client accepté,
+	// sur le worker le moins chargé ; le serveur doit être démarré
+	//	-name:			nom du client (champ adresseIP), "local" si NULL
+	//	-retour:		-1 si erreur, 0 si ok (le fd appartient alors au serveur)
+	int (*Attach) (CServerTcpIP *this, int fd, const char *name);
+
 	 /* Attributs */
 	 /*************/
-	int m_fdListen;			/* Descripteur de la socket d'écoute */
-	pthread_t m_threadListen;	/* Le thread qui écoute et répond aux demandes de connexions des clients */
-	Client *m_clistClients;		/* Liste chainée des clients connectés */
-	int m_iClientNumber;		/* Taille de la liste chainée */
+	CServerTcpIP_Worker *m_workers;	/* Threads d'écoute et leurs clients */
+	unsigned int m_uiNbWorkers;	/* Nombre de workers */
+	int m_iStarted;			/* 1 si les sockets d'écoute sont ouvertes */
 	CServerTcpIP_rx_t m_callback;	/* Fonction de callback pour le traitement des données reçues */
 	CServerTcpIP_connect_t m_connect_callback;	/* Fonction de callback pour les demandes de connexions clients */
+	CServerTcpIP_connect_t m_disconnect_callback;	/* Fonction de callback pour les déconnexions clients */
+	CServerTcpIP_connect_t m_drain_callback;	/* Fonction de callback pour les files d'émission vidées */
 	void *m_pvPrivateData;		/* Pointeur optionnel donné au constructeur et repassé aux callbacks */
+	unsigned int m_uiTxQueueSize;	/* Capacité des files d'émission en octets */
+	CServerTcpIP_policy_t m_TxPolicy;	/* Politique de file pleine */
 };
 
 /*
@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Banc de mesure de bout en bout sans matériel CAN : crée une interface vcan,
+# y démarre CAN-TCP puis lance canbench sur chaque encodage.
+#
+# Variables : IFACE (vcanbench), RATE (trames/s, 10000), DURATION (s, 10),
+# CLIENTS (4), WORKERS (1), MODES ("xml json candump csv bin")
+# CAN-TCP écoute toujours sur le port 1234, celui de canbench par défaut.
+#
+# Nécessite les droits root (ou sudo) pour le module vcan et l'interface.
+#
+
+IFACE=${IFACE:-vcanbench}
+RATE=${RATE:-10000}
+DURATION=${DURATION:-10}
+CLIENTS=${CLIENTS:-4}
+WORKERS=${WORKERS:-1}
+MODES=${MODES:-xml json candump csv bin}
+
+SERVER=./CAN-TCP
+BENCH=${BENCH:-.build/canbench}
+
+if [ "$(id -u)" -eq 0 ]; then SUDO=; else SUDO=sudo; fi
+
+$SUDO modprobe vcan || exit 1
+if ! ip link show "$IFACE" >/dev/null 2>&1; then
+	$SUDO ip link add dev "$IFACE" type vcan || exit 1
+	CREATED=1
+fi
+# File d'émission assez longue pour absorber les paquets du générateur
+$SUDO ip link set "$IFACE" txqueuelen 10000
+$SUDO ip link set "$IFACE" up || exit 1
+
+$SERVER -w "$WORKERS" "$IFACE" >/dev/null &
+PID=$!
+
+cleanup() {
+	kill "$PID" 2>/dev/null
+	wait "$PID" 2>/dev/null
+	if [ -n "$CREATED" ]; then $SUDO ip link del dev "$IFACE"; fi
+}
+trap cleanup EXIT INT TERM
+
+$BENCH -i "$IFACE" -r "$RATE" -d "$DURATION" -c "$CLIENTS" -P "$PID" $MODES
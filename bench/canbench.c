@@ -0,0 +1,419 @@
+/**
+ * @file canbench.c
+ *
+ * @brief Banc de mesure de bout en bout : bus CAN virtuel -> CAN-TCP -> clients TCP.
+ *
+ * Pour chaque encodage demandé, le banc connecte N clients TCP au serveur,
+ * leur fait négocier l'encodage, puis génère des trames sur l'interface CAN
+ * (vcan) à un débit donné pendant une durée donnée. Il mesure :
+ * - le débit soutenu reçu par les clients, en trames par seconde ;
+ * - le temps CPU du serveur par trame générée (si son pid est donné) ;
+ * - les pertes : refus d'émission sur le bus, trames manquantes chez les
+ *   clients, compteurs "stats" du serveur ;
+ * - les percentiles de latence du serveur (commande "latency").
+ *
+ * Utilisation : canbench [-i iface] [-p port] [-r trames/s] [-d secondes]
+ *                        [-c clients] [-P pid] [encodage ...]
+ *
+ * Le serveur doit déjà écouter l'interface : voir bench/bench.sh.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+/** @brief Nombre maximal de clients TCP */
+#define BENCH_MAX_CLIENTS 256
+/** @brief Taille d'un enregistrement binaire (canbin.h) */
+#define BENCH_BIN_RECORD 24
+/** @brief Période du générateur en ns */
+#define BENCH_TICK_NS 1000000L
+
+/**
+* @brief Paramètres du banc
+*/
+struct bench
+{
+    const char * iface;		/*!< Interface CAN générée */
+    unsigned short port;	/*!< Port du serveur */
+    unsigned long rate;		/*!< Trames générées par seconde */
+    unsigned int duration;	/*!< Durée de la génération en secondes */
+    unsigned int clients;	/*!< Nombre de clients TCP */
+    int pid;			/*!< pid du serveur, 0 si inconnu */
+};
+
+/**
+* @brief Etat du générateur de trames
+*/
+struct generateur
+{
+    const struct bench * b;	/*!< Paramètres */
+    int fd;			/*!< Socket CAN brut */
+    unsigned long sent;		/*!< Trames émises */
+    unsigned long refused;	/*!< Trames refusées par le noyau (file d'émission pleine) */
+};
+
+
+/** @brief Date courante en ns (CLOCK_MONOTONIC) */
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/** @brief Temps CPU consommé par un processus, en secondes */
+static double cpu_time(int pid)
+{
+    char path[64];
+    unsigned long utime, stime;
+    FILE * f;
+    int ok;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if((f = fopen(path, "r")) == NULL) return 0;
+    /* Champs 14 et 15 : utime et stime, en ticks */
+    ok = fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                &utime, &stime);
+    fclose(f);
+    if(ok != 2) return 0;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+
+/** @brief Ouvre une connexion TCP sur le serveur local */
+static int tcp_connect(unsigned short port)
+{
+    struct sockaddr_in addr;
+    int fd;
+
+    if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+
+/**
+* @brief Envoie une commande et lit la réponse
+*
+* La réponse est lue jusqu'à ce que le serveur se taise 300 ms.
+*
+* @returns le nombre d'octets de la réponse, terminée par un '\0'
+*/
+static size_t commande(int fd, const char * cmd, char * rep, size_t taille)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    size_t len = 0;
+    ssize_t n;
+
+    if(write(fd, cmd, strlen(cmd)) < 0) perror("write");
+    while(len + 1 < taille && poll(&pfd, 1, 300) > 0)
+    {
+	if((n = read(fd, rep + len, taille - 1 - len)) <= 0) break;
+	len += n;
+    }
+    rep[len] = '\0';
+    return len;
+}
+
+
+/** @brief Ouvre le socket CAN brut d'émission */
+static int can_open(const char * iface)
+{
+    struct sockaddr_can addr;
+    struct ifreq ifr;
+    int fd;
+
+    if((fd = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0)
+    {
+	perror("socket CAN");
+	return -1;
+    }
+    /* Aucune trame à recevoir */
+    setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, iface, IFNAMSIZ - 1);
+    if(ioctl(fd, SIOCGIFINDEX, &ifr) < 0)
+    {
+	perror(iface);
+	close(fd);
+	return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+	perror("bind CAN");
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+
+/**
+* @brief Thread générateur : rate trames/s, cadencées par paquets chaque milliseconde
+*
+* Les identifiants parcourent 0x100..0x1FF, les données portent un numéro de
+* séquence.
+*/
+static void * generateur_fct(void * arg)
+{
+    struct generateur * g = arg;
+    struct can_frame cf;
+    struct timespec echeance;
+    unsigned long long total, dues;
+    unsigned long ticks, t;
+    unsigned int i;
+
+    ticks = g->b->duration * (1000000000L / BENCH_TICK_NS);
+    total = 0;
+    memset(&cf, 0, sizeof(cf));
+    cf.can_dlc = 8;
+    clock_gettime(CLOCK_MONOTONIC, &echeance);
+
+    for(t = 1; t <= ticks; t++)
+    {
+	/* Trames dues depuis le début : pas de dérive sur les débits non entiers */
+	dues = (unsigned long long)g->b->rate * t / (1000000000L / BENCH_TICK_NS);
+	while(total < dues)
+	{
+	    cf.can_id = 0x100 + (total & 0xFF);
+	    for(i = 0; i < 8; i++)
+		cf.data[i] = total >> (8 * i);
+	    if(write(g->fd, &cf, sizeof(cf)) != sizeof(cf))
+	    {
+		if(errno != ENOBUFS && errno != EAGAIN)
+		{
+		    perror("write CAN");
+		    return NULL;
+		}
+		g->refused++;
+	    }
+	    else g->sent++;
+	    total++;
+	}
+
+	echeance.tv_nsec += BENCH_TICK_NS;
+	if(echeance.tv_nsec >= 1000000000L)
+	{
+	    echeance.tv_nsec -= 1000000000L;
+	    echeance.tv_sec++;
+	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &echeance, NULL);
+    }
+    return NULL;
+}
+
+
+/**
+* @brief Mesure un encodage
+*
+* @returns 0 si OK, 1 si erreur
+*/
+static int mesure(const struct bench * b, const char * mode)
+{
+    static int fds[BENCH_MAX_CLIENTS];
+    static unsigned long long recu[BENCH_MAX_CLIENTS];
+    static char tampon[1 << 16];
+    char cmd[64];
+    struct pollfd pfd[BENCH_MAX_CLIENTS];
+    struct generateur g;
+    pthread_t thread;
+    long long debut, dernier, fin_gen;
+    unsigned long long trames, attendues;
+    double cpu0 = 0, cpu1 = 0, duree;
+    int ctrl, binaire, ret = 1, generation;
+    unsigned int i;
+    ssize_t n;
+    char * p;
+
+    binaire = (strcmp(mode, "bin") == 0);
+
+    /* Client de contrôle : ne reçoit aucune trame (identifiant 0 jamais généré) */
+    if((ctrl = tcp_connect(b->port)) < 0)
+    {
+	perror("connexion au serveur");
+	return 1;
+    }
+    commande(ctrl, "subscribe 0", tampon, sizeof(tampon));
+
+    for(i = 0; i < b->clients; i++)
+    {
+	if((fds[i] = tcp_connect(b->port)) < 0)
+	{
+	    perror("connexion au serveur");
+	    goto fin;
+	}
+	snprintf(cmd, sizeof(cmd), "mode %s", mode);
+	commande(fds[i], cmd, tampon, sizeof(tampon));
+	if(strncmp(tampon, cmd, strlen(cmd)) != 0)
+	{
+	    fprintf(stderr, "Encodage %s refusé : %s", mode, tampon);
+	    i++;
+	    goto fin;
+	}
+	recu[i] = 0;
+	pfd[i].fd = fds[i];
+	pfd[i].events = POLLIN;
+    }
+
+    commande(ctrl, "latency reset", tampon, sizeof(tampon));
+
+    memset(&g, 0, sizeof(g));
+    g.b = b;
+    if((g.fd = can_open(b->iface)) < 0) goto fin;
+
+    if(b->pid) cpu0 = cpu_time(b->pid);
+    debut = dernier = now_ns();
+    if(pthread_create(&thread, NULL, generateur_fct, &g) != 0)
+    {
+	close(g.fd);
+	goto fin;
+    }
+
+    /* Réception jusqu'à la fin de la génération, puis jusqu'à 1 s de silence */
+    generation = 1;
+    fin_gen = 0;
+    for(;;)
+    {
+	if(generation && now_ns() - debut >= (long long)b->duration * 1000000000LL)
+	{
+	    pthread_join(thread, NULL);
+	    generation = 0;
+	    fin_gen = now_ns();
+	}
+	if(!generation && now_ns() - (dernier > fin_gen ? dernier : fin_gen) > 1000000000LL)
+	    break;
+
+	if(poll(pfd, b->clients, 100) <= 0) continue;
+	for(i = 0; i < b->clients; i++)
+	{
+	    if(!(pfd[i].revents & POLLIN)) continue;
+	    if((n = read(fds[i], tampon, sizeof(tampon))) <= 0)
+	    {
+		pfd[i].fd = -1;
+		continue;
+	    }
+	    dernier = now_ns();
+	    if(binaire)
+		recu[i] += n;
+	    else
+		for(p = tampon; (p = memchr(p, '\n', tampon + n - p)) != NULL; p++)
+		    recu[i]++;
+	}
+    }
+    if(b->pid) cpu1 = cpu_time(b->pid);
+    close(g.fd);
+
+    trames = 0;
+    for(i = 0; i < b->clients; i++)
+	trames += binaire ? recu[i] / BENCH_BIN_RECORD : recu[i];
+    attendues = (unsigned long long)g.sent * b->clients;
+    duree = (dernier - debut) / 1e9;
+
+    printf("== %s : %u clients, %lu trames/s demandées pendant %u s\n",
+           mode, b->clients, b->rate, b->duration);
+    printf("généré     %lu trames, %lu refusées par le bus\n", g.sent, g.refused);
+    printf("reçu       %llu / %llu trames, %llu manquantes\n",
+           trames, attendues, (attendues > trames) ? attendues - trames : 0);
+    printf("débit      %.0f trames/s par client\n",
+           (duree > 0) ? trames / b->clients / duree : 0.0);
+    if(b->pid && g.sent)
+	printf("cpu        %.2f us/trame générée (%.2f s)\n",
+	       (cpu1 - cpu0) * 1e6 / g.sent, cpu1 - cpu0);
+
+    /* Compteurs et latences du serveur */
+    commande(ctrl, "stats", tampon, sizeof(tampon));
+    for(p = strtok(tampon, "\n"); p != NULL; p = strtok(NULL, "\n"))
+	if(strncmp(p, "stats client", 12) != 0)
+	    printf("%s\n", p);
+    commande(ctrl, "latency", tampon, sizeof(tampon));
+    fputs(tampon, stdout);
+    printf("\n");
+    ret = 0;
+
+fin:
+    while(i-- > 0)
+	close(fds[i]);
+    close(ctrl);
+    /* Laisse le serveur retirer les clients avant la mesure suivante */
+    usleep(200000);
+    return ret;
+}
+
+
+int main(int argc, char * argv[])
+{
+    static const char * modes_defaut[] = { "xml", "json", "candump", "csv", "bin" };
+    struct bench b = { "vcan0", 1234, 10000, 10, 4, 0 };
+    char tampon[4096];
+    int opt, ctrl, i, ret = 0;
+
+    while((opt = getopt(argc, argv, "i:p:r:d:c:P:")) != -1)
+    {
+	switch(opt)
+	{
+	case 'i': b.iface = optarg; break;
+	case 'p': b.port = atoi(optarg); break;
+	case 'r': b.rate = strtoul(optarg, NULL, 0); break;
+	case 'd': b.duration = atoi(optarg); break;
+	case 'c': b.clients = atoi(optarg); break;
+	case 'P': b.pid = atoi(optarg); break;
+	default:
+	    fprintf(stderr, "Utilisation : %s [-i iface] [-p port] [-r trames/s] [-d secondes]"
+	            " [-c clients] [-P pid] [encodage ...]\n", argv[0]);
+	    return 1;
+	}
+    }
+    if(b.clients == 0 || b.clients > BENCH_MAX_CLIENTS || b.rate == 0 || b.duration == 0)
+    {
+	fprintf(stderr, "Paramètres invalides\n");
+	return 1;
+    }
+
+    /* Démarrage de la réception CAN du serveur sur toutes ses interfaces, sans
+       enregistrement, en laissant au serveur 5 s pour se mettre à l'écoute */
+    for(i = 0; (ctrl = tcp_connect(b.port)) < 0 && i < 50; i++)
+	usleep(100000);
+    if(ctrl < 0)
+    {
+	perror("connexion au serveur");
+	return 1;
+    }
+    commande(ctrl, "enregistrer", tampon, sizeof(tampon));
+    close(ctrl);
+
+    if(optind < argc)
+	for(i = optind; i < argc; i++)
+	    ret |= mesure(&b, argv[i]);
+    else
+	for(i = 0; i < (int)(sizeof(modes_defaut) / sizeof(*modes_defaut)); i++)
+	    ret |= mesure(&b, modes_defaut[i]);
+
+    return ret;
+}
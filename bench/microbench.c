@@ -0,0 +1,420 @@
+/**
+ * @file microbench.c
+ *
+ * @brief Mesures en processus des fonctions du chemin chaud, sans noyau CAN ni réseau.
+ *
+ * - dispatch : flux de trames synthétiques passé à can_rx_batch, pour
+ *   plusieurs nombres de binds et mélanges de masques ;
+ * - encodage : coût de chaque encodeur frameenc ;
+ * - diffusion : Send en broadcast et parseXML vers N clients socketpair
+ *   confiés au serveur par Attach.
+ *
+ * Chaque mesure donne le temps par trame et le nombre d'allocations par
+ * trame (malloc, calloc et realloc interceptés dans ce programme).
+ *
+ * Utilisation : microbench [-n trames]
+ *
+ * main.c et libcan.c sont inclus dans cette unité de compilation afin
+ * d'appeler directement le dispatch (statique) et la diffusion de main.c.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/* libcan.c d'abord : sa trace de réception dépend de DEBUG, défini par debug.h */
+#include "../libcan.c"
+#define main can_tcp_main
+#include "../main.c"
+#undef main
+
+/** @brief Nombre de trames par mesure par défaut */
+#define MICROBENCH_FRAMES	(1 << 18)
+/** @brief Taille des lots passés à can_rx_batch */
+#define MICROBENCH_BATCH	32
+/** @brief Nombre maximal de clients socketpair */
+#define MICROBENCH_MAX_CLIENTS	64
+/** @brief Trames diffusées entre deux vidages des clients */
+#define MICROBENCH_DRAIN	32
+
+
+/*
+ * Comptage des allocations : interception des fonctions d'allocation de la glibc
+ */
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t nmemb, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+
+static unsigned long nb_alloc = 0;
+
+void * malloc(size_t size)
+{
+    __atomic_fetch_add(&nb_alloc, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t nmemb, size_t size)
+{
+    __atomic_fetch_add(&nb_alloc, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void * realloc(void * ptr, size_t size)
+{
+    __atomic_fetch_add(&nb_alloc, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+
+/**
+* @brief Mesure en cours
+*/
+struct mesure
+{
+    long long debut;		/*!< Date de début en ns */
+    unsigned long alloc;	/*!< Allocations au début */
+};
+
+/** @brief Date courante en ns (CLOCK_MONOTONIC) */
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/** @brief Démarre une mesure */
+static void mesure_debut(struct mesure * m)
+{
+    m->alloc = __atomic_load_n(&nb_alloc, __ATOMIC_RELAXED);
+    m->debut = now_ns();
+}
+
+/** @brief Termine une mesure et affiche le coût par trame */
+static void mesure_fin(const struct mesure * m, const char * nom, const char * variante,
+                       unsigned long trames)
+{
+    long long duree = now_ns() - m->debut;
+    unsigned long alloc = __atomic_load_n(&nb_alloc, __ATOMIC_RELAXED) - m->alloc;
+
+    printf("%-10s %-28s %9.1f ns/trame %8.3f alloc/trame\n", nom, variante,
+           (double)duree / trames, (double)alloc / trames);
+}
+
+
+/*
+ * Flux synthétique : identifiants pseudo-aléatoires sur 11 bits, dates courantes.
+ * flux_fd porte les mêmes trames en CAN FD, 64 octets de données.
+ * flux_eff porte des trames J1939 : identifiants étendus de priorité 6, PGN
+ * parmi FE00 à FEFF, adresse source sur 8 bits.
+ */
+static struct canfd_frame flux[MICROBENCH_BATCH * 64];
+static struct canfd_frame flux_fd[MICROBENCH_BATCH * 64];
+static struct canfd_frame flux_eff[MICROBENCH_BATCH * 64];
+static struct timeval flux_tv[MICROBENCH_BATCH * 64];
+#define MICROBENCH_FLUX (sizeof(flux) / sizeof(*flux))
+
+static void flux_init(void)
+{
+    unsigned int i, graine = 12345;
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    for(i = 0; i < MICROBENCH_FLUX; i++)
+    {
+	graine = graine * 1103515245 + 12345;
+	memset(&flux[i], 0, sizeof(flux[i]));
+	flux[i].can_id = (graine >> 16) & CAN_SFF_MASK;
+	flux[i].len = 8;
+	memcpy(flux[i].data, &graine, sizeof(graine));
+	flux_fd[i] = flux[i];
+	flux_fd[i].flags = CANFD_FDF | CANFD_BRS;
+	flux_fd[i].len = CANFD_MAX_DLEN;
+	memset(flux_fd[i].data + 8, graine >> 24, CANFD_MAX_DLEN - 8);
+	flux_eff[i] = flux[i];
+	flux_eff[i].can_id = CAN_EFF_FLAG | 0x18FE0000 | ((graine >> 8) & 0xFFFF);
+	flux_tv[i] = tv;
+    }
+}
+
+
+/*
+ * Dispatch
+ */
+static unsigned long nb_callbacks;
+
+static void compte(CServerTcpIP * this, struct can_ctx * ctx, const struct canfd_frame * cf, const struct timeval * tv)
+{
+    nb_callbacks++;
+}
+
+/**
+* @brief Mesure can_rx_batch pour un jeu de binds
+*
+* @param exacts Binds exacts (masque 0x7FF), identifiants répartis sur 11 bits
+* @param masques Binds masqués (masque 0x7F0, groupes de 16 identifiants)
+* @param tous 1 pour ajouter un bind qui accepte tout (masque nul)
+*/
+static void bench_dispatch(unsigned long trames, unsigned int exacts, unsigned int masques, int tous)
+{
+    struct can_ctx * ctx;
+    struct mesure m;
+    char variante[64];
+    unsigned long n;
+    unsigned int i;
+
+    if((ctx = can_ctx_new("bench")) == NULL)
+	return;
+    for(i = 0; i < exacts; i++)
+	can_ctx_bind_receive(ctx, (i * 0x7FF / exacts) & CAN_SFF_MASK, CAN_SFF_MASK, NULL, 0, compte);
+    for(i = 0; i < masques; i++)
+	can_ctx_bind_receive(ctx, (i * 0x7F0 / masques) & 0x7F0, 0x7F0, NULL, 0, compte);
+    if(tous)
+	can_ctx_bind_receive(ctx, 0, 0, NULL, 0, compte);
+
+    snprintf(variante, sizeof(variante), "exact=%u masque=%u%s", exacts, masques, tous ? " +tout" : "");
+    nb_callbacks = 0;
+    mesure_debut(&m);
+    for(n = 0; n < trames; n += MICROBENCH_BATCH)
+	can_rx_batch(ctx, &flux[n % MICROBENCH_FLUX], &flux_tv[n % MICROBENCH_FLUX], MICROBENCH_BATCH);
+    mesure_fin(&m, "dispatch", variante, n);
+
+    can_ctx_free(ctx);
+}
+
+
+/**
+* @brief Mesure can_rx_batch sur un flux J1939 (identifiants étendus)
+*
+* @param pgns Binds de PGN (masque 0x03FFFF00), PGN FE00 à FEFF
+* @param exacts Binds exacts sur 29 bits
+*/
+static void bench_dispatch_j1939(unsigned long trames, unsigned int pgns, unsigned int exacts)
+{
+    struct can_ctx * ctx;
+    struct mesure m;
+    char variante[64];
+    unsigned long n;
+    unsigned int i;
+
+    if((ctx = can_ctx_new("bench")) == NULL)
+	return;
+    for(i = 0; i < pgns; i++)
+	can_ctx_bind_receive(ctx, CAN_EFF_FLAG | 0x18FE0000 | ((i * 256 / pgns) << 8), 0x03FFFF00,
+	                     NULL, 0, compte);
+    for(i = 0; i < exacts; i++)
+	can_ctx_bind_receive(ctx, flux_eff[i % MICROBENCH_FLUX].can_id, CAN_EFF_MASK, NULL, 0, compte);
+
+    snprintf(variante, sizeof(variante), "j1939 pgn=%u exact29=%u", pgns, exacts);
+    nb_callbacks = 0;
+    mesure_debut(&m);
+    for(n = 0; n < trames; n += MICROBENCH_BATCH)
+	can_rx_batch(ctx, &flux_eff[n % MICROBENCH_FLUX], &flux_tv[n % MICROBENCH_FLUX], MICROBENCH_BATCH);
+    mesure_fin(&m, "dispatch", variante, n);
+
+    can_ctx_free(ctx);
+}
+
+
+/*
+ * Encodage
+ */
+static void bench_encodage(unsigned long trames)
+{
+    static char out[FRAMEENC_MAX_SIZE];
+    struct mesure m;
+    char variante[64];
+    unsigned long n, total = 0;
+    int e;
+
+    for(e = 0; e < FRAMEENC_COUNT; e++)
+    {
+	mesure_debut(&m);
+	for(n = 0; n < trames; n++)
+	    total += frameenc_table[e].encode(out, &flux[n % MICROBENCH_FLUX], &flux_tv[n % MICROBENCH_FLUX],
+	                                      "can0", 0);
+	mesure_fin(&m, "encodage", frameenc_table[e].name, trames);
+    }
+    for(e = 0; e < FRAMEENC_COUNT; e++)
+    {
+	snprintf(variante, sizeof(variante), "%s fd64", frameenc_table[e].name);
+	mesure_debut(&m);
+	for(n = 0; n < trames; n++)
+	    total += frameenc_table[e].encode(out, &flux_fd[n % MICROBENCH_FLUX], &flux_tv[n % MICROBENCH_FLUX],
+	                                      "can0", 0);
+	mesure_fin(&m, "encodage", variante, trames);
+    }
+    /* Empêche l'élimination des appels */
+    if(total == 0) printf("\n");
+}
+
+
+/*
+ * Diffusion vers des clients socketpair
+ */
+static int pairs[MICROBENCH_MAX_CLIENTS];
+static unsigned int nb_pairs;
+
+/** @brief Lit tout ce que les clients ont reçu */
+static void vide_clients(void)
+{
+    static char tampon[1 << 16];
+    unsigned int i;
+
+    for(i = 0; i < nb_pairs; i++)
+	while(read(pairs[i], tampon, sizeof(tampon)) > 0);
+}
+
+/** @brief Connecte des clients jusqu'à en avoir n */
+static int ajoute_clients(CServerTcpIP * serveur, unsigned int n)
+{
+    int sv[2], taille = 1 << 20;
+
+    while(nb_pairs < n)
+    {
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0)
+	    return -1;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &taille, sizeof(taille));
+	if(serveur->Attach(serveur, sv[0], "socketpair") < 0)
+	{
+	    close(sv[0]);
+	    close(sv[1]);
+	    return -1;
+	}
+	pairs[nb_pairs++] = sv[1];
+    }
+    return 0;
+}
+
+/** @brief Passe les clients connectés dans un encodage */
+static void choix_mode(CServerTcpIP * serveur, Client * client, void * arg)
+{
+    struct session * s = client->pdata;
+
+    if(s != NULL) s->mode = *(int *)arg;
+}
+
+/**
+* @brief Mesure Send (broadcast d'un document XML) et parseXML vers n clients
+*
+* Seuls les appels mesurés sont chronométrés : le vidage des clients, fait
+* toutes les MICROBENCH_DRAIN trames, n'est pas compté.
+*/
+static void bench_diffusion(CServerTcpIP * serveur, unsigned long trames, unsigned int n)
+{
+    char xml[FRAMEENC_MAX_SIZE], variante[64];
+    unsigned int len;
+    unsigned long i, alloc;
+    long long duree, debut;
+    int mode;
+
+    if(ajoute_clients(serveur, n))
+    {
+	perror("socketpair");
+	return;
+    }
+    len = frameenc_table[FRAMEENC_XML].encode(xml, &flux[0], &flux_tv[0], "can0", 0);
+
+    /* Send : même message pour tous les clients */
+    duree = 0;
+    alloc = __atomic_load_n(&nb_alloc, __ATOMIC_RELAXED);
+    for(i = 0; i < trames; i += MICROBENCH_DRAIN)
+    {
+	unsigned int k;
+
+	debut = now_ns();
+	for(k = 0; k < MICROBENCH_DRAIN; k++)
+	    serveur->Send(serveur, NULL, xml, len);
+	duree += now_ns() - debut;
+	vide_clients();
+    }
+    alloc = __atomic_load_n(&nb_alloc, __ATOMIC_RELAXED) - alloc;
+    snprintf(variante, sizeof(variante), "Send xml clients=%u", n);
+    printf("%-10s %-28s %9.1f ns/trame %8.3f alloc/trame\n", "diffusion", variante,
+           (double)duree / i, (double)alloc / i);
+
+    /* parseXML : encodage par client, selon son mode */
+    for(mode = 0; mode < FRAMEENC_COUNT; mode++)
+    {
+	serveur->ForEach(serveur, choix_mode, &mode);
+	duree = 0;
+	alloc = __atomic_load_n(&nb_alloc, __ATOMIC_RELAXED);
+	for(i = 0; i < trames; i += MICROBENCH_DRAIN)
+	{
+	    unsigned int k;
+
+	    debut = now_ns();
+	    for(k = 0; k < MICROBENCH_DRAIN; k++)
+		parseXML(serveur, 0, &flux[(i + k) % MICROBENCH_FLUX], &flux_tv[(i + k) % MICROBENCH_FLUX]);
+	    duree += now_ns() - debut;
+	    vide_clients();
+	}
+	alloc = __atomic_load_n(&nb_alloc, __ATOMIC_RELAXED) - alloc;
+	snprintf(variante, sizeof(variante), "parseXML %s clients=%u", frameenc_table[mode].name, n);
+	printf("%-10s %-28s %9.1f ns/trame %8.3f alloc/trame\n", "diffusion", variante,
+	       (double)duree / i, (double)alloc / i);
+    }
+}
+
+
+int main(int argc, char * argv[])
+{
+    unsigned long trames = MICROBENCH_FRAMES;
+    static const unsigned int clients[] = { 1, 8, 64 };
+    unsigned int i;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:")) != -1)
+    {
+	if(opt == 'n') trames = strtoul(optarg, NULL, 0);
+	else
+	{
+	    fprintf(stderr, "Utilisation : %s [-n trames]\n", argv[0]);
+	    return 1;
+	}
+    }
+    if(trames < MICROBENCH_BATCH)
+	trames = MICROBENCH_BATCH;
+
+    flux_init();
+
+    /* Dispatch : sans bind, binds exacts, binds masqués, mélange */
+    bench_dispatch(trames, 0, 0, 0);
+    bench_dispatch(trames, 1, 0, 0);
+    bench_dispatch(trames, 64, 0, 0);
+    bench_dispatch(trames, 1024, 0, 0);
+    bench_dispatch(trames, 0, 16, 0);
+    bench_dispatch(trames, 256, 16, 0);
+    bench_dispatch(trames, 0, 0, 1);
+    bench_dispatch(trames, 256, 16, 1);
+    bench_dispatch_j1939(trames, 16, 0);
+    bench_dispatch_j1939(trames, 256, 0);
+    bench_dispatch_j1939(trames, 256, 256);
+
+    bench_encodage(trames);
+
+    /* Diffusion : serveur démarré sur un port libre, clients confiés par Attach */
+    this = CServerTcpIP_New(protocole, onConnect, NULL);
+    if(this == NULL)
+	return 1;
+    this->SetDisconnectCallback(this, onDisconnect);
+    this->SetDrainCallback(this, onDrain);
+    if(this->Start(this, 0) != 0)
+    {
+	fprintf(stderr, "Démarrage du serveur impossible\n");
+	return 1;
+    }
+    nb_bus = 1;
+    for(i = 0; i < sizeof(clients) / sizeof(*clients); i++)
+	bench_diffusion(this, trames / clients[i], clients[i]);
+
+    this->Free(this);
+    for(i = 0; i < nb_pairs; i++)
+	close(pairs[i]);
+    return 0;
+}
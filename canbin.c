@@ -0,0 +1,155 @@
+/**
+ * @file canbin.c
+ *
+ * @brief Format binaire compact des trames CAN échangées sur le flux TCP.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "canbin.h"
+
+
+/**
+* @brief Donne la taille d'un enregistrement d'après son premier octet
+*
+* @param magic Premier octet de l'enregistrement
+*
+* @returns CANBIN_RECORD_SIZE, CANBIN_FD_RECORD_SIZE, 0 si ce n'est pas un marqueur
+*/
+unsigned int canbin_record_size(unsigned char magic)
+{
+    if(magic == CANBIN_MAGIC) return CANBIN_RECORD_SIZE;
+    if(magic == CANBIN_MAGIC_FD) return CANBIN_FD_RECORD_SIZE;
+    return 0;
+}
+
+
+/**
+* @brief Encode une trame dans un enregistrement de la taille demandée
+*
+* @param rec Enregistrement à remplir
+* @param size CANBIN_RECORD_SIZE ou CANBIN_FD_RECORD_SIZE
+* @param cf La trame à encoder, dont les données tiennent dans l'enregistrement
+* @param tv Date de la trame
+* @param bus Numéro du bus de la trame
+*/
+static void canbin_pack_size(unsigned char * rec, unsigned int size, const struct canfd_frame * cf,
+                             const struct timeval * tv, unsigned int bus)
+{
+    unsigned long long us;
+    unsigned int id, len = size - 16;
+    unsigned char flags = 0;
+    int i;
+
+    if(cf->can_id & CAN_EFF_FLAG)
+    {
+	flags |= CANBIN_FLAG_EFF;
+	id = cf->can_id & CAN_EFF_MASK;
+    }
+    else id = cf->can_id & CAN_SFF_MASK;
+    if(cf->can_id & CAN_RTR_FLAG) flags |= CANBIN_FLAG_RTR;
+    if(cf->can_id & CAN_ERR_FLAG) flags |= CANBIN_FLAG_ERR;
+    if(cf->flags & CANFD_FDF)
+    {
+	flags |= CANBIN_FLAG_FD;
+	if(cf->flags & CANFD_BRS) flags |= CANBIN_FLAG_BRS;
+	if(cf->flags & CANFD_ESI) flags |= CANBIN_FLAG_ESI;
+    }
+    if(cf->len < len) len = cf->len;
+
+    rec[0] = (size == CANBIN_FD_RECORD_SIZE) ? CANBIN_MAGIC_FD : CANBIN_MAGIC;
+    rec[1] = flags;
+    rec[2] = len;
+    rec[3] = bus;
+
+    rec[4] = id >> 24;
+    rec[5] = id >> 16;
+    rec[6] = id >> 8;
+    rec[7] = id;
+
+    us = (unsigned long long)tv->tv_sec * 1000000ULL + tv->tv_usec;
+    for(i = 0; i < 8; i++)
+	rec[8 + i] = us >> (56 - 8 * i);
+
+    memcpy(rec + 16, cf->data, len);
+    memset(rec + 16 + len, 0, size - 16 - len);
+}
+
+
+/**
+* @brief Encode une trame CAN dans un enregistrement binaire
+*
+* L'enregistrement est long seulement si la trame porte plus de 8 octets.
+*
+* @param rec Enregistrement à remplir (CANBIN_MAX_RECORD_SIZE octets)
+* @param cf La trame à encoder
+* @param tv Date de la trame
+* @param bus Numéro du bus de la trame
+*
+* @returns La taille de l'enregistrement écrit
+*/
+unsigned int canbin_pack(unsigned char * rec, const struct canfd_frame * cf,
+                         const struct timeval * tv, unsigned int bus)
+{
+    unsigned int size = (cf->len > CAN_MAX_DLEN) ? CANBIN_FD_RECORD_SIZE : CANBIN_RECORD_SIZE;
+
+    canbin_pack_size(rec, size, cf, tv, bus);
+    return size;
+}
+
+
+/**
+* @brief Encode une trame CAN dans un enregistrement long
+*
+* @param rec Enregistrement à remplir (CANBIN_FD_RECORD_SIZE octets)
+* @param cf La trame à encoder
+* @param tv Date de la trame
+* @param bus Numéro du bus de la trame
+*/
+void canbin_pack_fd(unsigned char * rec, const struct canfd_frame * cf,
+                    const struct timeval * tv, unsigned int bus)
+{
+    canbin_pack_size(rec, CANBIN_FD_RECORD_SIZE, cf, tv, bus);
+}
+
+
+/**
+* @brief Décode un enregistrement binaire en trame CAN
+*
+* @param rec Enregistrement à décoder (taille donnée par canbin_record_size)
+* @param cf La trame à remplir
+* @param bus Numéro du bus de la trame, ou NULL
+*
+* @returns 0 si OK, !=0 si l'enregistrement est invalide
+*/
+int canbin_unpack(const unsigned char * rec, struct canfd_frame * cf, unsigned int * bus)
+{
+    unsigned int id, size;
+
+    if((size = canbin_record_size(rec[0])) == 0) return 1;
+    if(rec[2] > size - 16) return 2;
+    if(rec[2] > CAN_MAX_DLEN && !(rec[1] & CANBIN_FLAG_FD)) return 2;
+
+    id = ((unsigned int)rec[4] << 24) | ((unsigned int)rec[5] << 16)
+	| ((unsigned int)rec[6] << 8) | rec[7];
+
+    memset(cf, 0, offsetof(struct canfd_frame, data));
+    if(rec[1] & CANBIN_FLAG_EFF)
+	cf->can_id = (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+    else
+	cf->can_id = id & CAN_SFF_MASK;
+    if(rec[1] & CANBIN_FLAG_RTR) cf->can_id |= CAN_RTR_FLAG;
+    if(rec[1] & CANBIN_FLAG_ERR) cf->can_id |= CAN_ERR_FLAG;
+    if(rec[1] & CANBIN_FLAG_FD)
+    {
+	cf->flags = CANFD_FDF;
+	if(rec[1] & CANBIN_FLAG_BRS) cf->flags |= CANFD_BRS;
+	if(rec[1] & CANBIN_FLAG_ESI) cf->flags |= CANFD_ESI;
+    }
+
+    cf->len = rec[2];
+    memcpy(cf->data, rec + 16, cf->len);
+    if(bus != NULL) *bus = rec[3];
+    return 0;
+}
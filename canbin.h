@@ -0,0 +1,125 @@
+/**
+ * @file canbin.h
+ *
+ * @brief Format binaire compact des trames CAN échangées sur le flux TCP.
+ *
+ * Chaque trame est transportée dans un enregistrement de taille fixe
+ * (CANBIN_RECORD_SIZE octets), les champs multi-octets étant en big-endian :
+ *
+ * | Offset | Taille | Champ                                         |
+ * |--------|--------|-----------------------------------------------|
+ * | 0      | 1      | Marqueur CANBIN_MAGIC                         |
+ * | 1      | 1      | Flags (CANBIN_FLAG_*)                         |
+ * | 2      | 1      | Longueur des données (0 à 8, 0 à 64 en long)  |
+ * | 3      | 1      | Numéro du bus (interface CAN), 0 par défaut   |
+ * | 4      | 4      | Identifiant CAN (sans les bits de flags)      |
+ * | 8      | 8      | Timestamp en microsecondes depuis l'epoch     |
+ * | 16     | 8      | Données                                       |
+ *
+ * Une trame de plus de 8 octets (CAN FD) est transportée dans un
+ * enregistrement long : même en-tête, marqueur CANBIN_MAGIC_FD et 64 octets de
+ * données (CANBIN_FD_RECORD_SIZE octets). Le marqueur donne donc la taille de
+ * l'enregistrement ; le flag CANBIN_FLAG_FD indique une trame CAN FD, quelle
+ * que soit sa longueur.
+ *
+ * Le marqueur ne peut pas commencer une commande texte : un client peut donc
+ * envoyer indifféremment des commandes texte et des enregistrements binaires.
+ */
+
+#ifndef __CANBIN_H__
+#define __CANBIN_H__
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#include <sys/time.h>
+#include <linux/can.h>
+
+#ifndef CANFD_FDF
+/** @brief Marque une trame CAN FD dans struct canfd_frame (linux >= 5.14) */
+#define CANFD_FDF 0x04
+#endif
+
+/** @brief Premier octet de chaque enregistrement binaire */
+#define CANBIN_MAGIC 0xCA
+/** @brief Taille d'un enregistrement binaire en octets */
+#define CANBIN_RECORD_SIZE 24
+/** @brief Premier octet de chaque enregistrement long (64 octets de données) */
+#define CANBIN_MAGIC_FD 0xCB
+/** @brief Taille d'un enregistrement long en octets */
+#define CANBIN_FD_RECORD_SIZE 80
+/** @brief Taille maximale d'un enregistrement */
+#define CANBIN_MAX_RECORD_SIZE CANBIN_FD_RECORD_SIZE
+
+/** @brief Identifiant étendu 29 bits */
+#define CANBIN_FLAG_EFF 0x01
+/** @brief Trame de requête distante */
+#define CANBIN_FLAG_RTR 0x02
+/** @brief Trame d'erreur */
+#define CANBIN_FLAG_ERR 0x04
+/** @brief Trame CAN FD */
+#define CANBIN_FLAG_FD 0x08
+/** @brief CAN FD : commutation de débit pour les données */
+#define CANBIN_FLAG_BRS 0x10
+/** @brief CAN FD : indicateur d'état d'erreur de l'émetteur */
+#define CANBIN_FLAG_ESI 0x20
+
+
+/**
+* @brief Donne la taille d'un enregistrement d'après son premier octet
+*
+* @param magic Premier octet de l'enregistrement
+*
+* @returns CANBIN_RECORD_SIZE, CANBIN_FD_RECORD_SIZE, 0 si ce n'est pas un marqueur
+*/
+unsigned int canbin_record_size(unsigned char magic);
+
+
+/**
+* @brief Encode une trame CAN dans un enregistrement binaire
+*
+* L'enregistrement est long seulement si la trame porte plus de 8 octets.
+*
+* @param rec Enregistrement à remplir (CANBIN_MAX_RECORD_SIZE octets)
+* @param cf La trame à encoder
+* @param tv Date de la trame
+* @param bus Numéro du bus de la trame
+*
+* @returns La taille de l'enregistrement écrit
+*/
+unsigned int canbin_pack(unsigned char * rec, const struct canfd_frame * cf,
+                         const struct timeval * tv, unsigned int bus);
+
+
+/**
+* @brief Encode une trame CAN dans un enregistrement long
+*
+* Pour les fichiers dont tous les enregistrements ont la même taille.
+*
+* @param rec Enregistrement à remplir (CANBIN_FD_RECORD_SIZE octets)
+* @param cf La trame à encoder
+* @param tv Date de la trame
+* @param bus Numéro du bus de la trame
+*/
+void canbin_pack_fd(unsigned char * rec, const struct canfd_frame * cf,
+                    const struct timeval * tv, unsigned int bus);
+
+
+/**
+* @brief Décode un enregistrement binaire en trame CAN
+*
+* @param rec Enregistrement à décoder (taille donnée par canbin_record_size)
+* @param cf La trame à remplir
+* @param bus Numéro du bus de la trame, ou NULL
+*
+* @returns 0 si OK, !=0 si l'enregistrement est invalide
+*/
+int canbin_unpack(const unsigned char * rec, struct canfd_frame * cf, unsigned int * bus);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,352 @@
+/**
+ * @file cancap.c
+ *
+ * @brief Fichiers de capture binaires du trafic CAN.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cancap.h"
+
+
+/** @brief Ecrit un entier 32 bits en big-endian */
+static void put_u32(unsigned char * p, unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+
+/** @brief Ecrit un entier 64 bits en big-endian */
+static void put_u64(unsigned char * p, unsigned long long v)
+{
+    int i;
+
+    for(i = 0; i < 8; i++)
+	p[i] = v >> (56 - 8 * i);
+}
+
+
+/** @brief Lit un entier 32 bits big-endian */
+static unsigned int get_u32(const unsigned char * p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16)
+	| ((unsigned int)p[2] << 8) | p[3];
+}
+
+
+/** @brief Lit un entier 64 bits big-endian */
+static unsigned long long get_u64(const unsigned char * p)
+{
+    unsigned long long v = 0;
+    int i;
+
+    for(i = 0; i < 8; i++)
+	v = (v << 8) | p[i];
+    return v;
+}
+
+
+/**
+* @brief Remplit l'en-tête d'un fichier de capture
+*
+* Les noms qui ne tiennent pas dans l'en-tête sont omis.
+*
+* @param hdr En-tête à remplir (CANCAP_HEADER_SIZE octets)
+* @param ifaces Noms des interfaces CAN, par numéro de bus
+* @param nb_ifaces Nombre d'interfaces
+* @param stride Pas de l'index
+* @param record_size CANBIN_RECORD_SIZE ou CANBIN_FD_RECORD_SIZE
+*/
+void cancap_header(unsigned char * hdr, const char * const * ifaces,
+                   unsigned int nb_ifaces, unsigned int stride, unsigned int record_size)
+{
+    unsigned int i, pos = 0, len;
+
+    memset(hdr, 0, CANCAP_HEADER_SIZE);
+    memcpy(hdr, CANCAP_MAGIC, 8);
+    put_u32(hdr + 8, record_size);
+    put_u32(hdr + 12, stride);
+    for(i = 0; i < nb_ifaces && i < CANCAP_MAX_IFACES; i++)
+    {
+	len = strlen(ifaces[i]);
+	if(pos + len + 1 > CANCAP_IFACES_SIZE)
+	    break;
+	memcpy(hdr + 16 + pos, ifaces[i], len);
+	pos += len + 1;
+    }
+}
+
+
+/**
+* @brief Remplit l'en-tête d'un fichier d'index
+*
+* @param hdr En-tête à remplir (CANCAP_IDX_HEADER_SIZE octets)
+* @param stride Pas de l'index
+*/
+void cancap_idx_header(unsigned char * hdr, unsigned int stride)
+{
+    memset(hdr, 0, CANCAP_IDX_HEADER_SIZE);
+    memcpy(hdr, CANCAP_IDX_MAGIC, 8);
+    put_u32(hdr + 8, stride);
+}
+
+
+/**
+* @brief Remplit une entrée d'index
+*
+* @param ent Entrée à remplir (CANCAP_IDX_ENTRY_SIZE octets)
+* @param us Timestamp de la trame en microsecondes
+* @param n Numéro de la trame
+*/
+void cancap_idx_entry(unsigned char * ent, unsigned long long us, unsigned long long n)
+{
+    put_u64(ent, us);
+    put_u64(ent + 8, n);
+}
+
+
+/**
+* @brief Lit le timestamp d'un enregistrement canbin
+*
+* @param rec L'enregistrement
+*
+* @returns Le timestamp en microsecondes
+*/
+unsigned long long cancap_record_time(const unsigned char * rec)
+{
+    return get_u64(rec + 8);
+}
+
+
+/** @brief Adresse de la n-ième trame projetée */
+static const unsigned char * cancap_record(const struct cancap * cap, unsigned long n)
+{
+    return cap->map + CANCAP_HEADER_SIZE + (size_t)n * cap->record_size;
+}
+
+
+/**
+* @brief Projette le fichier d'index s'il est cohérent avec la capture
+*
+* Seules les entrées qui référencent des trames complètes sont retenues.
+*
+* @returns 0 si l'index est utilisable, 1 sinon
+*/
+static int cancap_idx_map(struct cancap * cap, const char * path)
+{
+    char name[4096];
+    struct stat st;
+    unsigned long n, expected;
+    int fd;
+
+    snprintf(name, sizeof(name), "%s.idx", path);
+    if((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0)
+	return 1;
+    if(fstat(fd, &st) < 0 || st.st_size < CANCAP_IDX_HEADER_SIZE)
+    {
+	close(fd);
+	return 1;
+    }
+    cap->idx_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(cap->idx_map == MAP_FAILED)
+    {
+	cap->idx_map = NULL;
+	return 1;
+    }
+    cap->idx_size = st.st_size;
+
+    n = (st.st_size - CANCAP_IDX_HEADER_SIZE) / CANCAP_IDX_ENTRY_SIZE;
+    expected = (cap->count + cap->stride - 1) / cap->stride;
+    if(n > expected) n = expected;
+    if(memcmp(cap->idx_map, CANCAP_IDX_MAGIC, 8) != 0
+       || get_u32(cap->idx_map + 8) != cap->stride || n < expected)
+    {
+	munmap((void *)cap->idx_map, cap->idx_size);
+	cap->idx_map = NULL;
+	return 1;
+    }
+    cap->index = cap->idx_map + CANCAP_IDX_HEADER_SIZE;
+    cap->nindex = n;
+    return 0;
+}
+
+
+/**
+* @brief Reconstruit l'index en mémoire à partir des trames
+*
+* @returns 0 si OK, 1 si l'allocation échoue
+*/
+static int cancap_idx_build(struct cancap * cap)
+{
+    unsigned long i, n;
+
+    n = (cap->count + cap->stride - 1) / cap->stride;
+    cap->idx_mem = malloc(n * CANCAP_IDX_ENTRY_SIZE + 1);
+    if(cap->idx_mem == NULL)
+	return 1;
+    for(i = 0; i < n; i++)
+	cancap_idx_entry(cap->idx_mem + i * CANCAP_IDX_ENTRY_SIZE,
+	                 cancap_record_time(cancap_record(cap, i * cap->stride)),
+	                 (unsigned long long)i * cap->stride);
+    cap->index = cap->idx_mem;
+    cap->nindex = n;
+    return 0;
+}
+
+
+/**
+* @brief Ouvre une capture en lecture par mmap
+*
+* @param cap Capture à initialiser
+* @param path Chemin du fichier de capture
+*
+* @returns 0 si OK, 1 fichier, 2 format invalide, 3 mmap, 4 allocation
+*/
+int cancap_open(struct cancap * cap, const char * path)
+{
+    struct stat st;
+    unsigned int pos;
+
+    memset(cap, 0, sizeof(*cap));
+    if((cap->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	return 1;
+    if(fstat(cap->fd, &st) < 0)
+    {
+	close(cap->fd);
+	return 1;
+    }
+    if(st.st_size < CANCAP_HEADER_SIZE)
+    {
+	close(cap->fd);
+	return 2;
+    }
+
+    cap->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, cap->fd, 0);
+    if(cap->map == MAP_FAILED)
+    {
+	close(cap->fd);
+	return 3;
+    }
+    cap->map_size = st.st_size;
+
+    cap->record_size = get_u32(cap->map + 8);
+    if(memcmp(cap->map, CANCAP_MAGIC, 8) != 0
+       || (cap->record_size != CANBIN_RECORD_SIZE && cap->record_size != CANBIN_FD_RECORD_SIZE)
+       || (cap->stride = get_u32(cap->map + 12)) == 0)
+    {
+	cancap_close(cap);
+	return 2;
+    }
+    /* Liste des noms d'interfaces : chaînes consécutives terminées par des 0 */
+    memcpy(cap->ifaces, cap->map + 16, CANCAP_IFACES_SIZE);
+    cap->ifaces[CANCAP_IFACES_SIZE] = '\0';
+    for(pos = 0; pos < CANCAP_IFACES_SIZE && cap->ifaces[pos] != '\0'
+	    && cap->nb_ifaces < CANCAP_MAX_IFACES; pos += strlen(cap->ifaces + pos) + 1)
+	cap->iface[cap->nb_ifaces++] = cap->ifaces + pos;
+    if(cap->nb_ifaces == 0)
+	cap->iface[cap->nb_ifaces++] = cap->ifaces;
+
+    /* Une trame incomplète en fin de fichier (arrêt brutal) est ignorée */
+    cap->count = (st.st_size - CANCAP_HEADER_SIZE) / cap->record_size;
+
+    madvise((void *)cap->map, cap->map_size, MADV_RANDOM);
+
+    if(cancap_idx_map(cap, path) && cancap_idx_build(cap))
+    {
+	cancap_close(cap);
+	return 4;
+    }
+    return 0;
+}
+
+
+/**
+* @brief Ferme une capture
+*
+* @param cap La capture
+*/
+void cancap_close(struct cancap * cap)
+{
+    if(cap->idx_map != NULL)
+	munmap((void *)cap->idx_map, cap->idx_size);
+    free(cap->idx_mem);
+    if(cap->map != NULL)
+	munmap((void *)cap->map, cap->map_size);
+    close(cap->fd);
+    memset(cap, 0, sizeof(*cap));
+    cap->fd = -1;
+}
+
+
+/**
+* @brief Lit une trame de la capture
+*
+* @param cap La capture
+* @param n Numéro de la trame
+* @param cf La trame à remplir
+* @param tv Date de la trame, ou NULL
+* @param bus Numéro du bus de la trame, ou NULL
+*
+* @returns 0 si OK, 1 hors de la capture, 2 enregistrement invalide
+*/
+int cancap_frame(const struct cancap * cap, unsigned long n,
+                 struct canfd_frame * cf, struct timeval * tv, unsigned int * bus)
+{
+    const unsigned char * rec;
+    unsigned long long us;
+
+    if(n >= cap->count) return 1;
+    rec = cancap_record(cap, n);
+    if(canbin_record_size(rec[0]) != cap->record_size || canbin_unpack(rec, cf, bus)) return 2;
+    if(tv != NULL)
+    {
+	us = cancap_record_time(rec);
+	tv->tv_sec = us / 1000000ULL;
+	tv->tv_usec = us % 1000000ULL;
+    }
+    return 0;
+}
+
+
+/**
+* @brief Cherche la première trame datée d'au moins us
+*
+* Recherche dichotomique dans l'index puis parcours d'au plus un pas de trames.
+*
+* @param cap La capture
+* @param us Timestamp recherché en microsecondes
+*
+* @returns Le numéro de la trame, ou cap->count si aucune
+*/
+unsigned long cancap_seek(const struct cancap * cap, unsigned long long us)
+{
+    unsigned long lo = 0, hi = cap->nindex, mid, n;
+
+    /* Première entrée datée d'au moins us */
+    while(lo < hi)
+    {
+	mid = lo + (hi - lo) / 2;
+	if(get_u64(cap->index + mid * CANCAP_IDX_ENTRY_SIZE) < us)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if(lo == 0)
+	return 0;
+
+    /* La trame cherchée est dans le pas qui précède cette entrée */
+    n = get_u64(cap->index + (lo - 1) * CANCAP_IDX_ENTRY_SIZE + 8);
+    while(n < cap->count && cancap_record_time(cancap_record(cap, n)) < us)
+	n++;
+    return n;
+}
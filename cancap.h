@@ -0,0 +1,183 @@
+/**
+ * @file cancap.h
+ *
+ * @brief Fichiers de capture binaires du trafic CAN.
+ *
+ * Un fichier de capture est formé d'un en-tête de CANCAP_HEADER_SIZE octets
+ * suivi d'une zone de données où les trames sont ajoutées les unes après les
+ * autres sous forme d'enregistrements canbin de taille fixe (canbin.h). La
+ * n-ième trame est donc à l'offset CANCAP_HEADER_SIZE + n * taille, et une
+ * capture interrompue reste lisible jusqu'à son dernier enregistrement complet.
+ *
+ * La taille des enregistrements est donnée par l'en-tête : CANBIN_RECORD_SIZE
+ * pour une capture de trames classiques, CANBIN_FD_RECORD_SIZE (enregistrements
+ * longs) pour une capture pouvant contenir des trames CAN FD.
+ *
+ * En-tête (champs multi-octets en big-endian) :
+ *
+ * | Offset | Taille | Champ                                         |
+ * |--------|--------|-----------------------------------------------|
+ * | 0      | 8      | Marqueur CANCAP_MAGIC                         |
+ * | 8      | 4      | Taille d'un enregistrement                    |
+ * | 12     | 4      | Pas de l'index (trames par entrée)            |
+ * | 16     | 48     | Noms des interfaces CAN, séparés par des 0    |
+ *
+ * Le champ "bus" d'un enregistrement (canbin.h) est le rang du nom de son
+ * interface dans la liste de l'en-tête.
+ *
+ * L'index temporel est un fichier annexe <capture>.idx : un en-tête de
+ * CANCAP_IDX_HEADER_SIZE octets (CANCAP_IDX_MAGIC puis le pas de l'index sur
+ * 4 octets et 4 octets réservés) suivi d'une entrée toutes les "pas" trames :
+ * timestamp en microsecondes (8 octets) et numéro de la trame (8 octets).
+ * L'index est écrit après les données qu'il référence ; s'il est absent ou
+ * incomplet, cancap_open le reconstruit en mémoire.
+ */
+
+#ifndef __CANCAP_H__
+#define __CANCAP_H__
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#include <stddef.h>
+#include <sys/time.h>
+#include <linux/can.h>
+
+#include "canbin.h"
+
+/** @brief Marqueur de début d'un fichier de capture */
+#define CANCAP_MAGIC "CANCAP01"
+/** @brief Taille de l'en-tête d'un fichier de capture */
+#define CANCAP_HEADER_SIZE 64
+/** @brief Marqueur de début d'un fichier d'index */
+#define CANCAP_IDX_MAGIC "CANIDX01"
+/** @brief Taille de l'en-tête d'un fichier d'index */
+#define CANCAP_IDX_HEADER_SIZE 16
+/** @brief Taille d'une entrée d'index */
+#define CANCAP_IDX_ENTRY_SIZE 16
+/** @brief Pas de l'index par défaut, en trames */
+#define CANCAP_IDX_STRIDE 1024
+/** @brief Taille de la liste des noms d'interfaces de l'en-tête */
+#define CANCAP_IFACES_SIZE 48
+/** @brief Nombre maximum d'interfaces nommées dans l'en-tête */
+#define CANCAP_MAX_IFACES 8
+
+/**
+* @brief Capture ouverte en lecture
+*/
+struct cancap
+{
+    int fd;				/*!< Descripteur de la capture */
+    const unsigned char * map;		/*!< Projection de la capture */
+    size_t map_size;			/*!< Taille projetée */
+    unsigned long count;		/*!< Nombre de trames complètes */
+    unsigned int record_size;		/*!< Taille d'un enregistrement */
+    unsigned int stride;		/*!< Pas de l'index */
+    char ifaces[CANCAP_IFACES_SIZE + 1];	/*!< Noms des interfaces, séparés par des 0 */
+    const char * iface[CANCAP_MAX_IFACES];	/*!< Nom de l'interface de chaque bus */
+    unsigned int nb_ifaces;		/*!< Nombre d'interfaces nommées */
+    const unsigned char * index;	/*!< Entrées de l'index */
+    unsigned long nindex;		/*!< Nombre d'entrées de l'index */
+    const unsigned char * idx_map;	/*!< Projection du fichier d'index */
+    size_t idx_size;			/*!< Taille du fichier d'index projeté */
+    unsigned char * idx_mem;		/*!< Index reconstruit en mémoire */
+};
+
+
+/**
+* @brief Remplit l'en-tête d'un fichier de capture
+*
+* Les noms qui ne tiennent pas dans l'en-tête sont omis.
+*
+* @param hdr En-tête à remplir (CANCAP_HEADER_SIZE octets)
+* @param ifaces Noms des interfaces CAN, par numéro de bus
+* @param nb_ifaces Nombre d'interfaces
+* @param stride Pas de l'index
+* @param record_size CANBIN_RECORD_SIZE ou CANBIN_FD_RECORD_SIZE
+*/
+void cancap_header(unsigned char * hdr, const char * const * ifaces,
+                   unsigned int nb_ifaces, unsigned int stride, unsigned int record_size);
+
+
+/**
+* @brief Remplit l'en-tête d'un fichier d'index
+*
+* @param hdr En-tête à remplir (CANCAP_IDX_HEADER_SIZE octets)
+* @param stride Pas de l'index
+*/
+void cancap_idx_header(unsigned char * hdr, unsigned int stride);
+
+
+/**
+* @brief Remplit une entrée d'index
+*
+* @param ent Entrée à remplir (CANCAP_IDX_ENTRY_SIZE octets)
+* @param us Timestamp de la trame en microsecondes
+* @param n Numéro de la trame
+*/
+void cancap_idx_entry(unsigned char * ent, unsigned long long us, unsigned long long n);
+
+
+/**
+* @brief Lit le timestamp d'un enregistrement canbin
+*
+* @param rec L'enregistrement
+*
+* @returns Le timestamp en microsecondes
+*/
+unsigned long long cancap_record_time(const unsigned char * rec);
+
+
+/**
+* @brief Ouvre une capture en lecture par mmap
+*
+* @param cap Capture à initialiser
+* @param path Chemin du fichier de capture
+*
+* @returns 0 si OK, 1 fichier, 2 format invalide, 3 mmap, 4 allocation
+*/
+int cancap_open(struct cancap * cap, const char * path);
+
+
+/**
+* @brief Ferme une capture
+*
+* @param cap La capture
+*/
+void cancap_close(struct cancap * cap);
+
+
+/**
+* @brief Lit une trame de la capture
+*
+* @param cap La capture
+* @param n Numéro de la trame
+* @param cf La trame à remplir
+* @param tv Date de la trame, ou NULL
+* @param bus Numéro du bus de la trame, ou NULL
+*
+* @returns 0 si OK, 1 hors de la capture, 2 enregistrement invalide
+*/
+int cancap_frame(const struct cancap * cap, unsigned long n,
+                 struct canfd_frame * cf, struct timeval * tv, unsigned int * bus);
+
+
+/**
+* @brief Cherche la première trame datée d'au moins us
+*
+* Recherche dichotomique dans l'index puis parcours d'au plus un pas de trames.
+*
+* @param cap La capture
+* @param us Timestamp recherché en microsecondes
+*
+* @returns Le numéro de la trame, ou cap->count si aucune
+*/
+unsigned long cancap_seek(const struct cancap * cap, unsigned long long us);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
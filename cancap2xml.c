@@ -0,0 +1,64 @@
+/**
+ * @file cancap2xml.c
+ *
+ * @brief Convertit une capture binaire (cancap.h) en document XML.
+ *
+ * Le document produit est celui qu'écrivait l'enregistrement XML historique :
+ * prologue, balise racine au nom de l'interface CAN et un élément <trame> par
+ * trame. Une fenêtre temporelle peut être extraite sans lire la capture depuis
+ * le début grâce à l'index.
+ *
+ * Utilisation : cancap2xml <capture> [debut_us [fin_us]] > capture.xml
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cancap.h"
+#include "frameenc.h"
+
+
+int main(int argc, char * argv[])
+{
+    struct cancap cap;
+    struct canfd_frame cf;
+    struct timeval tv;
+    char out[FRAMEENC_MAX_SIZE];
+    unsigned long long debut = 0, fin = ~0ULL;
+    unsigned long n;
+    unsigned int bus;
+    int ret;
+
+    if(argc < 2 || argc > 4)
+    {
+	fprintf(stderr, "Utilisation : %s <capture> [debut_us [fin_us]]\n", argv[0]);
+	return 1;
+    }
+    if(argc > 2) debut = strtoull(argv[2], NULL, 0);
+    if(argc > 3) fin = strtoull(argv[3], NULL, 0);
+
+    if((ret = cancap_open(&cap, argv[1])) != 0)
+    {
+	fprintf(stderr, "%s : capture illisible (%d)\n", argv[1], ret);
+	return 1;
+    }
+
+    printf("<?xml version=\"1.0\" encoding=\"UTF-8\"?><%s>", cap.iface[0]);
+    for(n = cancap_seek(&cap, debut); n < cap.count; n++)
+    {
+	if(cancap_frame(&cap, n, &cf, &tv, &bus))
+	{
+	    fprintf(stderr, "Trame %lu invalide\n", n);
+	    continue;
+	}
+	if((unsigned long long)tv.tv_sec * 1000000ULL + tv.tv_usec >= fin)
+	    break;
+	/* Avec plusieurs interfaces, chaque trame porte la sienne */
+	fwrite(out, 1, frameenc_xml_trame(out, &cf, &tv, (cap.nb_ifaces > 1 && bus < cap.nb_ifaces)
+	                                  ? cap.iface[bus] : NULL), stdout);
+    }
+    printf("</%s>", cap.iface[0]);
+
+    cancap_close(&cap);
+    return 0;
+}
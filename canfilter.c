@@ -0,0 +1,114 @@
+/**
+ * @file canfilter.c
+ *
+ * @brief Filtre d'identifiants CAN d'un client TCP (abonnements ID/masque).
+ */
+
+#include <string.h>
+
+#include "canfilter.h"
+
+
+/**
+* @brief Normalise un abonnement comme un bind de libcan
+*
+* Identifiant étendu s'il porte CAN_EFF_FLAG ou dépasse 0x7FF ; le masque
+* reçoit CAN_EFF_FLAG, sauf le masque nul qui accepte toutes les trames.
+*/
+static void canfilter_norm(canid_t * id, canid_t * mask)
+{
+    if((*id & CAN_EFF_FLAG) || (*id & CAN_EFF_MASK) > CAN_SFF_MASK)
+    {
+	*id = (*id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+	if(*mask) *mask = (*mask & CAN_EFF_MASK) | CAN_EFF_FLAG;
+    }
+    else
+    {
+	*id &= CAN_SFF_MASK;
+	if(*mask) *mask = (*mask & CAN_SFF_MASK) | CAN_EFF_FLAG;
+    }
+}
+
+
+/** @brief Ajoute à la table les identifiants standards acceptés par un abonnement */
+static void canfilter_expand(struct canfilter * f, const struct canfilter_sub * s)
+{
+    canid_t x;
+
+    for(x = 0; x <= CAN_SFF_MASK; x++)
+    {
+	if(((x ^ s->id) & s->mask) == 0)
+	    f->sff[x >> 3] |= 1 << (x & 7);
+    }
+}
+
+
+void canfilter_clear(struct canfilter * f)
+{
+    memset(f, 0, sizeof(*f));
+}
+
+
+int canfilter_add(struct canfilter * f, canid_t id, canid_t mask)
+{
+    unsigned int i;
+
+    canfilter_norm(&id, &mask);
+    for(i = 0; i < f->nb; i++)
+    {
+	if(f->subs[i].id == id && f->subs[i].mask == mask)
+	{
+	    f->active = 1;
+	    return 0;
+	}
+    }
+    if(f->nb >= CANFILTER_MAX) return 1;
+
+    f->subs[f->nb].id = id;
+    f->subs[f->nb].mask = mask;
+    canfilter_expand(f, &f->subs[f->nb]);
+    f->nb++;
+    f->active = 1;
+    return 0;
+}
+
+
+int canfilter_remove(struct canfilter * f, canid_t id, canid_t mask)
+{
+    unsigned int i;
+
+    canfilter_norm(&id, &mask);
+    for(i = 0; i < f->nb; i++)
+    {
+	if(f->subs[i].id == id && f->subs[i].mask == mask)
+	    break;
+    }
+    if(i == f->nb) return 1;
+
+    f->subs[i] = f->subs[--f->nb];
+
+    /* Les abonnements se recouvrent : la table est reconstruite */
+    memset(f->sff, 0, sizeof(f->sff));
+    for(i = 0; i < f->nb; i++)
+	canfilter_expand(f, &f->subs[i]);
+    return 0;
+}
+
+
+int canfilter_match(const struct canfilter * f, canid_t can_id)
+{
+    unsigned int i;
+
+    if(!f->active) return 1;
+
+    /* Identifiant standard sans flags : table */
+    if((can_id & ~CAN_SFF_MASK) == 0)
+	return (f->sff[can_id >> 3] >> (can_id & 7)) & 1;
+
+    for(i = 0; i < f->nb; i++)
+    {
+	if(((can_id ^ f->subs[i].id) & f->subs[i].mask) == 0)
+	    return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file canfilter.h
+ *
+ * @brief Filtre d'identifiants CAN d'un client TCP (abonnements ID/masque).
+ *
+ * Un abonnement (id, masque) laisse passer les trames vérifiant
+ * "(ID_reçue & masque) == (id & masque)", comme un bind de réception de libcan :
+ * un identifiant avec CAN_EFF_FLAG ou au-delà de 0x7FF est étendu (29 bits), et
+ * un abonnement ne laisse passer que les trames de son format, sauf avec un
+ * masque nul.
+ * Les abonnements sont conservés dans une liste et développés dans une table
+ * de bits couvrant les 2048 identifiants standards : le test d'une trame
+ * 11 bits sans flags est un simple accès à la table, seules les autres trames
+ * parcourent la liste.
+ *
+ * Un filtre inactif (aucun abonnement demandé) laisse passer toutes les trames.
+ */
+
+#ifndef __CANFILTER_H__
+#define __CANFILTER_H__
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#include <linux/can.h>
+
+/** @brief Nombre maximal d'abonnements par filtre */
+#define CANFILTER_MAX 32
+
+/**
+* @brief Abonnement ID/masque
+*/
+struct canfilter_sub
+{
+    canid_t id;		/*!< Identifiant, CAN_EFF_FLAG si étendu */
+    canid_t mask;	/*!< Masque, CAN_EFF_FLAG sauf masque nul */
+};
+
+/**
+* @brief Filtre d'identifiants CAN
+*/
+struct canfilter
+{
+    int active;						/*!< 0 : toutes les trames passent */
+    unsigned char sff[(CAN_SFF_MASK + 1) / 8];		/*!< Identifiants standards acceptés */
+    struct canfilter_sub subs[CANFILTER_MAX];	/*!< Abonnements */
+    unsigned int nb;					/*!< Nombre d'abonnements */
+};
+
+
+/**
+* @brief Vide un filtre et le désactive : toutes les trames passent
+*
+* @param f Le filtre
+*/
+void canfilter_clear(struct canfilter * f);
+
+
+/**
+* @brief Ajoute un abonnement et active le filtre
+*
+* @param f Le filtre
+* @param id L'identifiant
+* @param mask Le masque
+*
+* @returns 0 si OK (ou déjà abonné), 1 si le filtre est plein
+*/
+int canfilter_add(struct canfilter * f, canid_t id, canid_t mask);
+
+
+/**
+* @brief Retire un abonnement, le filtre reste actif
+*
+* @param f Le filtre
+* @param id L'identifiant
+* @param mask Le masque
+*
+* @returns 0 si OK, 1 si l'abonnement n'existe pas
+*/
+int canfilter_remove(struct canfilter * f, canid_t id, canid_t mask);
+
+
+/**
+* @brief Teste si une trame passe le filtre
+*
+* @param f Le filtre
+* @param can_id Identifiant de la trame, flags compris
+*
+* @returns 1 si la trame passe, 0 sinon
+*/
+int canfilter_match(const struct canfilter * f, canid_t can_id);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
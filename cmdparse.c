@@ -0,0 +1,132 @@
+/**
+ * @file cmdparse.c
+ *
+ * @brief Découpage incrémental des données reçues d'un client TCP en commandes.
+ */
+
+#include <string.h>
+
+#include "canbin.h"
+#include "cmdparse.h"
+
+
+void cmdparse_clear(struct cmdparse * p)
+{
+    p->len = 0;
+    p->toolong = 0;
+}
+
+
+/** @brief Consomme n octets du morceau */
+static void cmdparse_skip(char ** data, unsigned int * size, unsigned int n)
+{
+    *data += n;
+    *size -= n;
+}
+
+
+int cmdparse_next(struct cmdparse * p, char ** data, unsigned int * size,
+                  char ** cmd, unsigned int * len)
+{
+    char * d, * nl, * line;
+    unsigned int n, rec;
+
+    while(*size > 0)
+    {
+	d = *data;
+
+	/* Enregistrement binaire : complet dans le morceau, ou à compléter */
+	if(p->len == 0 && !p->toolong && (rec = canbin_record_size(d[0])) != 0)
+	{
+	    if(*size >= rec)
+	    {
+		cmdparse_skip(data, size, rec);
+		*cmd = d;
+		*len = rec;
+		return CMDPARSE_RECORD;
+	    }
+	    memcpy(p->buf, d, *size);
+	    p->len = *size;
+	    cmdparse_skip(data, size, *size);
+	    break;
+	}
+	if(p->len > 0 && (rec = canbin_record_size(p->buf[0])) != 0)
+	{
+	    n = rec - p->len;
+	    if(n > *size) n = *size;
+	    memcpy(p->buf + p->len, d, n);
+	    p->len += n;
+	    cmdparse_skip(data, size, n);
+	    if(p->len < rec)
+		break;
+	    p->len = 0;
+	    *cmd = p->buf;
+	    *len = rec;
+	    return CMDPARSE_RECORD;
+	}
+
+	/* Ligne de texte */
+	nl = memchr(d, '\n', *size);
+	n = (nl != NULL) ? (unsigned int)(nl - d) : *size;
+	cmdparse_skip(data, size, (nl != NULL) ? n + 1 : n);
+
+	if(p->toolong)
+	{
+	    /* Fin de la ligne trop longue */
+	    if(nl == NULL)
+		break;
+	    p->toolong = 0;
+	    *cmd = NULL;
+	    *len = 0;
+	    return CMDPARSE_TOOLONG;
+	}
+
+	if(nl == NULL)
+	{
+	    /* Ligne incomplète : gardée jusqu'au morceau suivant */
+	    if(p->len + n > CMDPARSE_LINE_MAX)
+	    {
+		p->toolong = 1;
+		p->len = 0;
+	    }
+	    else
+	    {
+		memcpy(p->buf + p->len, d, n);
+		p->len += n;
+	    }
+	    break;
+	}
+
+	if(p->len == 0)
+	    line = d;
+	else
+	{
+	    if(p->len + n > CMDPARSE_LINE_MAX)
+		n = CMDPARSE_LINE_MAX + 1;
+	    else
+	    {
+		memcpy(p->buf + p->len, d, n);
+		n += p->len;
+	    }
+	    line = p->buf;
+	    p->len = 0;
+	}
+	if(n > CMDPARSE_LINE_MAX)
+	{
+	    *cmd = NULL;
+	    *len = 0;
+	    return CMDPARSE_TOOLONG;
+	}
+
+	if(n > 0 && line[n - 1] == '\r')
+	    n--;
+	line[n] = '\0';
+	if(n == 0)
+	    continue;	/* Ligne vide */
+	*cmd = line;
+	*len = n;
+	return CMDPARSE_LINE;
+    }
+
+    return CMDPARSE_NONE;
+}
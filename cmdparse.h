@@ -0,0 +1,79 @@
+/**
+ * @file cmdparse.h
+ *
+ * @brief Découpage incrémental des données reçues d'un client TCP en commandes.
+ *
+ * Un client envoie des lignes de texte terminées par '\n' (un '\r' final est
+ * ignoré) et des enregistrements binaires de CANBIN_RECORD_SIZE octets, qui
+ * commencent par CANBIN_MAGIC, ou de CANBIN_FD_RECORD_SIZE octets, qui
+ * commencent par CANBIN_MAGIC_FD. Une commande peut arriver en plusieurs
+ * morceaux et un morceau peut contenir plusieurs commandes : cmdparse_next
+ * rend chaque commande complète, dans l'ordre, et garde le début d'une
+ * commande incomplète dans le tampon du parseur jusqu'au morceau suivant.
+ *
+ * Les commandes entières d'un morceau sont rendues en place, sans copie :
+ * le '\n' d'une ligne y est remplacé par un 0. Aucune allocation.
+ */
+
+#ifndef __CMDPARSE_H__
+#define __CMDPARSE_H__
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/** @brief Longueur maximale d'une ligne de commande, '\n' exclu */
+#define CMDPARSE_LINE_MAX 4096
+
+/** @brief Pas de commande complète : morceau entièrement consommé */
+#define CMDPARSE_NONE		0
+/** @brief Ligne de texte, terminée par un 0 */
+#define CMDPARSE_LINE		1
+/** @brief Enregistrement binaire, de la taille donnée par son marqueur */
+#define CMDPARSE_RECORD		2
+/** @brief Ligne de plus de CMDPARSE_LINE_MAX octets, ignorée */
+#define CMDPARSE_TOOLONG	3
+
+/**
+* @brief Parseur d'un client
+*/
+struct cmdparse
+{
+    char buf[CMDPARSE_LINE_MAX + 1];	/*!< Début de la commande incomplète */
+    unsigned int len;			/*!< Octets dans buf */
+    int toolong;			/*!< 1 si la ligne en cours est ignorée jusqu'à son '\n' */
+};
+
+
+/**
+* @brief Vide le parseur
+*
+* @param p Le parseur
+*/
+void cmdparse_clear(struct cmdparse * p);
+
+
+/**
+* @brief Extrait la commande complète suivante d'un morceau reçu
+*
+* Avance *data et *size sur ce qui a été consommé. La commande rendue reste
+* valide jusqu'à l'appel suivant.
+*
+* @param p Le parseur du client
+* @param data Morceau reçu, modifiable
+* @param size Taille du morceau
+* @param cmd Début de la commande
+* @param len Longueur de la commande ('\n' exclu)
+*
+* @returns CMDPARSE_LINE, CMDPARSE_RECORD ou CMDPARSE_TOOLONG ; CMDPARSE_NONE
+* lorsque le morceau est épuisé
+*/
+int cmdparse_next(struct cmdparse * p, char ** data, unsigned int * size,
+                  char ** cmd, unsigned int * len);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
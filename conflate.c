@@ -0,0 +1,85 @@
+/**
+ * @file conflate.c
+ *
+ * @brief Table des dernières valeurs par identifiant CAN (conflation).
+ */
+
+#include <string.h>
+
+#include "conflate.h"
+
+
+/** @brief Compare un slot au couple (identifiant, bus) */
+static int conflate_cmp(const struct conflate_slot * s, canid_t id, unsigned int bus)
+{
+    if(s->cf.can_id != id) return (s->cf.can_id < id) ? -1 : 1;
+    if(s->bus != bus) return (s->bus < bus) ? -1 : 1;
+    return 0;
+}
+
+
+void conflate_clear(struct conflate * c)
+{
+    c->head = c->nb = 0;
+}
+
+
+int conflate_put(struct conflate * c, const struct canfd_frame * cf,
+                 const struct timeval * tv, unsigned int bus)
+{
+    unsigned int lo = c->head, hi = c->nb, mid;
+    int cmp;
+
+    /* Recherche dichotomique de la position du couple */
+    while(lo < hi)
+    {
+	mid = (lo + hi) / 2;
+	cmp = conflate_cmp(&c->slots[mid], cf->can_id, bus);
+	if(cmp == 0)
+	{
+	    c->slots[mid].cf = *cf;
+	    c->slots[mid].tv = *tv;
+	    return 0;
+	}
+	if(cmp < 0) lo = mid + 1;
+	else hi = mid;
+    }
+
+    if(c->nb - c->head >= CONFLATE_SLOTS)
+    {
+	c->dropped++;
+	return 1;
+    }
+
+    /* Tassement en début de table avant insertion */
+    if(c->nb == CONFLATE_SLOTS)
+    {
+	memmove(c->slots, c->slots + c->head, (c->nb - c->head) * sizeof(*c->slots));
+	lo -= c->head;
+	c->nb -= c->head;
+	c->head = 0;
+    }
+
+    memmove(c->slots + lo + 1, c->slots + lo, (c->nb - lo) * sizeof(*c->slots));
+    c->slots[lo].cf = *cf;
+    c->slots[lo].tv = *tv;
+    c->slots[lo].bus = bus;
+    c->nb++;
+    return 0;
+}
+
+
+unsigned int conflate_pending(const struct conflate * c)
+{
+    return c->nb - c->head;
+}
+
+
+int conflate_pop(struct conflate * c, struct conflate_slot * slot)
+{
+    if(c->head == c->nb) return 1;
+
+    *slot = c->slots[c->head++];
+    if(c->head == c->nb) c->head = c->nb = 0;
+    return 0;
+}
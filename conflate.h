@@ -0,0 +1,98 @@
+/**
+ * @file conflate.h
+ *
+ * @brief Table des dernières valeurs par identifiant CAN (conflation).
+ *
+ * Lorsqu'un client TCP ne suit plus le débit, seule la dernière trame de
+ * chaque couple (identifiant, bus) est conservée dans une table de taille
+ * fixe, triée par identifiant puis par bus. Une trame plus récente remplace
+ * celle du même couple ; la table est vidée dans l'ordre des identifiants
+ * lorsque la socket du client se libère.
+ *
+ * La mémoire est bornée à CONFLATE_SLOTS trames : une trame d'un nouveau
+ * couple est perdue (et comptée) lorsque la table est pleine.
+ */
+
+#ifndef __CONFLATE_H__
+#define __CONFLATE_H__
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#include <sys/time.h>
+#include <linux/can.h>
+
+/** @brief Nombre de trames conservées au plus par table */
+#define CONFLATE_SLOTS 256
+
+/**
+* @brief Dernière trame d'un couple (identifiant, bus)
+*/
+struct conflate_slot
+{
+    struct canfd_frame cf;	/*!< Trame */
+    struct timeval tv;		/*!< Date de la trame */
+    unsigned int bus;		/*!< Bus de la trame */
+};
+
+/**
+* @brief Table de conflation, les trames en attente sont slots[head..nb[
+*/
+struct conflate
+{
+    struct conflate_slot slots[CONFLATE_SLOTS];	/*!< Trames triées par identifiant puis bus */
+    unsigned int head;				/*!< Première trame en attente */
+    unsigned int nb;				/*!< Fin des trames en attente */
+    unsigned long dropped;			/*!< Trames perdues, table pleine */
+};
+
+
+/**
+* @brief Vide une table
+*
+* @param c La table
+*/
+void conflate_clear(struct conflate * c);
+
+
+/**
+* @brief Conserve une trame, en remplaçant celle du même couple (identifiant, bus)
+*
+* @param c La table
+* @param cf La trame
+* @param tv Date de la trame
+* @param bus Bus de la trame
+*
+* @returns 0 si OK, 1 si la table est pleine (trame perdue)
+*/
+int conflate_put(struct conflate * c, const struct canfd_frame * cf,
+                 const struct timeval * tv, unsigned int bus);
+
+
+/**
+* @brief Nombre de trames en attente
+*
+* @param c La table
+*
+* @returns le nombre de trames en attente
+*/
+unsigned int conflate_pending(const struct conflate * c);
+
+
+/**
+* @brief Retire la trame en attente de plus petit identifiant
+*
+* @param c La table
+* @param slot Reçoit la trame
+*
+* @returns 0 si OK, 1 si la table est vide
+*/
+int conflate_pop(struct conflate * c, struct conflate_slot * slot);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,365 @@
+/**
+ * @file frameenc.c
+ *
+ * @brief Encodeurs de trames CAN pour la diffusion TCP et l'enregistrement.
+ */
+
+#include <string.h>
+
+#include "canbin.h"
+#include "frameenc.h"
+
+/** @brief Copie une chaîne littérale et avance le pointeur */
+#define PUT_LIT(p, lit) do { memcpy((p), (lit), sizeof(lit) - 1); (p) += sizeof(lit) - 1; } while(0)
+
+/** @brief Chiffres hexadécimaux */
+static const char hex_digits[] = "0123456789ABCDEF";
+
+/** @brief Représentation hexadécimale sur deux caractères de chaque octet */
+static const char hex_bytes[] =
+    "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+
+/** @brief Ecrit un entier en décimal */
+static char * put_dec(char * p, unsigned long v)
+{
+    char tmp[20];
+    int n = 0;
+
+    do
+    {
+	tmp[n++] = '0' + v % 10;
+	v /= 10;
+    } while(v);
+    while(n)
+	*p++ = tmp[--n];
+    return p;
+}
+
+
+/** @brief Ecrit les microsecondes sur six chiffres */
+static char * put_usec(char * p, unsigned long us)
+{
+    int i;
+
+    for(i = 5; i >= 0; i--)
+    {
+	p[i] = '0' + us % 10;
+	us /= 10;
+    }
+    return p + 6;
+}
+
+
+/** @brief Ecrit un entier en hexadécimal, sans zéros de tête (comme "%X") */
+static char * put_hex(char * p, unsigned int v)
+{
+    int shift = 28;
+
+    while(shift > 0 && (v >> shift) == 0)
+	shift -= 4;
+    for(; shift >= 0; shift -= 4)
+	*p++ = hex_digits[(v >> shift) & 0xF];
+    return p;
+}
+
+
+/** @brief Ecrit un entier en hexadécimal sur un nombre fixe de chiffres */
+static char * put_hex_fixed(char * p, unsigned int v, int digits)
+{
+    int i;
+
+    for(i = digits - 1; i >= 0; i--)
+    {
+	p[i] = hex_digits[v & 0xF];
+	v >>= 4;
+    }
+    return p + digits;
+}
+
+
+/** @brief Longueur des données d'une trame, bornée à CANFD_MAX_DLEN */
+#define FRAME_LEN(cf) ((cf)->len > CANFD_MAX_DLEN ? CANFD_MAX_DLEN : (cf)->len)
+
+/** @brief Ecrit les données de la trame, deux chiffres hexadécimaux par octet */
+static char * put_data(char * p, const struct canfd_frame * cf)
+{
+    int i, len = FRAME_LEN(cf);
+
+    for(i = 0; i < len; i++, p += 2)
+	memcpy(p, hex_bytes + 2 * cf->data[i], 2);
+    return p;
+}
+
+
+/** @brief Ecrit le nom de l'interface (IFNAMSIZ caractères au plus) */
+static char * put_iface(char * p, const char * iface)
+{
+    int i;
+
+    for(i = 0; iface != NULL && i < 16 && iface[i] != '\0'; i++)
+	*p++ = iface[i];
+    return p;
+}
+
+
+/** @brief Ecrit l'interface : son nom, ou "bus<numéro>" si elle n'en a pas */
+static char * put_bus(char * p, const char * iface, unsigned int bus)
+{
+    if(iface != NULL && iface[0] != '\0')
+	return put_iface(p, iface);
+    PUT_LIT(p, "bus");
+    return put_dec(p, bus);
+}
+
+
+/** @brief Ecrit la date en secondes.microsecondes */
+static char * put_time(char * p, const struct timeval * tv)
+{
+    p = put_dec(p, tv->tv_sec);
+    *p++ = '.';
+    return put_usec(p, tv->tv_usec);
+}
+
+
+/** @brief Identifiant de la trame sans flags */
+static unsigned int frame_id(const struct canfd_frame * cf)
+{
+    if(cf->can_id & CAN_ERR_FLAG)
+	return cf->can_id & CAN_ERR_MASK;
+    if(cf->can_id & CAN_EFF_FLAG)
+	return cf->can_id & CAN_EFF_MASK;
+    return cf->can_id & CAN_SFF_MASK;
+}
+
+
+/** @brief Ecrit l'identifiant comme candump : 3 chiffres en standard, 8 en étendu */
+static char * put_id(char * p, const struct canfd_frame * cf)
+{
+    if(cf->can_id & CAN_ERR_FLAG)
+	return put_hex_fixed(p, cf->can_id & (CAN_ERR_MASK | CAN_ERR_FLAG), 8);
+    if(cf->can_id & CAN_EFF_FLAG)
+	return put_hex_fixed(p, cf->can_id & CAN_EFF_MASK, 8);
+    return put_hex_fixed(p, cf->can_id & CAN_SFF_MASK, 3);
+}
+
+
+/**
+* @brief Ecrit l'élément <trame> d'une trame, sans prologue ni racine
+*
+* @param out Tampon de sortie (FRAMEENC_MAX_SIZE octets)
+* @param cf La trame
+* @param tv Date de la trame
+* @param iface Nom de l'interface de la trame, ou NULL
+*
+* @returns Le nombre d'octets écrits
+*/
+unsigned int frameenc_xml_trame(char * out, const struct canfd_frame * cf,
+                                const struct timeval * tv, const char * iface)
+{
+    char * p = out;
+    int i, len = FRAME_LEN(cf);
+
+    PUT_LIT(p, "<trame>");
+    if(iface != NULL)
+    {
+	PUT_LIT(p, "<iface>");
+	p = put_iface(p, iface);
+	PUT_LIT(p, "</iface>");
+    }
+    PUT_LIT(p, "<id>0x");
+    p = put_hex(p, frame_id(cf));
+    PUT_LIT(p, "</id><dlc>");
+    p = put_dec(p, cf->len);
+    PUT_LIT(p, "</dlc>");
+    if(cf->can_id & CAN_EFF_FLAG)
+	PUT_LIT(p, "<eff>1</eff>");
+    if(cf->can_id & CAN_RTR_FLAG)
+	PUT_LIT(p, "<rtr>1</rtr>");
+    if(cf->can_id & CAN_ERR_FLAG)
+	PUT_LIT(p, "<err>1</err>");
+    if(cf->flags & CANFD_FDF)
+    {
+	/* Trame CAN FD : flags BRS (1) et ESI (2) */
+	PUT_LIT(p, "<fd>");
+	p = put_dec(p, cf->flags & (CANFD_BRS | CANFD_ESI));
+	PUT_LIT(p, "</fd>");
+    }
+    PUT_LIT(p, "<timestamp>");
+    p = put_time(p, tv);
+    PUT_LIT(p, "</timestamp><data>");
+    if(cf->can_id & CAN_RTR_FLAG)
+	len = 0;
+    for(i = 0; i < len; i++)
+    {
+	PUT_LIT(p, "<data");
+	p = put_dec(p, i);
+	PUT_LIT(p, ">0x");
+	p = put_hex(p, cf->data[i]);
+	PUT_LIT(p, "</data");
+	p = put_dec(p, i);
+	*p++ = '>';
+    }
+    PUT_LIT(p, "</data></trame>");
+    return p - out;
+}
+
+
+/** @brief Document XML : prologue, racine au nom de l'interface, <trame> */
+static unsigned int enc_xml(char * out, const struct canfd_frame * cf,
+                            const struct timeval * tv, const char * iface,
+                            unsigned int bus)
+{
+    char * p = out;
+
+    PUT_LIT(p, "<?xml version=\"1.0\" encoding=\"UTF-8\"?><");
+    p = put_bus(p, iface, bus);
+    *p++ = '>';
+    p += frameenc_xml_trame(p, cf, tv, NULL);
+    PUT_LIT(p, "</");
+    p = put_bus(p, iface, bus);
+    PUT_LIT(p, ">\n");
+    return p - out;
+}
+
+
+/** @brief Une ligne JSON */
+static unsigned int enc_json(char * out, const struct canfd_frame * cf,
+                             const struct timeval * tv, const char * iface,
+                             unsigned int bus)
+{
+    char * p = out;
+
+    PUT_LIT(p, "{\"ts\":");
+    p = put_time(p, tv);
+    PUT_LIT(p, ",\"iface\":\"");
+    p = put_bus(p, iface, bus);
+    PUT_LIT(p, "\",\"bus\":");
+    p = put_dec(p, bus);
+    PUT_LIT(p, ",\"id\":\"");
+    p = put_id(p, cf);
+    PUT_LIT(p, "\",\"dlc\":");
+    p = put_dec(p, cf->len);
+    if(cf->flags & CANFD_FDF)
+    {
+	PUT_LIT(p, ",\"fd\":");
+	p = put_dec(p, cf->flags & (CANFD_BRS | CANFD_ESI));
+    }
+    if(cf->can_id & CAN_EFF_FLAG)
+	PUT_LIT(p, ",\"eff\":1");
+    if(cf->can_id & CAN_RTR_FLAG)
+	PUT_LIT(p, ",\"rtr\":1");
+    if(cf->can_id & CAN_ERR_FLAG)
+	PUT_LIT(p, ",\"err\":1");
+    PUT_LIT(p, ",\"data\":\"");
+    if(!(cf->can_id & CAN_RTR_FLAG))
+	p = put_data(p, cf);
+    PUT_LIT(p, "\"}\n");
+    return p - out;
+}
+
+
+/** @brief Une ligne au format log de candump : (date) iface id#données, id##<flags>données en FD */
+static unsigned int enc_candump(char * out, const struct canfd_frame * cf,
+                                const struct timeval * tv, const char * iface,
+                                unsigned int bus)
+{
+    char * p = out;
+
+    *p++ = '(';
+    p = put_time(p, tv);
+    PUT_LIT(p, ") ");
+    p = put_bus(p, iface, bus);
+    *p++ = ' ';
+    p = put_id(p, cf);
+    *p++ = '#';
+    if(cf->flags & CANFD_FDF)
+    {
+	*p++ = '#';
+	*p++ = hex_digits[cf->flags & (CANFD_BRS | CANFD_ESI)];
+	p = put_data(p, cf);
+    }
+    else if(cf->can_id & CAN_RTR_FLAG)
+    {
+	/* Longueur demandée, comme candump */
+	*p++ = 'R';
+	if(cf->len > 0 && cf->len <= CAN_MAX_DLEN)
+	    *p++ = hex_digits[cf->len];
+    }
+    else
+	p = put_data(p, cf);
+    *p++ = '\n';
+    return p - out;
+}
+
+
+/** @brief Une ligne CSV : date,iface,id,dlc,données ("R" pour une trame RTR) */
+static unsigned int enc_csv(char * out, const struct canfd_frame * cf,
+                            const struct timeval * tv, const char * iface,
+                            unsigned int bus)
+{
+    char * p = out;
+
+    p = put_time(p, tv);
+    *p++ = ',';
+    p = put_bus(p, iface, bus);
+    *p++ = ',';
+    p = put_id(p, cf);
+    *p++ = ',';
+    p = put_dec(p, cf->len);
+    *p++ = ',';
+    if(cf->can_id & CAN_RTR_FLAG)
+	*p++ = 'R';
+    else
+	p = put_data(p, cf);
+    *p++ = '\n';
+    return p - out;
+}
+
+
+/** @brief Enregistrement binaire canbin */
+static unsigned int enc_bin(char * out, const struct canfd_frame * cf,
+                            const struct timeval * tv, const char * iface,
+                            unsigned int bus)
+{
+    (void)iface;
+    return canbin_pack((unsigned char *)out, cf, tv, bus);
+}
+
+
+/** @brief Encodeurs, indexés par FRAMEENC_* */
+const struct frame_encoder frameenc_table[FRAMEENC_COUNT] =
+{
+    { "xml", enc_xml },
+    { "json", enc_json },
+    { "candump", enc_candump },
+    { "csv", enc_csv },
+    { "bin", enc_bin }
+};
+
+
+/**
+* @brief Cherche un encodeur par son nom
+*
+* @param name Nom de l'encodeur (pas forcément terminé par un 0)
+* @param len Longueur du nom
+*
+* @returns L'indice FRAMEENC_* de l'encodeur, -1 si inconnu
+*/
+int frameenc_find(const char * name, size_t len)
+{
+    int i;
+
+    for(i = 0; i < FRAMEENC_COUNT; i++)
+	if(strlen(frameenc_table[i].name) == len
+	   && memcmp(frameenc_table[i].name, name, len) == 0)
+	    return i;
+    return -1;
+}
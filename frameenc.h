@@ -0,0 +1,121 @@
+/**
+ * @file frameenc.h
+ *
+ * @brief Encodeurs de trames CAN pour la diffusion TCP et l'enregistrement.
+ *
+ * Chaque encodeur écrit une trame dans un tampon fourni par l'appelant, d'au
+ * moins FRAMEENC_MAX_SIZE octets, et retourne le nombre d'octets écrits. Les
+ * encodeurs n'allouent pas de mémoire et n'utilisent pas la famille printf :
+ * les conversions hexadécimales et décimales passent par des tables.
+ *
+ * | Encodeur | Sortie (une trame)                                             |
+ * |----------|----------------------------------------------------------------|
+ * | xml      | Document XML complet : prologue, racine <iface>, <trame>       |
+ * | json     | {"ts":1700000000.123456,"iface":"can0","bus":0,"id":"123","dlc":2,"data":"11AA"} |
+ * | candump  | (1700000000.123456) can0 123#11AA  (format candump -l)         |
+ * | csv      | 1700000000.123456,can0,123,2,11AA                              |
+ * | bin      | Enregistrement canbin de CANBIN_RECORD_SIZE octets (canbin.h)   |
+ *
+ * Les trames CAN FD (CANFD_FDF) portent jusqu'à 64 octets de données, dlc
+ * étant alors la longueur des données. Elles sont marquées comme le fait
+ * candump : élément <fd> en XML, champ "fd" en JSON, "123##1" + données en
+ * candump, la valeur étant les flags BRS (1) et ESI (2). Le CSV ne donne que la
+ * longueur ; en binaire, au-delà de 8 octets, l'enregistrement est long
+ * (CANBIN_FD_RECORD_SIZE octets).
+ *
+ * Les flags d'identifiant suivent aussi candump : identifiant sur 8 chiffres
+ * pour une trame étendue (EFF) ou d'erreur (ERR), "123#R" suivi de la longueur
+ * demandée pour une trame RTR, sans données ("R" dans la colonne des données en
+ * CSV). Le XML donne l'identifiant sans flags et les éléments <eff>, <rtr> et
+ * <err>, le JSON les champs "eff", "rtr" et "err", présents seulement s'ils
+ * valent 1. L'enregistrement binaire conserve les trois flags.
+ *
+ * Les sorties texte se terminent par un saut de ligne. Chaque sortie porte
+ * l'interface de la trame : son nom dans les formats texte ("bus<numéro>" si
+ * elle n'a pas de nom), son numéro de bus en JSON (champ "bus") et dans
+ * l'enregistrement binaire.
+ */
+
+#ifndef __FRAMEENC_H__
+#define __FRAMEENC_H__
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#include <stddef.h>
+#include <sys/time.h>
+#include <linux/can.h>
+
+/** @brief Document XML par trame (encodage historique, par défaut) */
+#define FRAMEENC_XML		0
+/** @brief Une ligne JSON par trame */
+#define FRAMEENC_JSON		1
+/** @brief Une ligne au format log de candump par trame */
+#define FRAMEENC_CANDUMP	2
+/** @brief Une ligne CSV par trame */
+#define FRAMEENC_CSV		3
+/** @brief Enregistrement binaire canbin */
+#define FRAMEENC_BIN		4
+/** @brief Nombre d'encodeurs */
+#define FRAMEENC_COUNT		5
+
+/** @brief Taille minimale du tampon passé à un encodeur (XML d'une trame de 64 octets) */
+#define FRAMEENC_MAX_SIZE	2048
+
+/**
+* @brief Encodeur de trames
+*/
+struct frame_encoder
+{
+    /** Nom de l'encodeur (commande "mode <nom>") */
+    const char * name;
+    /**
+    * Encode une trame dans out (FRAMEENC_MAX_SIZE octets)
+    * et retourne le nombre d'octets écrits.
+    * iface est le nom de l'interface de la trame, bus son numéro.
+    */
+    unsigned int (*encode)(char * out, const struct canfd_frame * cf,
+                           const struct timeval * tv, const char * iface,
+                           unsigned int bus);
+};
+
+/** @brief Encodeurs, indexés par FRAMEENC_* */
+extern const struct frame_encoder frameenc_table[FRAMEENC_COUNT];
+
+
+/**
+* @brief Cherche un encodeur par son nom
+*
+* @param name Nom de l'encodeur (pas forcément terminé par un 0)
+* @param len Longueur du nom
+*
+* @returns L'indice FRAMEENC_* de l'encodeur, -1 si inconnu
+*/
+int frameenc_find(const char * name, size_t len);
+
+
+/**
+* @brief Ecrit l'élément <trame> d'une trame, sans prologue ni racine
+*
+* C'est l'élément qu'ajoute l'enregistrement XML pour chaque trame. Si iface
+* n'est pas NULL, l'interface est donnée par un élément <iface> ; sinon
+* l'interface est celle de la balise racine du document. La date est donnée
+* par <timestamp> en secondes.microsecondes, comme dans les autres formats.
+*
+* @param out Tampon de sortie (FRAMEENC_MAX_SIZE octets)
+* @param cf La trame
+* @param tv Date de la trame
+* @param iface Nom de l'interface de la trame, ou NULL
+*
+* @returns Le nombre d'octets écrits
+*/
+unsigned int frameenc_xml_trame(char * out, const struct canfd_frame * cf,
+                                const struct timeval * tv, const char * iface);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
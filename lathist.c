@@ -0,0 +1,121 @@
+/**
+ * @file lathist.c
+ *
+ * @brief Histogrammes de latence log-linéaires, sans verrou.
+ */
+
+#include <time.h>
+
+#include "lathist.h"
+
+struct lathist lathist_stage[LATHIST_STAGES];
+
+const char * const lathist_name[LATHIST_STAGES] =
+{
+    "rx", "dispatch", "encode", "enqueue", "write"
+};
+
+
+/** @brief Case d'une valeur */
+static unsigned int lathist_bucket(unsigned long long v)
+{
+    unsigned int e;
+
+    if(v < 16) return v;
+    e = 63 - __builtin_clzll(v);
+    return 16 + (e - 4) * 8 + ((v >> (e - 3)) & 7);
+}
+
+
+/** @brief Plus grande valeur d'une case */
+static unsigned long long lathist_upper(unsigned int i)
+{
+    unsigned int e;
+
+    if(i < 16) return i;
+    e = (i - 16) / 8 + 4;
+    return ((8ULL + (i - 16) % 8 + 1) << (e - 3)) - 1;
+}
+
+
+void lathist_record(struct lathist * h, unsigned long long ns)
+{
+    unsigned long long max;
+
+    atomic_fetch_add_explicit(&h->count[lathist_bucket(ns)], 1, memory_order_relaxed);
+
+    max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while(ns > max
+	  && !atomic_compare_exchange_weak_explicit(&h->max, &max, ns,
+	                                            memory_order_relaxed, memory_order_relaxed))
+	;
+}
+
+
+void lathist_record_since(struct lathist * h, const struct timeval * origin)
+{
+    struct timespec now;
+    long long ns;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    ns = (long long)(now.tv_sec - origin->tv_sec) * 1000000000LL
+	+ now.tv_nsec - (long long)origin->tv_usec * 1000;
+    lathist_record(h, (ns > 0) ? ns : 0);
+}
+
+
+unsigned long lathist_count(const struct lathist * h)
+{
+    unsigned long total = 0;
+    unsigned int i;
+
+    for(i = 0; i < LATHIST_BUCKETS; i++)
+	total += atomic_load_explicit(&h->count[i], memory_order_relaxed);
+    return total;
+}
+
+
+unsigned long long lathist_percentile(const struct lathist * h, double p)
+{
+    unsigned long count[LATHIST_BUCKETS];
+    unsigned long total = 0, rank, cumul = 0;
+    unsigned long long max;
+    unsigned int i;
+
+    /* Instantané : les cases peuvent évoluer pendant la lecture */
+    for(i = 0; i < LATHIST_BUCKETS; i++)
+    {
+	count[i] = atomic_load_explicit(&h->count[i], memory_order_relaxed);
+	total += count[i];
+    }
+    if(total == 0) return 0;
+
+    rank = (unsigned long)(p * total);
+    if(rank < 1) rank = 1;
+    if(rank > total) rank = total;
+
+    max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    for(i = 0; i < LATHIST_BUCKETS; i++)
+    {
+	cumul += count[i];
+	if(cumul >= rank)
+	    return (lathist_upper(i) < max) ? lathist_upper(i) : max;
+    }
+    return max;
+}
+
+
+unsigned long long lathist_max(const struct lathist * h)
+{
+    return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+
+void lathist_reset(struct lathist * h)
+{
+    unsigned int i;
+
+    for(i = 0; i < LATHIST_BUCKETS; i++)
+	atomic_store_explicit(&h->count[i], 0, memory_order_relaxed);
+    atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+}
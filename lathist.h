@@ -0,0 +1,129 @@
+/**
+ * @file lathist.h
+ *
+ * @brief Histogrammes de latence log-linéaires, sans verrou.
+ *
+ * Chaque étape du chemin d'une trame, de son arrivée sur le bus CAN à son
+ * écriture sur une socket TCP, enregistre la latence écoulée depuis la date
+ * d'arrivée noyau de la trame (SO_TIMESTAMP) :
+ *
+ * | Etape    | Frontière mesurée                                       |
+ * |----------|---------------------------------------------------------|
+ * | rx       | Trame lue par recvmmsg() dans le thread de l'interface  |
+ * | dispatch | Trame confiée aux binds de réception (can_rx)           |
+ * | encode   | Trame encodée pour un client                            |
+ * | enqueue  | Trame acceptée par la file d'émission d'un client       |
+ * | write    | Dernier octet de la trame écrit sur la socket du client |
+ *
+ * Les valeurs sont en nanosecondes. Les 16 premières valeurs ont chacune leur
+ * case, puis chaque puissance de deux est découpée en 8 cases linéaires :
+ * l'erreur relative d'un percentile est au plus de 12,5 %. L'enregistrement
+ * n'est qu'un incrément atomique relâché : les histogrammes peuvent être
+ * alimentés par plusieurs threads et lus à tout moment.
+ */
+
+#ifndef __LATHIST_H__
+#define __LATHIST_H__
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#include <stdatomic.h>
+#include <sys/time.h>
+
+/** @brief Lecture de la trame sur la socket CAN */
+#define LATHIST_RX		0
+/** @brief Dispatch vers les binds de réception */
+#define LATHIST_DISPATCH	1
+/** @brief Encodage de la trame */
+#define LATHIST_ENCODE		2
+/** @brief Mise en file d'émission TCP */
+#define LATHIST_ENQUEUE		3
+/** @brief Ecriture sur la socket TCP */
+#define LATHIST_WRITE		4
+/** @brief Nombre d'étapes */
+#define LATHIST_STAGES		5
+
+/** @brief Nombre de cases d'un histogramme (valeurs sur 64 bits) */
+#define LATHIST_BUCKETS		(16 + 60 * 8)
+
+/**
+* @brief Histogramme de latence
+*/
+struct lathist
+{
+    atomic_ulong count[LATHIST_BUCKETS];	/*!< Nombre de valeurs par case */
+    atomic_ullong max;				/*!< Plus grande valeur enregistrée */
+};
+
+/** @brief Histogrammes des étapes, indexés par LATHIST_* */
+extern struct lathist lathist_stage[LATHIST_STAGES];
+/** @brief Noms des étapes (commande "latency") */
+extern const char * const lathist_name[LATHIST_STAGES];
+
+
+/**
+* @brief Enregistre une valeur
+*
+* @param h L'histogramme
+* @param ns La latence en nanosecondes
+*/
+void lathist_record(struct lathist * h, unsigned long long ns);
+
+
+/**
+* @brief Enregistre la latence écoulée depuis une date
+*
+* @param h L'histogramme
+* @param origin Date d'arrivée de la trame (temps réel)
+*/
+void lathist_record_since(struct lathist * h, const struct timeval * origin);
+
+
+/**
+* @brief Nombre de valeurs enregistrées
+*
+* @param h L'histogramme
+*
+* @returns le nombre de valeurs
+*/
+unsigned long lathist_count(const struct lathist * h);
+
+
+/**
+* @brief Percentile d'un histogramme
+*
+* @param h L'histogramme
+* @param p Le percentile, entre 0 et 1 (0.99 pour p99)
+*
+* @returns la borne haute de la case du percentile en ns, 0 si vide
+*/
+unsigned long long lathist_percentile(const struct lathist * h, double p);
+
+
+/**
+* @brief Plus grande valeur enregistrée
+*
+* @param h L'histogramme
+*
+* @returns la valeur en ns
+*/
+unsigned long long lathist_max(const struct lathist * h);
+
+
+/**
+* @brief Remet un histogramme à zéro
+*
+* Les valeurs enregistrées pendant la remise à zéro peuvent être perdues.
+*
+* @param h L'histogramme
+*/
+void lathist_reset(struct lathist * h);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
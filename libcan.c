@@ -7,6 +7,7 @@
 
 
 
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,78 +15,144 @@
 #include <pthread.h>
 #include <string.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
-#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <signal.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <stddef.h>
 #include <net/if.h>
 
+#include <linux/can/bcm.h>
+#include <linux/can/raw.h>
+
 #include "libcan.h"
+#include "lathist.h"
 #include "CServerTcpIP.h"
 
-/** @brief  File descriptor du Socket CAN */
-static int socket_can;
-
-/** @brief File descriptor de la fifo en lecture */
-static int fifofd_rd;
-/** @brief File descriptor de la fifo en écriture */
-static int fifofd_wr;
 /** @brief Constante sensée être dans les headers systèmes : linux, libc, etc...*/
 #define AF_CAN 29
 /** @brief Constante sensée être dans les headers systèmes : linux, libc, etc...*/
 #define PF_CAN 29
-/** @brief Nom du fichier contenant la fifo générée aléatoirement */
-static char fifo[L_tmpnam] = {0,};
 
-/** @brief  Variable d'état de la lib : 1=>OK; 0=>KO */
-static int can_ok=0;
+/** @brief Nombre de trames de l'anneau d'émission (puissance de 2) */
+#ifndef CAN_TX_RING_SIZE
+#define CAN_TX_RING_SIZE 1024
+#endif
+/** @brief Nombre maximum de trames émises par appel à sendmmsg() */
+#ifndef CAN_TX_BATCH
+#define CAN_TX_BATCH 32
+#endif
+/** @brief Nouveaux essais d'un envoi refusé faute de place dans le noyau (1 ms chacun) */
+#ifndef CAN_TX_RETRIES
+#define CAN_TX_RETRIES 10
+#endif
+/** @brief Taille des données de contrôle reçues avec chaque trame (timestamp, pertes) */
+#define CAN_RX_CMSG_SIZE (CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(uint32_t)))
+
+/** @brief Nombre de trames lues par défaut à chaque appel de recvmmsg() */
+#ifndef CAN_RX_BATCH
+#define CAN_RX_BATCH 32
+#endif
+
+/** @brief Calcule le minimum entre a et b */
+#define MIN(a,b) (((a)<(b))? (a) : (b))
+/** @brief Calcule le maximum entre a et b */
+#define MAX(a,b) (((a)>(b))? (a) : (b))
 
+/** @brief Octets utiles d'une trame : en-tête et données, sans le reste du tableau data */
+#define CAN_FRAME_USED(cf) (offsetof(struct canfd_frame, data) + MIN((cf)->len, CANFD_MAX_DLEN))
+/** @brief Taille d'écriture/lecture sur le socket : CANFD_MTU pour une trame FD */
+#define CAN_FRAME_MTU(cf) (((cf)->flags & CANFD_FDF) ? CANFD_MTU : CAN_MTU)
 
-/** @brief Thread principal de la lib */
-static pthread_t can_thread;
+/**
+* @brief Case de l'anneau d'émission
+*
+* Le numéro de séquence indique l'état de la case : seq == pos, libre pour le
+* producteur de la position pos ; seq == pos + 1, trame publiée à lire.
+*/
+struct tx_slot
+{
+    atomic_uint seq;		/*!< Numéro de séquence de la case */
+    struct canfd_frame frame;	/*!< Trame à émettre */
+};
 
-/** @brief Variable permettant à la lib de s'arreter proprement : 1=OK, 0=STOP! */
-static int volatile continu = 1;
 /**
 * @brief Binds de reception : Association d'un identifiant+masque à une zone
 * 	mémoire et à un calback
 */
 struct bind_rx
 {
-    unsigned short id; 		/*!< Identifiant CAN*/
-    unsigned short mask;	/*!< Masque */
+    canid_t id; 		/*!< Identifiant CAN, normalisé par can_id_norm */
+    canid_t mask;		/*!< Masque, normalisé par can_id_norm */
     void * pmem;		/*!< Zone mémoire à remplir. Ignorée si NULL */
-    unsigned char len;		/*!< Longueur de la zone mémoire.*/
-    void (*callback)
-	(CServerTcpIP *this, struct can_frame cf);	/*!< callback à appeler lors d'un match du message. Ignoré si NULL */
+    unsigned short len;		/*!< Longueur de la zone mémoire.*/
+    can_callback_t callback;	/*!< callback à appeler lors d'un match du message. Ignoré si NULL */
 };
 
-/** @brief Nombre maximum de binds actif en reception */
-#define MAX_RX_BINDS 10
-/** @brief Tableau des binds en reception */
-static struct bind_rx binds_rx[MAX_RX_BINDS];
-/** @brief Pointeur sur l'élément du tableau de bind pas encore rempli */
-static struct bind_rx * ptr_bind_rx_max = binds_rx;
+/** @brief Nombre d'identifiants standards (11 bits) */
+#define CAN_SFF_IDS (CAN_SFF_MASK + 1)
 
+/** @brief Masque normalisé d'un bind exact sur un identifiant standard */
+#define CAN_SFF_EXACT (CAN_SFF_MASK | CAN_EFF_FLAG)
 
 /**
-* @brief Vérifie les binds sur reception d'un message CAN
-*
-* can_rx est appelée lors de la reception d'un message.
-* Elle cherche alors un bind qui correspond au message reçu.
-* Si elle en trouve, alors elle rempli (si cela à lieu d'être) la zone mémoire
-* et appelle le callback du bind.
+* @brief Groupe de binds de même masque
 *
-* @param cf Le message reçu
+* Les binds du groupe sont rangés par clé (identifiant & masque) dans une table
+* de hachage à adressage ouvert : une trame coûte une recherche par masque
+* distinct (identifiants 29 bits exacts, masques de PGN J1939...), quel que
+* soit le nombre de binds.
 */
-static void can_rx(struct can_frame cf);
+struct rx_group
+{
+    canid_t mask;		/*!< Masque commun */
+    unsigned int slot;		/*!< Première case du groupe dans slots */
+    unsigned int size;		/*!< Nombre de cases (puissance de 2) */
+};
 
-/** @brief Calcule le minimum entre a et b */
-#define MIN(a,b) (((a)<(b))? (a) : (b))
-/** @brief Calcule le maximum entre a et b */
-#define MAX(a,b) (((a)>(b))? (a) : (b))
+/**
+* @brief Case de la table de hachage d'un groupe
+*/
+struct rx_slot
+{
+    canid_t key;		/*!< Identifiant & masque */
+    unsigned int first;		/*!< Début des binds de la clé dans members */
+    unsigned int nb;		/*!< Nombre de binds de la clé, 0 si case libre */
+};
+
+/**
+* @brief Table de dispatch en reception, immuable une fois publiée
+*
+* - binds exacts sur un ID standard : indexés directement par identifiant, au
+*   format CSR : les binds de l'ID i sont exact[first[i]] à exact[first[i+1]-1]
+* - autres binds : regroupés par masque, puis hachés par clé dans chaque groupe
+* - nomatch : bit à 1 pour chaque ID standard qui ne correspond à aucun bind
+*
+* Les indices sont croissants : l'ordre d'enregistrement des binds est conservé.
+*/
+struct rx_table
+{
+    struct bind_rx * binds;		/*!< Copie des binds */
+    unsigned int nb;			/*!< Nombre de binds */
+    unsigned int first[CAN_SFF_IDS + 1];	/*!< Début des binds exacts de chaque ID */
+    unsigned int * exact;		/*!< Indices des binds exacts, groupés par ID */
+    struct rx_group * groups;		/*!< Groupes de binds par masque */
+    unsigned int nb_groups;		/*!< Nombre de groupes */
+    struct rx_slot * slots;		/*!< Tables de hachage des groupes */
+    unsigned int * members;		/*!< Indices des binds, groupés par clé */
+    int eff;				/*!< Au moins un bind accepte des trames étendues */
+    const unsigned int ** run_pos;	/*!< Fusion en cours : position par liste (thread principal) */
+    const unsigned int ** run_end;	/*!< Fusion en cours : fin de chaque liste */
+    unsigned char nomatch[CAN_SFF_IDS / 8];	/*!< Chemin rapide "aucun bind" */
+    struct rx_table * next;		/*!< Chaînage des tables retirées */
+};
 
 /**
 * @brief Binds d'émission : Association d'un identifiant+periode à une zone
@@ -93,483 +160,2196 @@ static void can_rx(struct can_frame cf);
 */
 struct bind_tx
 {
-    unsigned short id;		/*!< Identifiant CAN*/
+    canid_t id;			/*!< Identifiant CAN, CAN_EFF_FLAG si étendu */
     void * pmem;		/*!< Zone mémoire à envoyer */
     unsigned short len;		/*!< Longueur de la zone mémoire.*/
     unsigned long period;	/*!< Période d'envoi en ms */
-    struct timeval last_send;	/*!< Date du dernier envoi du message */
+    unsigned long long next;	/*!< Prochaine échéance en ns (CLOCK_MONOTONIC) */
+};
+
+/**
+* @brief Message TX_SETUP du broadcast manager pour une trame
+*/
+struct bcm_tx_msg
+{
+    struct bcm_msg_head head;	/*!< En-tête BCM */
+    struct canfd_frame frame;	/*!< Trame à émettre périodiquement (CAN_FD_FRAME) */
+};
+
+/**
+* @brief Contexte d'une interface CAN
+*
+* Regroupe tout l'état de la lib pour une interface : socket, anneau
+* d'émission, threads, binds de réception et d'émission. Chaque interface a son
+* thread principal et son ordonnanceur, éventuellement fixés sur un CPU.
+*/
+struct can_ctx
+{
+    char name[IFNAMSIZ];	/*!< Nom de l'interface CAN */
+    int cpu;			/*!< CPU des threads de l'interface, -1 si aucun */
+
+    /** @brief  File descriptor du Socket CAN */
+    int socket_can;
+    /** @brief Index de l'interface CAN ouverte */
+    int can_ifindex;
+    /** @brief  Variable d'état de l'interface : 1=>OK; 0=>KO */
+    int can_ok;
+    /** @brief 1 si l'interface accepte les trames CAN FD (MTU CANFD_MTU, CAN_RAW_FD_FRAMES) */
+    int can_fd;
+    /** @brief Thread principal de l'interface */
+    pthread_t can_thread;
+    /** @brief Variable permettant à l'interface de s'arreter proprement : 1=OK, 0=STOP! */
+    int volatile continu;
+
+    /** @brief eventfd réveillant le thread principal lorsque des trames sont à émettre */
+    int tx_eventfd;
+    /** @brief Anneau d'émission multi-producteurs / consommateur unique, sans verrou */
+    struct tx_slot tx_ring[CAN_TX_RING_SIZE];
+    /** @brief Prochaine position réservée par un producteur (can_send) */
+    atomic_uint tx_enqueue_pos;
+    /** @brief Prochaine position lue par le thread principal (seul consommateur) */
+    unsigned int tx_dequeue_pos;
+    /** @brief Nombre de trames en cours d'ajout ou en attente dans l'anneau */
+    atomic_uint tx_pending;
+    /** @brief Lot de trames retirées de l'anneau pour sendmmsg() */
+    struct canfd_frame tx_frames[CAN_TX_BATCH];
+    /** @brief Vecteurs d'entrée/sortie associés au lot émis */
+    struct iovec tx_iov[CAN_TX_BATCH];
+    /** @brief En-têtes sendmmsg() associés au lot émis */
+    struct mmsghdr tx_msgs[CAN_TX_BATCH];
+
+    /** @brief Tableau des binds en reception (côté écrivains), agrandi à la demande */
+    struct bind_rx * binds_rx;
+    /** @brief Nombre de binds en reception */
+    unsigned int nb_binds_rx;
+    /** @brief Taille allouée du tableau des binds en reception */
+    unsigned int max_binds_rx;
+    /** @brief Protège binds_rx et la publication des tables */
+    pthread_mutex_t rx_mutex;
+    /** @brief Table de dispatch publiée, lue sans verrou par le thread principal */
+    struct rx_table * _Atomic rx_table;
+    /**
+    * @brief Epoque du thread principal : impaire pendant un dispatch
+    *
+    * Un écrivain qui remplace la table attend que l'époque change avant de
+    * libérer l'ancienne (période de grâce à la RCU).
+    */
+    atomic_uint rx_epoch;
+    /** @brief Tables retirées depuis un callback, libérées à la fin du dispatch */
+    struct rx_table * rx_retired;
+
+    /** @brief Nombre maximum de trames lues à chaque appel de recvmmsg() */
+    unsigned int rx_batch;
+    /** @brief Tampon des trames reçues par lot */
+    struct canfd_frame * rx_frames;
+    /** @brief Date d'arrivée de chaque trame du lot (SO_TIMESTAMP) */
+    struct timeval * rx_tv;
+    /** @brief Données de contrôle de chaque trame du lot (timestamp noyau) */
+    char * rx_cmsg;
+    /** @brief Vecteurs d'entrée/sortie associés aux trames */
+    struct iovec * rx_iov;
+    /** @brief En-têtes recvmmsg() associés aux trames */
+    struct mmsghdr * rx_msgs;
+
+    /** @brief Tableau des binds d'émission, agrandi à la demande */
+    struct bind_tx * binds_tx;
+    /** @brief Nombre de binds d'émission */
+    unsigned int nb_binds_tx;
+    /** @brief Taille allouée du tableau des binds d'émission */
+    unsigned int max_binds_tx;
+    /**
+    * @brief Tas binaire des indices de binds_tx, ordonné par échéance
+    *
+    * Le sommet est le prochain bind à émettre : à chaque réveil, l'ordonnanceur
+    * ne touche que les binds arrivés à échéance.
+    */
+    unsigned int * tx_heap;
+    /** @brief Nombre de binds dans le tas (0 avec le backend CAN_TX_BCM) */
+    unsigned int nb_heap_tx;
+    /** @brief Backend des envois périodiques : CAN_TX_USER ou CAN_TX_BCM */
+    int tx_mode;
+    /** @brief Socket du broadcast manager (backend CAN_TX_BCM) */
+    int socket_bcm;
+    /** @brief Protège binds_tx et tx_heap */
+    pthread_mutex_t tx_mutex;
+    /** @brief timerfd (CLOCK_MONOTONIC) armé sur la prochaine échéance */
+    int tx_timerfd;
+    /** @brief Thread de l'ordonnanceur d'émission périodique */
+    pthread_t sched_thread;
+    /** @brief Nombre d'échéances manquées par l'ordonnanceur */
+    unsigned long tx_deadline_misses;
+
+    /** @brief Compteurs du thread principal (réception, dispatch, émission) */
+    struct can_stats stats;
+    /** @brief Trames refusées par can_ctx_send, anneau plein */
+    atomic_ulong tx_full;
+    /** @brief Réveils du thread principal en échec (écriture de l'eventfd) */
+    atomic_ulong tx_wake_errors;
+    /** @brief Dernière valeur du compteur de pertes du socket (SO_RXQ_OVFL) */
+    uint32_t rx_ovfl_last;
 };
 
-/** @brief Nombre maximum de binds d'émission */
-#define MAX_TX_BINDS 10
-/** @brief  Tableau des binds d'émission */
-static struct bind_tx binds_tx[MAX_TX_BINDS];
-/** @brief Pointeur sur l'élément du tableau de bind pas encore rempli */
-static struct bind_tx * ptr_bind_tx_max = binds_tx;
+/** @brief Contexte utilisé par les fonctions sans contexte (can_init, can_send...) */
+static struct can_ctx * can_default = NULL;
+
+/** @brief Contexte en cours de dispatch par le thread courant (appel depuis un callback) */
+static _Thread_local struct can_ctx * rx_dispatch_ctx = NULL;
 
-/* @brief Temps en ms d'avance du déclanchement  d'un envoi avant son échance réel
- * Permet d'envoyer des messages juste avant leurs échéances au lieu de 10ms
- * trop tard */
-#define DELTA_TIME 3
 
 /**
-* @brief Cherche un message à envoyer parmis les binds
+* @brief Vérifie les binds sur reception d'un message CAN
 *
-* can_tx_periodique est appelée périodiquement et est chargée de trouver parmis les
-* binds actifs celui qui a dépassé sa période et d'envoyer le message
-* correspondant.
+* can_rx est appelée lors de la reception d'un message.
+* Elle cherche alors les binds qui correspondent au message reçu.
+* Pour chacun, elle rempli (si cela à lieu d'être) la zone mémoire
+* et appelle le callback du bind.
 *
-* @param signo Signal appelant la fonction (SIGALRM ici)
+* @param ctx L'interface
+* @param tbl Table de dispatch
+* @param cf Le message reçu
 */
-static void can_tx_periodique(int signo);
+static void can_rx(struct can_ctx * ctx, const struct rx_table * tbl, const struct canfd_frame * cf,
+                   const struct timeval * tv);
 
+/**
+* @brief Vérifie les binds pour un lot de messages CAN reçus
+*
+* @param ctx L'interface
+* @param cf Tableau des messages reçus
+* @param n Nombre de messages
+*/
+static void can_rx_batch(struct can_ctx * ctx, const struct canfd_frame * cf,
+                         const struct timeval * tv, int n);
 
 /**
-* @brief Thread principal : Traite les messages reçus pour et depuis le CAN.
+* @brief Recompile le filtre noyau CAN_RAW_FILTER à partir des binds de réception
 *
-* Attend sur le socket CAN et sur la fifo d'envois de message. Dès qu'un message
-* se présente il le traite.
+* @returns 0 si OK, 1 si erreur
 */
-static void * can_thread_fct(void* args)
-{
-    fd_set readfds;
-    struct timeval timeout;
-    int ndfs;
-    struct can_frame msg;
-    args = args;
+static int can_rx_filter_apply(struct can_ctx * ctx);
 
-    /* Initializing select() */
-    while(continu)
-    {
+/**
+* @brief Thread de l'ordonnanceur : émet les binds arrivés à échéance
+*
+* Attend sur le timerfd armé sur l'échéance du sommet du tas, émet chaque bind
+* échu puis réarme le timer.
+*/
+static void * can_sched_fct(void * args);
+
+/** @brief Libère une table de dispatch */
+static void rx_table_free(struct rx_table * tbl);
+/** @brief Date courante en ns sur CLOCK_MONOTONIC */
+static unsigned long long can_now_ns(void);
+/** @brief Remonte l'élément pos du tas vers le sommet */
+static void tx_heap_up(struct can_ctx * ctx, unsigned int pos);
+/** @brief Arme le timerfd sur l'échéance du sommet du tas */
+static void can_sched_arm(struct can_ctx * ctx);
+/** @brief Confie un bind d'émission au broadcast manager du noyau */
+static int can_bcm_setup(struct can_ctx * ctx, struct bind_tx * ptr_bind, int start);
+/** @brief Remplit la trame d'un bind d'émission à partir de sa zone mémoire */
+static void can_bind_frame(const struct bind_tx * ptr_bind, struct canfd_frame * cf);
 
-	FD_ZERO(&readfds);
-	FD_SET(socket_can, &readfds);
-	FD_SET(fifofd_rd, &readfds);
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 100000;
 
-	ndfs = MAX(socket_can, fifofd_rd) + 1;
 
-	while(select(ndfs, &readfds, NULL, NULL, &timeout) > 0) /* Boucle de 100 ms */
+
+/**
+* @brief Lit sur le socket CAN toutes les trames disponibles, par lots
+*
+* Les trames sont lues par recvmmsg() par lots de rx_batch trames au plus, puis
+* chaque lot est transmis en une seule passe à can_rx_batch. La lecture continue
+* tant que les lots sont pleins.
+*
+* Chaque trame est datée par le noyau à son arrivée (SO_TIMESTAMP) ; à défaut
+* elle prend la date de la lecture du lot. La taille lue distingue les trames
+* CAN FD (CANFD_MTU, marquées CANFD_FDF) des trames classiques (CAN_MTU).
+*/
+static void can_rx_drain(struct can_ctx * ctx)
+{
+    int n, i, nvalid;
+    struct timeval now;
+    struct cmsghdr * cmsg;
+    long long us;
+    uint32_t ovfl;
+
+    do
+    {
+	n = recvmmsg(ctx->socket_can, ctx->rx_msgs, ctx->rx_batch, MSG_DONTWAIT, NULL);
+	if(n < 0)
 	{
-	    if(FD_ISSET(socket_can, &readfds))
+	    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
 	    {
-		/* Données reçues sur le CAN */
-		int err;
-
-		/* Lecture des donneés */
-		if(!(err = recv(socket_can, &msg, sizeof(msg), 0)) == sizeof(msg))
-		{
-		    if(err == -1) perror("Recv from socket can");
-		    else fprintf(stderr, "Incomplete read from socket can");
-		}
-		/* Traitement du message reçu */
-		can_rx(msg);
+		perror("Recv from socket can");
+		ctx->stats.rx_errors++;
 	    }
+	    return;
+	}
 
-	    if(FD_ISSET(fifofd_rd, &readfds))
+	/* Elimination des lectures incomplètes, extraction des timestamps */
+	gettimeofday(&now, NULL);
+	nvalid = 0;
+	for(i = 0; i < n; i++)
+	{
+	    if(ctx->rx_msgs[i].msg_len == CANFD_MTU)
+		ctx->rx_frames[i].flags |= CANFD_FDF;
+	    else if(ctx->rx_msgs[i].msg_len == CAN_MTU)
+		ctx->rx_frames[i].flags = 0;
+	    else
 	    {
-		/* Données reçues dans la FIFO d'envoi */
-		int err;
-
-		/* Lecture des données dans la Fifo*/
-		if ((err=read(fifofd_rd, &msg, sizeof(msg))) == sizeof(msg))
+		fprintf(stderr, "Incomplete read from socket can\n");
+		ctx->stats.rx_short++;
+		continue;
+	    }
+	    ctx->rx_tv[nvalid] = now;
+	    for(cmsg = CMSG_FIRSTHDR(&ctx->rx_msgs[i].msg_hdr); cmsg != NULL;
+		cmsg = CMSG_NXTHDR(&ctx->rx_msgs[i].msg_hdr, cmsg))
+	    {
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP)
 		{
-		    /* Envoi de la donnée par le socket CAN */
-		    if(!(err = write(socket_can, &msg, sizeof(msg))) == sizeof(msg))
-		    {
-			if(err== -1)
-			    perror("Writing on socket can");
-			else
-			    fprintf(stderr, "Incomplete Write on socket can");
-		    }
+		    memcpy(&ctx->rx_tv[nvalid], CMSG_DATA(cmsg), sizeof(struct timeval));
+		    us = (now.tv_sec - ctx->rx_tv[nvalid].tv_sec) * 1000000LL
+			+ now.tv_usec - ctx->rx_tv[nvalid].tv_usec;
+		    lathist_record(&lathist_stage[LATHIST_RX], (us > 0) ? us * 1000 : 0);
 		}
-		else
+		else if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
 		{
-		    if(err == -1)
-		    {
-			if(errno != EAGAIN) /* EAGAIN si la fifo est vide */
-			    perror("Read from fifo");
-		    }
-		    else
-		    {
-			if(!err == 0)
-			    fprintf(stderr, "Incomplete read from fifo");
-		    }
+		    /* Compteur cumulé des trames perdues par le noyau sur ce socket */
+		    memcpy(&ovfl, CMSG_DATA(cmsg), sizeof(ovfl));
+		    ctx->stats.rx_overflows += ovfl - ctx->rx_ovfl_last;
+		    ctx->rx_ovfl_last = ovfl;
 		}
-
 	    }
-
-	    /* Réinitialisation de select() */
-
-	    FD_ZERO(&readfds);
-	    FD_SET(socket_can, &readfds);
-	    FD_SET(fifofd_rd, &readfds);
-	    ndfs = MAX(socket_can, fifofd_rd) + 1;
+	    if(nvalid != i) memcpy(&ctx->rx_frames[nvalid], &ctx->rx_frames[i], CAN_FRAME_USED(&ctx->rx_frames[i]));
+	    nvalid++;
 	}
-    }
 
-    pthread_exit(NULL);
+	/* Traitement du lot reçu */
+	ctx->stats.rx_frames += nvalid;
+	can_rx_batch(ctx, ctx->rx_frames, ctx->rx_tv, nvalid);
 
+	/* Longueur du contrôle remise à sa taille pour la lecture suivante */
+	for(i = 0; i < n; i++)
+	    ctx->rx_msgs[i].msg_hdr.msg_controllen = CAN_RX_CMSG_SIZE;
+    }
+    while((unsigned int)n == ctx->rx_batch);
 }
 
 
 /**
-* @brief Initialise la lib_can
+* @brief Retire au plus n trames de l'anneau d'émission
 *
-* Ouvre un socket can en lecture écriture. Crée le thread principal de la
-* lib_can. Crée une fifo pour la communication entre le programme appelant et la
-* lib_can. Crée un timer pour l'appel périodique à la fonction d'envoi.
-* Si la libcan est déjà active, alors il ne se passera rien.
+* N'est appelée que par le thread principal, seul consommateur.
 *
-* @param iface_can chaine pour l'interface CAN (ex : "can0")
+* @param frames Tableau à remplir
+* @param n Nombre maximum de trames à retirer
 *
-* @returns 0 si OK, 1 si socket_can KO, 2 FIFO, 3 Thread can, 4 Timer, 5 libcan active
+* @returns Nombre de trames retirées
 */
-int can_init(const char * iface_can)
+static int can_tx_dequeue(struct can_ctx * ctx, struct canfd_frame * frames, int n)
 {
-   /* Socket CAN */
-    struct ifreq ifr;
-    struct sockaddr_can addr;
-
-   /* Alarme périodique */
-    struct itimerval interval;
+    struct tx_slot * slot;
+    int i;
 
-    if(!can_ok)
+    for(i = 0; i < n; i++)
     {
-	/* Socket CAN */
-	if ((socket_can = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
-		perror("socket");
-		return 1;
-	}
+	slot = &ctx->tx_ring[ctx->tx_dequeue_pos & (CAN_TX_RING_SIZE - 1)];
+	if(atomic_load_explicit(&slot->seq, memory_order_acquire)
+	   != ctx->tx_dequeue_pos + 1)
+	    break; /* Anneau vide ou trame pas encore publiée */
+
+	memcpy(&frames[i], &slot->frame, CAN_FRAME_USED(&slot->frame));
+	atomic_store_explicit(&slot->seq, ctx->tx_dequeue_pos + CAN_TX_RING_SIZE,
+	                      memory_order_release);
+	ctx->tx_dequeue_pos++;
+    }
+    return i;
+}
 
-	addr.can_family = AF_CAN;
 
-	if(iface_can == NULL)
+/**
+* @brief Vide l'anneau d'émission vers le socket CAN
+*
+* Les trames sont retirées par lots de CAN_TX_BATCH et envoyées par sendmmsg(),
+* chacune à sa taille : CANFD_MTU pour une trame FD, CAN_MTU sinon.
+* Si la file d'émission du noyau est pleine (ENOBUFS), la fin du lot est
+* renvoyée après une courte attente, CAN_TX_RETRIES fois au plus ; les trames
+* qui restent non envoyées sont comptées dans tx_errors.
+* Le vidage continue tant que des producteurs ont des trames en cours d'ajout.
+*/
+static void can_tx_drain(struct can_ctx * ctx)
+{
+    struct canfd_frame * frames = ctx->tx_frames;
+    struct iovec * iov = ctx->tx_iov;
+    struct mmsghdr * msgs = ctx->tx_msgs;
+    struct pollfd pfd;
+    uint64_t val;
+    int n, i, sent, ret, retry;
+
+    /* Acquittement du réveil */
+    if(read(ctx->tx_eventfd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+	perror("Read from eventfd");
+
+    while(atomic_load_explicit(&ctx->tx_pending, memory_order_acquire) > 0)
+    {
+	n = can_tx_dequeue(ctx, frames, CAN_TX_BATCH);
+	if(n == 0)
 	{
-	    fprintf(stderr, "Utilisation de \"can0\" comme interface can par defaut\n");
-	    strcpy(ifr.ifr_name, "can0");
-	}
-	else strcpy(ifr.ifr_name, iface_can);
-
-	if (ioctl(socket_can, SIOCGIFINDEX, &ifr) < 0) {
-		perror("SIOCGIFINDEX");
-		return 1;
+	    /* Un producteur a réservé une case mais ne l'a pas encore publiée */
+	    sched_yield();
+	    continue;
 	}
 
-
-	addr.can_ifindex = ifr.ifr_ifindex;
-
-	if (bind(socket_can, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror("bind");
-		return 1;
+	for(i = 0; i < n; i++)
+	{
+	    iov[i].iov_base = &frames[i];
+	    iov[i].iov_len = CAN_FRAME_MTU(&frames[i]);
+	    memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+	    msgs[i].msg_hdr.msg_iov = &iov[i];
+	    msgs[i].msg_hdr.msg_iovlen = 1;
 	}
 
-	/* FIFO */
-	while ((tmpnam(fifo)) != NULL){
-	    if (mkfifo(fifo, 0600) == 0)
-		break;
-	    if (errno != EEXIST)
+	/* Envoi du lot par le socket CAN */
+	for(sent = 0, retry = 0; sent < n; sent += ret)
+	{
+	    ret = sendmmsg(ctx->socket_can, msgs + sent, n - sent, 0);
+	    if(ret <= 0)
 	    {
-		perror("Fifo");
-		return 2;
+		if(ret < 0 && errno == EINTR)
+		{
+		    ret = 0;
+		    continue;
+		}
+		/* File d'émission du noyau pleine : attente, puis renvoi de la fin du lot */
+		if(ret < 0 && (errno == ENOBUFS || errno == EAGAIN) && retry < CAN_TX_RETRIES)
+		{
+		    retry++;
+		    pfd.fd = ctx->socket_can;
+		    pfd.events = POLLOUT;
+		    poll(&pfd, 1, 1);
+		    ret = 0;
+		    continue;
+		}
+		perror("Writing on socket can");
+		ctx->stats.tx_errors += n - sent;
+		break;
 	    }
+	    ctx->stats.tx_frames += ret;
+	    retry = 0;
 	}
-	if (fifo == NULL) return 2;
 
-	if ((fifofd_rd = open(fifo, O_RDONLY | O_NONBLOCK)) < 0) {
-	    perror("open error");
-	    return 2;
-	}
-	if ((fifofd_wr= open(fifo, O_WRONLY)) < 0) {
-	    perror("open(myfunc) error");
-	    return 2;
-	}
+	atomic_fetch_sub_explicit(&ctx->tx_pending, n, memory_order_acq_rel);
+    }
+}
 
-	/* Lancement du thread */
-	if (pthread_create(&can_thread, NULL, can_thread_fct, (void *) NULL)) {
-	    perror("erreur pthread");
-	    return 3;
-	}
 
-	/* Association signal de l'alarme à la fonction can_tx_periodique */
-	signal(SIGALRM, can_tx_periodique);
+/**
+* @brief Thread principal : Traite les messages reçus pour et depuis le CAN.
+*
+* Attend sur le socket CAN et sur l'eventfd de l'anneau d'émission. Dès qu'un
+* message se présente il le traite. Les trames reçues sont lues par lots
+* (can_rx_drain), les trames à émettre envoyées par lots (can_tx_drain).
+*/
+static void * can_thread_fct(void* args)
+{
+    struct can_ctx * ctx = args;
+    struct pollfd pfd[2];
+
+    /* Initialisation de poll() : l'ensemble surveillé ne change pas */
+    pfd[0].fd = ctx->socket_can;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = ctx->tx_eventfd;
+    pfd[1].events = POLLIN;
 
-	/* Création de l'alarme périodique : Le process va recevoir des signaux
-	 * SIGALRM à intervalles réguliers */
-	interval.it_interval.tv_sec = 0;
-	interval.it_interval.tv_usec = 10000;
-	interval.it_value.tv_sec = 0;
-	interval.it_value.tv_usec = 10000;
+    while(ctx->continu)
+    {
+	if(poll(pfd, 2, 100) <= 0) /* Boucle de 100 ms */
+	{
+	    /* Réveil perdu (écriture de l'eventfd en échec) : l'anneau est vidé quand même */
+	    if(atomic_load_explicit(&ctx->tx_pending, memory_order_acquire) > 0)
+		can_tx_drain(ctx);
+	    continue;
+	}
 
-	if(setitimer(ITIMER_REAL,& interval, NULL))
+	if(pfd[0].revents & POLLIN)
 	{
-	    perror("setitimer");
-	    return 4;
+	    /* Données reçues sur le CAN */
+	    can_rx_drain(ctx);
 	}
 
-	can_ok = 1;
+	if(pfd[1].revents & POLLIN)
+	{
+	    /* Trames à émettre dans l'anneau */
+	    can_tx_drain(ctx);
+	}
     }
-    else return 5;
 
-    return 0;
+    pthread_exit(NULL);
+
 }
 
 
 /**
-* @brief Termine la lib_can
+* @brief Fixe le nombre maximum de trames lues par appel à recvmmsg()
 *
-* Attend la fin du thread. Ferme les fifos et le socket, supprime la fifo
-* utilisée.
+* Doit être appelée avant can_init.
 *
-* @returns 0
+* @param ctx L'interface
+* @param batch Taille des lots de réception (>= 1)
+*
+* @returns 0 si OK, 1 si taille invalide, 5 libcan active
 */
-int can_close(void)
+int can_ctx_set_rx_batch(struct can_ctx * ctx, unsigned int batch)
 {
-
-	continu = 0;
-	pthread_join(can_thread, NULL);
-	/* unlike fifo*/
-	close(socket_can);
-	close(fifofd_rd);
-	close(fifofd_wr);
-
-#ifdef DEBUG
-	printf("Fifo supprimee : %s\n", fifo);
-#endif
-	/* Suppression de la fifo temporaire */
-	unlink(fifo);
-	can_ok = 0;
-	return 0;
+    if(ctx->can_ok) return 5;
+    if(batch == 0) return 1;
+    ctx->rx_batch = batch;
+    return 0;
 }
 
 
-
+/**
+* @brief Alloue les tampons de réception par lots
+*
+* @returns 0 si OK, 1 sinon
+*/
+static int can_rx_alloc(struct can_ctx * ctx)
+{
+    unsigned int i;
+
+    ctx->rx_frames = calloc(ctx->rx_batch, sizeof(*ctx->rx_frames));
+    ctx->rx_tv = calloc(ctx->rx_batch, sizeof(*ctx->rx_tv));
+    ctx->rx_cmsg = calloc(ctx->rx_batch, CAN_RX_CMSG_SIZE);
+    ctx->rx_iov = calloc(ctx->rx_batch, sizeof(*ctx->rx_iov));
+    ctx->rx_msgs = calloc(ctx->rx_batch, sizeof(*ctx->rx_msgs));
+    if(ctx->rx_frames == NULL || ctx->rx_tv == NULL || ctx->rx_cmsg == NULL
+       || ctx->rx_iov == NULL || ctx->rx_msgs == NULL)
+	return 1;
+
+    for(i = 0; i < ctx->rx_batch; i++)
+    {
+	ctx->rx_iov[i].iov_base = &ctx->rx_frames[i];
+	ctx->rx_iov[i].iov_len = CANFD_MTU;
+	ctx->rx_msgs[i].msg_hdr.msg_iov = &ctx->rx_iov[i];
+	ctx->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+	ctx->rx_msgs[i].msg_hdr.msg_control = ctx->rx_cmsg + i * CAN_RX_CMSG_SIZE;
+	ctx->rx_msgs[i].msg_hdr.msg_controllen = CAN_RX_CMSG_SIZE;
+    }
+    return 0;
+}
 
 
 /**
-* @brief Donne l'état de la lib_can.
-*
-* @returns 1 si la lib est lancée, 0 sinon.
+* @brief Libère les tampons de réception par lots
 */
-int can_isok()
+static void can_rx_free(struct can_ctx * ctx)
 {
-    return can_ok;
+    free(ctx->rx_frames);
+    free(ctx->rx_tv);
+    free(ctx->rx_cmsg);
+    free(ctx->rx_iov);
+    free(ctx->rx_msgs);
+    ctx->rx_frames = NULL;
+    ctx->rx_tv = NULL;
+    ctx->rx_cmsg = NULL;
+    ctx->rx_iov = NULL;
+    ctx->rx_msgs = NULL;
 }
 
 
 /**
-* @brief Envoi directement un message
-*
-* @param msg message CAN à envoyer
+* @brief Fixe un thread de l'interface sur son CPU
 *
-* @returns 0 si OK, 1 si erreur
+* @param ctx L'interface
+* @param thread Le thread
 */
-int can_send(struct can_frame msg)
+static void can_pin_thread(struct can_ctx * ctx, pthread_t thread)
 {
-	int nbytes;
-
-	/* send frame */
-	if ((nbytes = write(fifofd_wr, &msg, sizeof(msg))) != sizeof(msg)) {
-		perror("Write on fifo");
-		return 1;
-	}
+    cpu_set_t set;
 
-	return 0;
+    if(ctx->cpu < 0)
+	return;
+    CPU_ZERO(&set);
+    CPU_SET(ctx->cpu, &set);
+    if(pthread_setaffinity_np(thread, sizeof(set), &set))
+	fprintf(stderr, "lib_can : %s : affinité CPU %d impossible\n", ctx->name, ctx->cpu);
 }
 
 
 /**
-* @brief Initialise le lancement périodique d'un message CAN
+* @brief Crée le contexte d'une interface CAN
 *
-* Associe un couple identifiant + peride à une zone mémoire.
-* Après l'execution de cette fonction, toutes les période arrondie à 10 ms, la
-* librairie envoi le message CAN ID avec les donneés de la zone mémoire.
+* Le contexte est créé arrêté : les binds et les réglages (can_ctx_set_rx_batch,
+* can_ctx_set_tx_mode, can_ctx_set_cpu) peuvent être faits avant can_ctx_init.
 *
-* @param ID Identifiant CAN
-* @param zone Zone mémoire à envoyer péridiquement
-* @param zone_length Longueur de la zone
-* @param period Période de l'envoi (granularité sur l'envoi : 10ms)
+* @param iface_can chaine pour l'interface CAN (ex : "can0"), "can0" si NULL
 *
-* @returns 1 si OK, !=0 si KO.
+* @returns Le contexte, NULL si erreur d'allocation
 */
-int can_bind_send(unsigned short ID, void * zone, unsigned short zone_length, unsigned long period)
+struct can_ctx * can_ctx_new(const char * iface_can)
 {
-    if((ptr_bind_tx_max - binds_tx) < MAX_TX_BINDS)
-    {
-	/* Remplissage structure Bind */
-	if(!(ID<=0x7FF)) return 1;
-	ptr_bind_tx_max->id = ID;
-
-	if(zone_length > 0) ptr_bind_tx_max->pmem = zone;
-	else ptr_bind_tx_max->pmem = NULL;
+    struct can_ctx * ctx;
 
-	ptr_bind_tx_max->len = zone_length;
-	if(period==0) return 2;
-	ptr_bind_tx_max->period = period;
+    if((ctx = calloc(1, sizeof(*ctx))) == NULL)
+	return NULL;
 
-	gettimeofday(&( ptr_bind_tx_max->last_send), NULL); /* Init du temps */
-
-	ptr_bind_tx_max++;
-    }
-    else
+    if(iface_can == NULL)
     {
-	fprintf(stderr,  "lib_can : Trop de binds: augmenter MAX_TX_BINDS\n");
-	return 3;
+	fprintf(stderr, "Utilisation de \"can0\" comme interface can par defaut\n");
+	iface_can = "can0";
     }
-    return 0;
+    snprintf(ctx->name, sizeof(ctx->name), "%s", iface_can);
+    ctx->cpu = -1;
+    ctx->socket_can = -1;
+    ctx->tx_eventfd = -1;
+    ctx->tx_timerfd = -1;
+    ctx->socket_bcm = -1;
+    ctx->tx_mode = CAN_TX_USER;
+    ctx->rx_batch = CAN_RX_BATCH;
+    pthread_mutex_init(&ctx->rx_mutex, NULL);
+    pthread_mutex_init(&ctx->tx_mutex, NULL);
+    return ctx;
 }
 
 
 /**
-* @brief Cherche un message à envoyer parmis les binds
+* @brief Détruit le contexte d'une interface CAN
 *
-* can_tx_periodique est appelée périodiquement et est chargée de trouver parmis les
-* binds actifs celui qui a dépassé sa période et d'envoyer le message
-* correspondant.
+* Arrête l'interface si elle est active et libère ses binds.
 *
-* @param signo Signal appelant la fonction (SIGALRM ici)
+* @param ctx L'interface
 */
-static void can_tx_periodique(int signo)
+void can_ctx_free(struct can_ctx * ctx)
 {
-    struct timeval now;
-    struct bind_tx * ptr_bind;
-    struct can_frame cf;
-
-    if(signo != SIGALRM)
-	return;
-    gettimeofday(&now, NULL);
-
-#ifdef DEBUG
-    printf("TIC_TX %ld %ld\n", now.tv_sec, now.tv_usec);
-    printf("Recherche Bind_TX actif : ID, ptr_mem, longueur, periode\n");
-#endif
-    /* Recherche Bind d'envoi actif */
-    for(ptr_bind = binds_tx; ptr_bind < ptr_bind_tx_max; ptr_bind++)
-    {
-#ifdef DEBUG
-	printf("Bind_Tx : %#x, %p, %d, %ld\n", ptr_bind->id, ptr_bind->pmem,
-	        ptr_bind->len, ptr_bind->period);
-#endif
-	if( (unsigned)(1000*(now.tv_sec - ptr_bind->last_send.tv_sec)
-	    + (now.tv_usec - ptr_bind->last_send.tv_usec)/1000)
-	    >=  (ptr_bind->period - DELTA_TIME))
-	{
-	    /* Trouvé*/
-#ifdef DEBUG
-	    printf("MATCH_TX! %#x %ld %ld\n", ptr_bind->id,
-		    now.tv_sec, now.tv_usec);
-#endif
-
-	    /* Envoi message */
+    struct rx_table * tbl;
+
+    if(ctx == NULL) return;
+    can_ctx_close(ctx);
+
+    tbl = atomic_load_explicit(&ctx->rx_table, memory_order_acquire);
+    rx_table_free(tbl);
+    free(ctx->binds_rx);
+    free(ctx->binds_tx);
+    free(ctx->tx_heap);
+    pthread_mutex_destroy(&ctx->rx_mutex);
+    pthread_mutex_destroy(&ctx->tx_mutex);
+    if(ctx == can_default)
+	can_default = NULL;
+    free(ctx);
+}
 
-	    cf.can_id = ptr_bind->id;
-	    cf.can_dlc = ptr_bind->len;
-	    memcpy(cf.data, ptr_bind->pmem, ptr_bind->len);
 
-	    can_send(cf);
-	    memcpy(&(ptr_bind->last_send), &now, sizeof(struct timeval));
-	}
-    }
+/**
+* @brief Donne le nom de l'interface CAN d'un contexte
+*
+* @param ctx L'interface
+*
+* @returns Le nom de l'interface (ex : "can0")
+*/
+const char * can_ctx_name(const struct can_ctx * ctx)
+{
+    return ctx->name;
 }
 
 
 /**
-* @brief Bind un ID+masque à un espace mémoire et/ou un callback
+* @brief Fixe les threads d'une interface sur un CPU
 *
-* Associe un couple identifiant + masque à une zone mémoire et/ou à un callback.
-* Après l'execution de cette fonction, si un message reçu respecte la condition
-* "(ID_reçue && mask) == (ID_bind && mask)" alors :
-* 	Si zone n'est pas NULL la mémoire est remplie
-*	si callback n'est pas NULL, callback est appelé
-*
-* @param ID l'identifiant CAN
-* @param mask le masque
-* @param zone la zone mémoire à remplir
-* @param zone_length la taille de la zone mémoire disponible
-* @param callback fonction à appeler lors de la reception
+* Doit être appelée avant can_ctx_init.
 *
-* @returns 0 si OK, !=0 si KO
+* @param ctx L'interface
+* @param cpu Numéro du CPU, -1 pour ne pas fixer les threads (défaut)
 *
+* @returns 0 si OK, 1 si CPU invalide, 5 interface active
 */
-int can_bind_receive(unsigned short ID, unsigned short mask,
-    void * zone, unsigned short zone_length, void (*callback)(CServerTcpIP *this, struct can_frame cf))
+int can_ctx_set_cpu(struct can_ctx * ctx, int cpu)
 {
-    if((ptr_bind_rx_max - binds_rx)<MAX_RX_BINDS)
-    {
-	/* Remplissage structure Bind */
-	if(!(ID<=0x7FF)) return 1;
-	ptr_bind_rx_max->id = ID;
-
-	if(!(mask<=0x7FF)) return 2;
-	ptr_bind_rx_max->mask = mask;
-
-	if(zone_length > 0) ptr_bind_rx_max->pmem = zone;
-	else ptr_bind_rx_max->pmem = NULL;
-
-	ptr_bind_rx_max->len = zone_length;
-
-	ptr_bind_rx_max->callback = callback;
-	ptr_bind_rx_max++;
-    }
-    else
-    {
-	fprintf(stderr,  "lib_can : Trop de binds : augmenter MAX_RX_BINDS\n");
-	return 3;
-    }
+    if(ctx->can_ok) return 5;
+    if(cpu < -1 || cpu >= CPU_SETSIZE) return 1;
+    ctx->cpu = cpu;
     return 0;
 }
 
 
 /**
-* @brief Vérifie les binds sur reception d'un message CAN
+* @brief Démarre une interface CAN
 *
-* can_rx est appelée lors de la reception d'un message.
-* Elle cherche alors un bind qui correspond au message reçu.
-* Si elle en trouve, alors elle rempli (si cela à lieu d'être) la zone mémoire
-* et appelle le callback du bind.
+* Ouvre un socket can en lecture écriture sur l'interface du contexte. Crée le
+* thread principal de l'interface. Crée l'anneau d'émission et son eventfd pour
+* la communication entre le programme appelant et l'interface. Crée le thread
+* d'ordonnancement des envois périodiques et son timerfd. Les threads sont fixés
+* sur le CPU choisi par can_ctx_set_cpu.
+* Si l'interface est déjà active, alors il ne se passera rien. En cas d'échec,
+* les threads déjà lancés sont arrêtés et tout ce qui a été ouvert est libéré.
 *
-* @param cf Le message reçu
+* @param ctx L'interface
+*
+* @returns 0 si OK, 1 si socket_can KO, 2 eventfd, 3 Thread can, 4 Ordonnanceur, 5 libcan active, 6 allocation
 */
-static void can_rx(struct can_frame cf)
+int can_ctx_init(struct can_ctx * ctx)
 {
-#ifdef DEBUG
-    int i;
-    printf("R%3x %d ", cf.can_id, cf.can_dlc);
-    for (i = 0; i<cf.can_dlc; i++)
-    {
-	printf("%02x ", cf.data[i]);
+   /* Socket CAN */
+    struct ifreq ifr;
+    struct sockaddr_can addr;
+
+   /* Ordonnanceur */
+    unsigned long long now;
+
+    unsigned int i;
+    int sock_opt = 1;
+    int ret, can_thread = 0;
+
+    if(ctx->can_ok)
+	return 5;
+
+    /* Socket CAN */
+    if ((ctx->socket_can = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+	perror("socket");
+	return 1;
     }
-    printf("\n");
-#endif /* DEBUG */
 
-    struct bind_rx * ptr_bind;
+    addr.can_family = AF_CAN;
 
-#ifdef DEBUG
-    printf("Recherche Bind_RX actif : ID, mask, ptr_mem, longueur, callback\n");
-#endif
+    strcpy(ifr.ifr_name, ctx->name);
 
-    for(ptr_bind = binds_rx; ptr_bind < ptr_bind_rx_max; ptr_bind++)
-    {
-#ifdef DEBUG
-	printf("Bind_Rx : %#x, %#x, %p, %#x, %p\n", ptr_bind->id,
- 		ptr_bind->mask, ptr_bind->pmem, ptr_bind->len, ptr_bind->callback);
-#endif
-	/* Recherche de Bind correspondant au message reçu */
-	if( (cf.can_id & ptr_bind->mask) == (ptr_bind->id & ptr_bind->mask))
-	{
-#ifdef DEBUG
-	    printf("MATCH_RX!\n");
-#endif
-	    /* Match*/
-	    /* Remplissage mémoire */
-	    if(ptr_bind->pmem != NULL)
-		memcpy(ptr_bind->pmem, cf.data, MIN(ptr_bind->len, cf.can_dlc));
-
-	    /* Appel callback */
-	    if(ptr_bind->callback != NULL)
-		ptr_bind->callback(this, cf);
-	}
+    ret = 1;
+    if (ioctl(ctx->socket_can, SIOCGIFINDEX, &ifr) < 0) {
+	perror("SIOCGIFINDEX");
+	goto erreur;
     }
-}
 
+
+    addr.can_ifindex = ifr.ifr_ifindex;
+    ctx->can_ifindex = ifr.ifr_ifindex;
+
+    if (bind(ctx->socket_can, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	perror("bind");
+	goto erreur;
+    }
+
+    /* Trames CAN FD, si l'interface les accepte (MTU CANFD_MTU) */
+    ctx->can_fd = 0;
+    if (ioctl(ctx->socket_can, SIOCGIFMTU, &ifr) == 0 && ifr.ifr_mtu == CANFD_MTU
+	&& setsockopt(ctx->socket_can, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &sock_opt, sizeof(sock_opt)) == 0)
+	ctx->can_fd = 1;
+
+    /* Date d'arrivée noyau de chaque trame, sinon date de lecture */
+    if (setsockopt(ctx->socket_can, SOL_SOCKET, SO_TIMESTAMP, &sock_opt, sizeof(sock_opt)) < 0) {
+	perror("setsockopt SO_TIMESTAMP");
+    }
+
+    /* Compteur des trames perdues par la file de réception du noyau */
+    ctx->rx_ovfl_last = 0;
+    if (setsockopt(ctx->socket_can, SOL_SOCKET, SO_RXQ_OVFL, &sock_opt, sizeof(sock_opt)) < 0) {
+	perror("setsockopt SO_RXQ_OVFL");
+    }
+
+    /* Filtre noyau : seules les trames attendues par un bind réveillent le thread */
+    pthread_mutex_lock(&ctx->rx_mutex);
+    if (can_rx_filter_apply(ctx)) {
+	pthread_mutex_unlock(&ctx->rx_mutex);
+	goto erreur;
+    }
+    pthread_mutex_unlock(&ctx->rx_mutex);
+
+    /* Anneau d'émission */
+    for (i = 0; i < CAN_TX_RING_SIZE; i++)
+	atomic_init(&ctx->tx_ring[i].seq, i);
+    atomic_init(&ctx->tx_enqueue_pos, 0);
+    atomic_init(&ctx->tx_pending, 0);
+    ctx->tx_dequeue_pos = 0;
+
+    if ((ctx->tx_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+	perror("eventfd");
+	ret = 2;
+	goto erreur;
+    }
+
+    /* Tampons de réception par lots */
+    if (can_rx_alloc(ctx)) {
+	perror("Allocation tampons de reception");
+	ret = 6;
+	goto erreur;
+    }
+
+    /* Lancement du thread */
+    ctx->continu = 1;
+    if (pthread_create(&ctx->can_thread, NULL, can_thread_fct, (void *) ctx)) {
+	perror("erreur pthread");
+	ret = 3;
+	goto erreur;
+    }
+    can_thread = 1;
+    can_pin_thread(ctx, ctx->can_thread);
+
+    /* Ordonnanceur d'émission périodique : timerfd sur CLOCK_MONOTONIC */
+    ret = 4;
+    if ((ctx->tx_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+	perror("timerfd_create");
+	goto erreur;
+    }
+
+    pthread_mutex_lock(&ctx->tx_mutex);
+    if (ctx->tx_mode == CAN_TX_BCM) {
+	/* Broadcast manager facultatif : à défaut, retour à l'ordonnanceur timerfd */
+	addr.can_ifindex = ctx->can_ifindex;
+	if ((ctx->socket_bcm = socket(PF_CAN, SOCK_DGRAM, CAN_BCM)) < 0) {
+	    perror("socket bcm");
+	} else if (connect(ctx->socket_bcm, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	    perror("connect bcm");
+	    close(ctx->socket_bcm);
+	    ctx->socket_bcm = -1;
+	}
+	if (ctx->socket_bcm < 0) {
+	    fprintf(stderr, "lib_can : %s : broadcast manager indisponible, ordonnanceur timerfd\n", ctx->name);
+	    ctx->tx_mode = CAN_TX_USER;
+	}
+    }
+    if (ctx->tx_mode == CAN_TX_BCM) {
+	/* Broadcast manager : une tâche TX_SETUP par bind existant */
+	ctx->nb_heap_tx = 0;
+	for (i = 0; i < ctx->nb_binds_tx; i++)
+	    can_bcm_setup(ctx, &ctx->binds_tx[i], 1);
+    } else {
+	/* Les échéances des binds existants repartent de maintenant */
+	now = can_now_ns();
+	ctx->nb_heap_tx = 0;
+	for (i = 0; i < ctx->nb_binds_tx; i++) {
+	    ctx->binds_tx[i].next = now + ctx->binds_tx[i].period * 1000000ULL;
+	    ctx->tx_heap[ctx->nb_heap_tx++] = i;
+	    tx_heap_up(ctx, i);
+	}
+	can_sched_arm(ctx);
+    }
+    pthread_mutex_unlock(&ctx->tx_mutex);
+
+    if (pthread_create(&ctx->sched_thread, NULL, can_sched_fct, (void *) ctx)) {
+	perror("erreur pthread");
+	goto erreur;
+    }
+    can_pin_thread(ctx, ctx->sched_thread);
+
+    ctx->can_ok = 1;
+    return 0;
+
+erreur:
+    /* Arrêt du thread déjà lancé (boucle de 100 ms), puis libération de tout le reste */
+    ctx->continu = 0;
+    if (can_thread)
+	pthread_join(ctx->can_thread, NULL);
+    if (ctx->socket_bcm >= 0) {
+	close(ctx->socket_bcm);
+	ctx->socket_bcm = -1;
+    }
+    if (ctx->tx_timerfd >= 0) {
+	close(ctx->tx_timerfd);
+	ctx->tx_timerfd = -1;
+    }
+    if (ctx->tx_eventfd >= 0) {
+	close(ctx->tx_eventfd);
+	ctx->tx_eventfd = -1;
+    }
+    close(ctx->socket_can);
+    ctx->socket_can = -1;
+    can_rx_free(ctx);
+    return ret;
+}
+
+
+/**
+* @brief Arrête une interface CAN
+*
+* Attend la fin des threads. Ferme l'eventfd, le timerfd et le socket. Les
+* binds sont conservés pour le prochain can_ctx_init.
+*
+* @param ctx L'interface
+*
+* @returns 0
+*/
+int can_ctx_close(struct can_ctx * ctx)
+{
+	if (!ctx->can_ok)
+		return 0;
+
+	ctx->continu = 0;
+	pthread_join(ctx->can_thread, NULL);
+	pthread_join(ctx->sched_thread, NULL);
+	ctx->can_ok = 0;
+	close(ctx->socket_can);
+	ctx->socket_can = -1;
+	close(ctx->tx_eventfd);
+	ctx->tx_eventfd = -1;
+	pthread_mutex_lock(&ctx->tx_mutex);
+	close(ctx->tx_timerfd);
+	ctx->tx_timerfd = -1;
+	/* La fermeture du socket BCM supprime ses tâches d'émission */
+	if (ctx->socket_bcm >= 0) {
+	    close(ctx->socket_bcm);
+	    ctx->socket_bcm = -1;
+	}
+	pthread_mutex_unlock(&ctx->tx_mutex);
+	can_rx_free(ctx);
+	return 0;
+}
+
+
+
+
+
+/**
+* @brief Donne l'état de la lib_can.
+*
+* @param ctx L'interface
+*
+* @returns 1 si la lib est lancée, 0 sinon.
+*/
+int can_ctx_isok(struct can_ctx * ctx)
+{
+    return ctx->can_ok;
+}
+
+
+/**
+* @brief Indique si une interface active accepte les trames CAN FD
+*
+* @param ctx L'interface
+*
+* @returns 1 si l'interface est active en CAN FD, 0 sinon.
+*/
+int can_ctx_isfd(struct can_ctx * ctx)
+{
+    return ctx->can_ok && ctx->can_fd;
+}
+
+
+/**
+* @brief Arrondit une longueur de données à la longueur CAN FD valide suivante
+*
+* Les longueurs CAN FD au-delà de 8 octets sont 12, 16, 20, 24, 32, 48 et 64.
+*
+* @param len Longueur des données (0 à 64)
+*
+* @returns La longueur valide, 64 au plus
+*/
+unsigned int can_fd_len(unsigned int len)
+{
+    if(len <= 8) return len;
+    if(len <= 24) return (len + 3) & ~3u;
+    if(len <= 32) return 32;
+    if(len <= 48) return 48;
+    return CANFD_MAX_DLEN;
+}
+
+
+void can_ctx_stats(struct can_ctx * ctx, struct can_stats * st)
+{
+    *st = ctx->stats;
+    st->tx_full = atomic_load_explicit(&ctx->tx_full, memory_order_relaxed);
+    st->tx_wake_errors = atomic_load_explicit(&ctx->tx_wake_errors, memory_order_relaxed);
+    st->tx_deadline_misses = ctx->tx_deadline_misses;
+}
+
+
+/**
+* @brief Réserve une case de l'anneau d'émission et y publie une trame
+*
+* tx_pending doit déjà compter la trame.
+*
+* @returns 0 si OK, 1 si l'anneau est plein
+*/
+static int can_tx_enqueue(struct can_ctx * ctx, const struct canfd_frame * msg)
+{
+	struct tx_slot * slot;
+	unsigned int pos, seq;
+
+	/* Réservation d'une case */
+	pos = atomic_load_explicit(&ctx->tx_enqueue_pos, memory_order_relaxed);
+	for (;;) {
+		slot = &ctx->tx_ring[pos & (CAN_TX_RING_SIZE - 1)];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak_explicit(&ctx->tx_enqueue_pos, &pos, pos + 1,
+			        memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if ((int)(seq - pos) < 0) {
+			return 1; /* Anneau plein */
+		} else {
+			pos = atomic_load_explicit(&ctx->tx_enqueue_pos, memory_order_relaxed);
+		}
+	}
+
+	/* Publication de la trame : en-tête et données utiles seulement */
+	memcpy(&slot->frame, msg, CAN_FRAME_USED(msg));
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+
+/**
+* @brief Envoi directement un message
+*
+* Place le message dans l'anneau d'émission sans verrou ni appel système, sauf
+* pour réveiller le thread principal au début d'une rafale. Peut être appelée
+* depuis n'importe quel thread, y compris l'ordonnanceur, ou gestionnaire de signal.
+* Une trame marquée CANFD_FDF est émise en CAN FD (len valide jusqu'à 64).
+*
+* @param ctx L'interface
+* @param msg message CAN à envoyer
+*
+* @returns 0 si OK, 1 si erreur (lib inactive ou anneau plein)
+*/
+int can_ctx_send_fd(struct can_ctx * ctx, const struct canfd_frame * msg)
+{
+	int wake, full;
+	uint64_t one = 1;
+
+	if (!ctx->can_ok)
+		return 1;
+
+	/* Le premier producteur d'une rafale réveille le thread principal */
+	wake = (atomic_fetch_add_explicit(&ctx->tx_pending, 1, memory_order_acq_rel) == 0);
+
+	full = can_tx_enqueue(ctx, msg);
+	if (full) {
+		atomic_fetch_sub_explicit(&ctx->tx_pending, 1, memory_order_acq_rel);
+		atomic_fetch_add_explicit(&ctx->tx_full, 1, memory_order_relaxed);
+	}
+
+	/*
+	 * write() est async-signal-safe : can_send reste utilisable depuis un handler.
+	 * La trame est dans l'anneau même si le réveil échoue : le thread principal
+	 * la trouvera à son prochain tour de boucle.
+	 */
+	if (wake && write(ctx->tx_eventfd, &one, sizeof(one)) != sizeof(one))
+		atomic_fetch_add_explicit(&ctx->tx_wake_errors, 1, memory_order_relaxed);
+
+	return full;
+}
+
+
+/**
+* @brief Envoi un lot de messages
+*
+* Les messages sont placés dans l'anneau d'émission comme une seule rafale :
+* un seul réveil du thread principal, qui les envoie par sendmmsg(). L'ordre
+* est conservé ; si l'anneau se remplit, les messages suivants sont refusés.
+*
+* @param ctx L'interface
+* @param msgs messages CAN à envoyer
+* @param n nombre de messages
+*
+* @returns Le nombre de messages placés dans l'anneau (les n premiers)
+*/
+unsigned int can_ctx_send_batch_fd(struct can_ctx * ctx, const struct canfd_frame * msgs, unsigned int n)
+{
+	unsigned int i;
+	int wake;
+	uint64_t one = 1;
+
+	if (!ctx->can_ok || n == 0)
+		return 0;
+
+	wake = (atomic_fetch_add_explicit(&ctx->tx_pending, n, memory_order_acq_rel) == 0);
+
+	for (i = 0; i < n; i++) {
+		if (can_tx_enqueue(ctx, &msgs[i]))
+			break;
+	}
+	if (i < n) {
+		atomic_fetch_sub_explicit(&ctx->tx_pending, n - i, memory_order_acq_rel);
+		atomic_fetch_add_explicit(&ctx->tx_full, n - i, memory_order_relaxed);
+	}
+
+	/* Comme can_ctx_send_fd : un réveil manqué est seulement compté */
+	if (wake && write(ctx->tx_eventfd, &one, sizeof(one)) != sizeof(one))
+		atomic_fetch_add_explicit(&ctx->tx_wake_errors, 1, memory_order_relaxed);
+
+	return i;
+}
+
+
+/** @brief Convertit une trame classique en struct canfd_frame (sans CANFD_FDF) */
+static inline void can_frame_fd(struct canfd_frame * cf, const struct can_frame * msg)
+{
+    cf->can_id = msg->can_id;
+    cf->len = MIN(msg->can_dlc, CAN_MAX_DLEN);
+    cf->flags = 0;
+    cf->__res0 = 0;
+    cf->__res1 = 0;
+    memcpy(cf->data, msg->data, CAN_MAX_DLEN);
+}
+
+
+/**
+* @brief Envoi directement un message classique (API historique)
+*
+* Equivalent de can_ctx_send_fd pour une struct can_frame passée par valeur.
+*
+* @param ctx L'interface
+* @param msg message CAN à envoyer
+*
+* @returns 0 si OK, 1 si erreur (lib inactive ou anneau plein)
+*/
+int can_ctx_send(struct can_ctx * ctx, struct can_frame msg)
+{
+	struct canfd_frame cf;
+
+	can_frame_fd(&cf, &msg);
+	return can_ctx_send_fd(ctx, &cf);
+}
+
+
+/**
+* @brief Envoi un lot de messages classiques
+*
+* Equivalent de can_ctx_send_batch_fd pour des struct can_frame, converties
+* par rafales de CAN_TX_BATCH trames.
+*
+* @param ctx L'interface
+* @param msgs messages CAN à envoyer
+* @param n nombre de messages
+*
+* @returns Le nombre de messages placés dans l'anneau (les n premiers)
+*/
+unsigned int can_ctx_send_batch(struct can_ctx * ctx, const struct can_frame * msgs, unsigned int n)
+{
+	struct canfd_frame lot[CAN_TX_BATCH];
+	unsigned int i, k, nb, ok = 0;
+
+	for (i = 0; i < n; i += nb) {
+		nb = MIN(n - i, CAN_TX_BATCH);
+		for (k = 0; k < nb; k++)
+			can_frame_fd(&lot[k], &msgs[i + k]);
+		k = can_ctx_send_batch_fd(ctx, lot, nb);
+		ok += k;
+		if (k < nb)
+			break;
+	}
+	return ok;
+}
+
+
+/**
+* @brief Normalise l'identifiant et le masque d'un bind
+*
+* Un identifiant est étendu (29 bits) s'il porte CAN_EFF_FLAG ou dépasse 0x7FF :
+* il reçoit alors CAN_EFF_FLAG. Comme pour les filtres SocketCAN, le masque
+* reçoit CAN_EFF_FLAG : le bind ne correspond qu'aux trames de son format. Un
+* masque nul accepte toutes les trames, standards comme étendues.
+*
+* @param id Identifiant à normaliser
+* @param mask Masque à normaliser, NULL si aucun
+*
+* @returns 0 si OK, 1 si identifiant invalide
+*/
+static int can_id_norm(canid_t * id, canid_t * mask)
+{
+    canid_t bits = *id & CAN_EFF_MASK;
+
+    if(*id & (CAN_RTR_FLAG | CAN_ERR_FLAG)) return 1;
+    if((*id & CAN_EFF_FLAG) || bits > CAN_SFF_MASK)
+    {
+	*id = bits | CAN_EFF_FLAG;
+	if(mask != NULL && *mask != 0)
+	    *mask = (*mask & CAN_EFF_MASK) | CAN_EFF_FLAG;
+    }
+    else
+    {
+	*id = bits;
+	if(mask != NULL && *mask != 0)
+	    *mask = (*mask & CAN_SFF_MASK) | CAN_EFF_FLAG;
+    }
+    return 0;
+}
+
+
+/**
+* @brief Initialise le lancement périodique d'un message CAN
+*
+* Associe un couple identifiant + peride à une zone mémoire. Un identifiant
+* avec CAN_EFF_FLAG ou au-delà de 0x7FF est émis en trame étendue (29 bits).
+* Après l'execution de cette fonction, toutes les périodes (à la milliseconde),
+* la librairie envoi le message CAN ID avec les donneés de la zone mémoire.
+* Une zone de plus de 8 octets est envoyée en CAN FD (débit de données commuté),
+* complétée de zéros jusqu'à la longueur FD valide suivante, 64 octets au plus.
+* Le nombre de binds n'est limité que par la mémoire disponible.
+*
+* @param ctx L'interface
+* @param ID Identifiant CAN
+* @param zone Zone mémoire à envoyer péridiquement
+* @param zone_length Longueur de la zone
+* @param period Période de l'envoi en ms
+*
+* @returns 0 si OK, 1 identifiant ou longueur invalide, 2 période nulle,
+* 3 allocation, 4 tâche refusée par le broadcast manager (le bind n'est pas créé)
+*/
+int can_ctx_bind_send(struct can_ctx * ctx, canid_t ID, void * zone,
+                      unsigned short zone_length, unsigned long period)
+{
+    struct bind_tx * ptr_bind;
+    void * ptr;
+    unsigned int max;
+
+    if(can_id_norm(&ID, NULL)) return 1;
+    if(period==0) return 2;
+    if(zone_length > CANFD_MAX_DLEN) return 1;
+
+    pthread_mutex_lock(&ctx->tx_mutex);
+
+    /* Agrandissement des tables */
+    if(ctx->nb_binds_tx == ctx->max_binds_tx)
+    {
+	max = ctx->max_binds_tx ? 2 * ctx->max_binds_tx : 16;
+	if((ptr = realloc(ctx->binds_tx, max * sizeof(*ctx->binds_tx))) == NULL)
+	{
+	    pthread_mutex_unlock(&ctx->tx_mutex);
+	    fprintf(stderr,  "lib_can : Allocation des binds d'emission impossible\n");
+	    return 3;
+	}
+	ctx->binds_tx = ptr;
+	if((ptr = realloc(ctx->tx_heap, max * sizeof(*ctx->tx_heap))) == NULL)
+	{
+	    pthread_mutex_unlock(&ctx->tx_mutex);
+	    fprintf(stderr,  "lib_can : Allocation des binds d'emission impossible\n");
+	    return 3;
+	}
+	ctx->tx_heap = ptr;
+	ctx->max_binds_tx = max;
+    }
+
+    /* Remplissage structure Bind */
+    ptr_bind = &ctx->binds_tx[ctx->nb_binds_tx];
+    ptr_bind->id = ID;
+
+    if(zone_length > 0) ptr_bind->pmem = zone;
+    else ptr_bind->pmem = NULL;
+
+    ptr_bind->len = zone_length;
+    ptr_bind->period = period;
+    ptr_bind->next = can_now_ns() + period * 1000000ULL;
+    ctx->nb_binds_tx++;
+
+    if(ctx->tx_mode == CAN_TX_BCM)
+    {
+	/* Le noyau cadence l'envoi (dès que le socket BCM est ouvert) */
+	if(ctx->socket_bcm >= 0 && can_bcm_setup(ctx, ptr_bind, 1))
+	{
+	    /* Tâche refusée : le bind, dernier de la table, n'est pas conservé */
+	    ctx->nb_binds_tx--;
+	    pthread_mutex_unlock(&ctx->tx_mutex);
+	    return 4;
+	}
+    }
+    else
+    {
+	/* Insertion dans le tas, réarmement si c'est la nouvelle première échéance */
+	ctx->tx_heap[ctx->nb_heap_tx] = ctx->nb_binds_tx - 1;
+	ctx->nb_heap_tx++;
+	tx_heap_up(ctx, ctx->nb_heap_tx - 1);
+	if(ctx->tx_heap[0] == ctx->nb_binds_tx - 1)
+	    can_sched_arm(ctx);
+    }
+
+    pthread_mutex_unlock(&ctx->tx_mutex);
+    return 0;
+}
+
+
+/**
+* @brief Choisit le backend des envois périodiques
+*
+* Avec CAN_TX_BCM, chaque bind d'émission devient une tâche TX_SETUP du
+* broadcast manager : le noyau cadence l'envoi, sans timer en espace
+* utilisateur. Doit être appelée avant can_init. Si le broadcast manager est
+* indisponible au démarrage, l'interface revient à CAN_TX_USER.
+*
+* @param ctx L'interface
+* @param mode CAN_TX_USER (défaut) ou CAN_TX_BCM
+*
+* @returns 0 si OK, 1 si mode invalide, 5 libcan active
+*/
+int can_ctx_set_tx_mode(struct can_ctx * ctx, int mode)
+{
+    if(ctx->can_ok) return 5;
+    if(mode != CAN_TX_USER && mode != CAN_TX_BCM) return 1;
+    ctx->tx_mode = mode;
+    return 0;
+}
+
+
+/**
+* @brief Signale la mise à jour de la zone mémoire d'un bind d'émission
+*
+* Avec le backend CAN_TX_BCM, le contenu de la zone est recopié dans la tâche
+* du noyau par un TX_SETUP sans modification du timer. Avec CAN_TX_USER, la
+* zone est relue à chaque envoi et l'appel n'a pas d'effet.
+*
+* @param ctx L'interface
+* @param ID Identifiant CAN du bind
+*
+* @returns 0 si OK, 1 si aucun bind pour cet identifiant, 2 erreur BCM
+*/
+int can_ctx_bind_send_update(struct can_ctx * ctx, canid_t ID)
+{
+    unsigned int i;
+    int ret = 1;
+
+    if(can_id_norm(&ID, NULL)) return 1;
+
+    pthread_mutex_lock(&ctx->tx_mutex);
+    for(i = 0; i < ctx->nb_binds_tx; i++)
+    {
+	if(ctx->binds_tx[i].id != ID)
+	    continue;
+	ret = 0;
+	if(ctx->tx_mode == CAN_TX_BCM && ctx->socket_bcm >= 0 && can_bcm_setup(ctx, &ctx->binds_tx[i], 0))
+	    ret = 2;
+    }
+    pthread_mutex_unlock(&ctx->tx_mutex);
+    return ret;
+}
+
+
+/**
+* @brief Confie un bind d'émission au broadcast manager du noyau
+*
+* Appelée avec tx_mutex verrouillé.
+*
+* @param ptr_bind Le bind à émettre
+* @param start 1 pour (re)démarrer le timer, 0 pour ne mettre à jour que les données
+*
+* @returns 0 si OK, 1 sinon
+*/
+static int can_bcm_setup(struct can_ctx * ctx, struct bind_tx * ptr_bind, int start)
+{
+    struct bcm_tx_msg msg;
+    size_t size;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.head.opcode = TX_SETUP;
+    msg.head.can_id = ptr_bind->id;
+    msg.head.nframes = 1;
+    if(start)
+    {
+	msg.head.flags = SETTIMER | STARTTIMER;
+	msg.head.count = 0;
+	msg.head.ival2.tv_sec = ptr_bind->period / 1000;
+	msg.head.ival2.tv_usec = (ptr_bind->period % 1000) * 1000;
+    }
+
+    can_bind_frame(ptr_bind, &msg.frame);
+    size = sizeof(msg.head) + sizeof(struct can_frame);
+    if(msg.frame.flags & CANFD_FDF)
+    {
+	msg.head.flags |= CAN_FD_FRAME;
+	size = sizeof(msg);
+    }
+
+    if(write(ctx->socket_bcm, &msg, size) != (ssize_t)size)
+    {
+	perror("Writing on socket bcm");
+	return 1;
+    }
+    return 0;
+}
+
+
+/**
+* @brief Remplit la trame d'un bind d'émission à partir de sa zone mémoire
+*
+* Au-delà de 8 octets, la trame est une trame CAN FD avec commutation de débit.
+*
+* @param ptr_bind Le bind
+* @param cf La trame à remplir
+*/
+static void can_bind_frame(const struct bind_tx * ptr_bind, struct canfd_frame * cf)
+{
+    memset(cf, 0, sizeof(*cf));
+    cf->can_id = ptr_bind->id;
+    if(ptr_bind->len > CAN_MAX_DLEN)
+    {
+	cf->flags = CANFD_FDF | CANFD_BRS;
+	cf->len = can_fd_len(ptr_bind->len);
+    }
+    else cf->len = ptr_bind->len;
+    if(ptr_bind->pmem != NULL)
+	memcpy(cf->data, ptr_bind->pmem, ptr_bind->len);
+}
+
+
+/** @brief Date courante en ns sur CLOCK_MONOTONIC */
+static unsigned long long can_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/** @brief Remonte l'élément pos du tas vers le sommet */
+static void tx_heap_up(struct can_ctx * ctx, unsigned int pos)
+{
+    unsigned int parent, idx = ctx->tx_heap[pos];
+
+    while(pos > 0)
+    {
+	parent = (pos - 1) / 2;
+	if(ctx->binds_tx[ctx->tx_heap[parent]].next <= ctx->binds_tx[idx].next)
+	    break;
+	ctx->tx_heap[pos] = ctx->tx_heap[parent];
+	pos = parent;
+    }
+    ctx->tx_heap[pos] = idx;
+}
+
+
+/** @brief Descend l'élément pos du tas vers les feuilles */
+static void tx_heap_down(struct can_ctx * ctx, unsigned int pos)
+{
+    unsigned int child, idx = ctx->tx_heap[pos];
+
+    while((child = 2 * pos + 1) < ctx->nb_heap_tx)
+    {
+	if(child + 1 < ctx->nb_heap_tx
+	   && ctx->binds_tx[ctx->tx_heap[child + 1]].next < ctx->binds_tx[ctx->tx_heap[child]].next)
+	    child++;
+	if(ctx->binds_tx[idx].next <= ctx->binds_tx[ctx->tx_heap[child]].next)
+	    break;
+	ctx->tx_heap[pos] = ctx->tx_heap[child];
+	pos = child;
+    }
+    ctx->tx_heap[pos] = idx;
+}
+
+
+/**
+* @brief Arme le timerfd sur l'échéance du sommet du tas
+*
+* Appelée avec tx_mutex verrouillé.
+*/
+static void can_sched_arm(struct can_ctx * ctx)
+{
+    struct itimerspec its;
+    unsigned long long next;
+
+    if(ctx->tx_timerfd < 0 || ctx->nb_heap_tx == 0)
+	return;
+
+    memset(&its, 0, sizeof(its));
+    next = ctx->binds_tx[ctx->tx_heap[0]].next;
+    its.it_value.tv_sec = next / 1000000000ULL;
+    its.it_value.tv_nsec = next % 1000000000ULL;
+    if(timerfd_settime(ctx->tx_timerfd, TFD_TIMER_ABSTIME, &its, NULL))
+	perror("timerfd_settime");
+}
+
+
+/**
+* @brief Thread de l'ordonnanceur : émet les binds arrivés à échéance
+*
+* Attend sur le timerfd armé sur l'échéance du sommet du tas, émet chaque bind
+* échu puis réarme le timer. Une échéance manquée d'au moins une période est
+* comptée dans tx_deadline_misses et le bind est recalé sur la date courante.
+*/
+static void * can_sched_fct(void * args)
+{
+    struct can_ctx * ctx = args;
+    struct pollfd pfd;
+    struct bind_tx * ptr_bind;
+    struct canfd_frame cf;
+    unsigned long long now, period;
+    uint64_t expirations;
+
+    pfd.fd = ctx->tx_timerfd;
+    pfd.events = POLLIN;
+
+    while(ctx->continu)
+    {
+	if(poll(&pfd, 1, 100) <= 0) /* Boucle de 100 ms */
+	    continue;
+
+	if(read(ctx->tx_timerfd, &expirations, sizeof(expirations)) < 0)
+	    continue;
+
+	pthread_mutex_lock(&ctx->tx_mutex);
+	now = can_now_ns();
+	while(ctx->nb_heap_tx > 0 && ctx->binds_tx[ctx->tx_heap[0]].next <= now)
+	{
+	    ptr_bind = &ctx->binds_tx[ctx->tx_heap[0]];
+#ifdef DEBUG
+	    printf("MATCH_TX! %#x %llu\n", ptr_bind->id, now);
+#endif
+	    /* Envoi message */
+	    can_bind_frame(ptr_bind, &cf);
+	    can_ctx_send_fd(ctx, &cf);
+
+	    /* Prochaine échéance */
+	    period = ptr_bind->period * 1000000ULL;
+	    ptr_bind->next += period;
+	    if(ptr_bind->next <= now)
+	    {
+		ctx->tx_deadline_misses++;
+		ptr_bind->next = now + period;
+	    }
+	    tx_heap_down(ctx, 0);
+	}
+	can_sched_arm(ctx);
+	pthread_mutex_unlock(&ctx->tx_mutex);
+    }
+
+    pthread_exit(NULL);
+}
+
+
+/**
+* @brief Libère une table de dispatch
+*
+* @param tbl La table
+*/
+static void rx_table_free(struct rx_table * tbl)
+{
+    if(tbl == NULL) return;
+    free(tbl->binds);
+    free(tbl->exact);
+    free(tbl->groups);
+    free(tbl->slots);
+    free(tbl->members);
+    free(tbl->run_pos);
+    free(tbl->run_end);
+    free(tbl);
+}
+
+
+/** @brief Hachage d'une clé de groupe (identifiant & masque) */
+static inline unsigned int rx_hash(canid_t key)
+{
+    key *= 0x9E3779B1u;
+    return key ^ (key >> 16);
+}
+
+
+/**
+* @brief Cherche une clé dans la table de hachage d'un groupe
+*
+* @param tbl La table de dispatch
+* @param g Le groupe
+* @param key Identifiant & masque du groupe
+*
+* @returns La case de la clé, NULL si aucun bind du groupe n'a cette clé
+*/
+static inline const struct rx_slot * rx_group_find(const struct rx_table * tbl,
+                                                   const struct rx_group * g, canid_t key)
+{
+    const struct rx_slot * slot;
+    unsigned int h = rx_hash(key);
+
+    /* Remplissage au plus de moitié : une case libre arrête la recherche */
+    for(;;)
+    {
+	slot = &tbl->slots[g->slot + (h & (g->size - 1))];
+	if(slot->nb == 0) return NULL;
+	if(slot->key == key) return slot;
+	h++;
+    }
+}
+
+
+/** @brief Vrai si le bind est exact sur un identifiant standard */
+#define RX_EXACT(b) ((b)->mask == CAN_SFF_EXACT && !((b)->id & CAN_EFF_FLAG))
+
+
+/**
+* @brief Construit une table de dispatch à partir de binds_rx
+*
+* Appelée avec rx_mutex verrouillé.
+*
+* @returns La table, NULL si erreur d'allocation
+*/
+static struct rx_table * rx_table_build(struct can_ctx * ctx)
+{
+    struct rx_table * tbl;
+    struct rx_group * g;
+    struct rx_slot * slot;
+    unsigned int i, id, n, nb_slots, h;
+    unsigned int * pos, * grp, * fill = NULL;
+    int match;
+
+    if((tbl = calloc(1, sizeof(*tbl))) == NULL)
+	return NULL;
+
+    n = ctx->nb_binds_rx ? ctx->nb_binds_rx : 1;
+    tbl->nb = ctx->nb_binds_rx;
+    tbl->binds = malloc(n * sizeof(*tbl->binds));
+    tbl->exact = malloc(n * sizeof(*tbl->exact));
+    tbl->groups = calloc(n, sizeof(*tbl->groups));
+    tbl->members = malloc(n * sizeof(*tbl->members));
+    tbl->run_pos = malloc((n + 1) * sizeof(*tbl->run_pos));
+    tbl->run_end = malloc((n + 1) * sizeof(*tbl->run_end));
+    pos = calloc(CAN_SFF_IDS, sizeof(*pos));
+    grp = malloc(n * sizeof(*grp));
+    if(tbl->binds == NULL || tbl->exact == NULL || tbl->groups == NULL || tbl->members == NULL
+       || tbl->run_pos == NULL || tbl->run_end == NULL || pos == NULL || grp == NULL)
+	goto erreur;
+    memcpy(tbl->binds, ctx->binds_rx, ctx->nb_binds_rx * sizeof(*tbl->binds));
+
+    /* Comptage des binds exacts par ID, répartition des autres par masque */
+    for(i = 0; i < tbl->nb; i++)
+    {
+	if(tbl->binds[i].mask == 0 || (tbl->binds[i].id & CAN_EFF_FLAG))
+	    tbl->eff = 1;
+	if(RX_EXACT(&tbl->binds[i]))
+	{
+	    tbl->first[tbl->binds[i].id + 1]++;
+	    continue;
+	}
+	for(grp[i] = 0; grp[i] < tbl->nb_groups; grp[i]++)
+	    if(tbl->groups[grp[i]].mask == tbl->binds[i].mask)
+		break;
+	if(grp[i] == tbl->nb_groups)
+	    tbl->groups[tbl->nb_groups++].mask = tbl->binds[i].mask;
+	tbl->groups[grp[i]].size++;
+    }
+
+    /* Index CSR des binds exacts */
+    for(id = 0; id < CAN_SFF_IDS; id++)
+    {
+	tbl->first[id + 1] += tbl->first[id];
+	pos[id] = tbl->first[id];
+    }
+    for(i = 0; i < tbl->nb; i++)
+	if(RX_EXACT(&tbl->binds[i]))
+	    tbl->exact[pos[tbl->binds[i].id]++] = i;
+
+    /* Tables de hachage des groupes, remplies au plus de moitié */
+    for(nb_slots = 0, g = tbl->groups; g < tbl->groups + tbl->nb_groups; g++)
+    {
+	for(h = 2; h < 2 * g->size; h *= 2);
+	g->slot = nb_slots;
+	g->size = h;
+	nb_slots += h;
+    }
+    tbl->slots = calloc(nb_slots ? nb_slots : 1, sizeof(*tbl->slots));
+    fill = calloc(nb_slots ? nb_slots : 1, sizeof(*fill));
+    if(tbl->slots == NULL || fill == NULL)
+	goto erreur;
+
+    /* Comptage des binds par clé */
+    for(i = 0; i < tbl->nb; i++)
+    {
+	if(RX_EXACT(&tbl->binds[i])) continue;
+	g = &tbl->groups[grp[i]];
+	slot = (struct rx_slot *)rx_group_find(tbl, g, tbl->binds[i].id & g->mask);
+	if(slot == NULL)
+	{
+	    for(h = rx_hash(tbl->binds[i].id & g->mask);
+		tbl->slots[g->slot + (h & (g->size - 1))].nb != 0; h++);
+	    slot = &tbl->slots[g->slot + (h & (g->size - 1))];
+	    slot->key = tbl->binds[i].id & g->mask;
+	}
+	slot->nb++;
+    }
+    for(h = i = 0; i < nb_slots; i++)
+    {
+	tbl->slots[i].first = h;
+	h += tbl->slots[i].nb;
+    }
+
+    /* Binds de chaque clé, par indice croissant */
+    for(i = 0; i < tbl->nb; i++)
+    {
+	if(RX_EXACT(&tbl->binds[i])) continue;
+	g = &tbl->groups[grp[i]];
+	slot = (struct rx_slot *)rx_group_find(tbl, g, tbl->binds[i].id & g->mask);
+	tbl->members[slot->first + fill[slot - tbl->slots]++] = i;
+    }
+
+    /* Chemin rapide : IDs standards qui ne correspondent à aucun bind */
+    for(id = 0; id < CAN_SFF_IDS; id++)
+    {
+	match = (tbl->first[id + 1] > tbl->first[id]);
+	for(i = 0; !match && i < tbl->nb_groups; i++)
+	    match = (rx_group_find(tbl, &tbl->groups[i], id & tbl->groups[i].mask) != NULL);
+	if(!match)
+	    tbl->nomatch[id / 8] |= 1 << (id % 8);
+    }
+
+    free(pos);
+    free(grp);
+    free(fill);
+    return tbl;
+
+erreur:
+    free(pos);
+    free(grp);
+    free(fill);
+    rx_table_free(tbl);
+    return NULL;
+}
+
+
+/**
+* @brief Publie une nouvelle table de dispatch et libère l'ancienne
+*
+* L'ancienne table est libérée après une période de grâce : si le thread
+* principal est en cours de dispatch, on attend la fin de ce dispatch. Depuis un
+* callback (donc depuis le thread principal), la libération est différée à la
+* fin du lot en cours.
+* L'échange de la table puis la lecture de l'époque, et côté lecteur
+* l'incrément de l'époque puis la lecture de la table, sont seq_cst : avec un
+* ordre acquire/release, chaque côté pourrait ne pas voir l'écriture de
+* l'autre, et l'ancienne table serait libérée pendant son parcours.
+* Appelée avec rx_mutex verrouillé : l'attente, bornée par la durée d'un lot,
+* retarde les autres bind/unbind. Le thread principal ne prend jamais
+* rx_mutex pendant un dispatch, l'attente ne peut donc pas s'interbloquer.
+*
+* @returns 0 si OK, 1 si erreur d'allocation
+*/
+static int rx_table_publish(struct can_ctx * ctx)
+{
+    struct rx_table * tbl, * old;
+    unsigned int epoch;
+
+    if((tbl = rx_table_build(ctx)) == NULL)
+    {
+	fprintf(stderr, "lib_can : Allocation de la table de reception impossible\n");
+	return 1;
+    }
+
+    old = atomic_exchange_explicit(&ctx->rx_table, tbl, memory_order_seq_cst);
+    if(old == NULL)
+	return 0;
+
+    if(rx_dispatch_ctx == ctx)
+    {
+	old->next = ctx->rx_retired;
+	ctx->rx_retired = old;
+	return 0;
+    }
+
+    /* Période de grâce */
+    epoch = atomic_load_explicit(&ctx->rx_epoch, memory_order_seq_cst);
+    if(epoch & 1)
+	while(atomic_load_explicit(&ctx->rx_epoch, memory_order_seq_cst) == epoch)
+	    sched_yield();
+
+    rx_table_free(old);
+    return 0;
+}
+
+
+/**
+* @brief Prend en compte une modification de binds_rx
+*
+* Republie la table de dispatch et recompile le filtre noyau.
+* Appelée avec rx_mutex verrouillé.
+*
+* @returns 0 si OK, 1 si erreur
+*/
+static int can_rx_binds_changed(struct can_ctx * ctx)
+{
+    if(rx_table_publish(ctx))
+	return 1;
+
+    /* Le noyau écarte désormais les identifiants sans bind */
+    if(ctx->can_ok && can_rx_filter_apply(ctx))
+	return 1;
+    return 0;
+}
+
+
+/**
+* @brief Bind un ID+masque à un espace mémoire et/ou un callback
+*
+* Associe un couple identifiant + masque à une zone mémoire et/ou à un callback.
+* Après l'execution de cette fonction, si un message reçu respecte la condition
+* "(ID_reçue && mask) == (ID_bind && mask)" alors :
+* 	Si zone n'est pas NULL la mémoire est remplie (len octets de la trame,
+* 	64 au plus en CAN FD, dans la limite de zone_length)
+*	si callback n'est pas NULL, callback est appelé
+* Un identifiant avec CAN_EFF_FLAG ou au-delà de 0x7FF est étendu (29 bits) ;
+* un bind ne correspond qu'aux trames de son format, sauf avec un masque nul.
+* Le nombre de binds n'est limité que par la mémoire disponible. Peut être
+* appelée pendant que la lib reçoit des trames.
+*
+* @param ctx L'interface
+* @param ID l'identifiant CAN
+* @param mask le masque
+* @param zone la zone mémoire à remplir
+* @param zone_length la taille de la zone mémoire disponible
+* @param callback fonction à appeler lors de la reception
+*
+* @returns 0 si OK, !=0 si KO
+*
+*/
+int can_ctx_bind_receive(struct can_ctx * ctx, canid_t ID, canid_t mask,
+    void * zone, unsigned short zone_length, can_callback_t callback)
+{
+    struct bind_rx * ptr_bind;
+    void * ptr;
+    unsigned int max;
+    int ret;
+
+    /* Remplissage structure Bind */
+    if(can_id_norm(&ID, &mask)) return 1;
+
+    pthread_mutex_lock(&ctx->rx_mutex);
+
+    /* Agrandissement de la table */
+    if(ctx->nb_binds_rx == ctx->max_binds_rx)
+    {
+	max = ctx->max_binds_rx ? 2 * ctx->max_binds_rx : 16;
+	if((ptr = realloc(ctx->binds_rx, max * sizeof(*ctx->binds_rx))) == NULL)
+	{
+	    pthread_mutex_unlock(&ctx->rx_mutex);
+	    fprintf(stderr,  "lib_can : Allocation des binds de reception impossible\n");
+	    return 3;
+	}
+	ctx->binds_rx = ptr;
+	ctx->max_binds_rx = max;
+    }
+
+    ptr_bind = &ctx->binds_rx[ctx->nb_binds_rx];
+    ptr_bind->id = ID;
+    ptr_bind->mask = mask;
+
+    if(zone_length > 0) ptr_bind->pmem = zone;
+    else ptr_bind->pmem = NULL;
+
+    ptr_bind->len = zone_length;
+    ptr_bind->callback = callback;
+    ctx->nb_binds_rx++;
+
+    ret = can_rx_binds_changed(ctx) ? 3 : 0;
+    pthread_mutex_unlock(&ctx->rx_mutex);
+    return ret;
+}
+
+
+/**
+* @brief Supprime un bind de reception
+*
+* Retire les binds correspondant exactement au quadruplet ID, masque, zone et
+* callback. Au retour, ni la zone ni le callback ne sont plus utilisés par la
+* lib (depuis un callback : à partir de la trame suivante). Peut être appelée
+* pendant que la lib reçoit des trames.
+*
+* @param ctx L'interface
+* @param ID l'identifiant CAN
+* @param mask le masque
+* @param zone la zone mémoire du bind
+* @param callback le callback du bind
+*
+* @returns 0 si OK, 1 si aucun bind ne correspond, 3 erreur d'allocation
+*/
+int can_ctx_unbind_receive(struct can_ctx * ctx, canid_t ID, canid_t mask,
+    void * zone, can_callback_t callback)
+{
+    unsigned int i, j;
+    int ret = 1;
+
+    if(can_id_norm(&ID, &mask)) return 1;
+
+    pthread_mutex_lock(&ctx->rx_mutex);
+    for(i = j = 0; i < ctx->nb_binds_rx; i++)
+    {
+	if(ctx->binds_rx[i].id == ID && ctx->binds_rx[i].mask == mask
+	   && ctx->binds_rx[i].pmem == zone && ctx->binds_rx[i].callback == callback)
+	{
+	    ret = 0;
+	    continue;
+	}
+	ctx->binds_rx[j++] = ctx->binds_rx[i];
+    }
+    ctx->nb_binds_rx = j;
+
+    if(ret == 0 && can_rx_binds_changed(ctx))
+	ret = 3;
+    pthread_mutex_unlock(&ctx->rx_mutex);
+    return ret;
+}
+
+
+/**
+* @brief Modifie la zone mémoire et le callback d'un bind de reception
+*
+* Tous les binds ID+masque existants sont mis à jour. Peut être appelée pendant
+* que la lib reçoit des trames.
+*
+* @param ctx L'interface
+* @param ID l'identifiant CAN
+* @param mask le masque
+* @param zone la nouvelle zone mémoire à remplir
+* @param zone_length la taille de la zone mémoire disponible
+* @param callback le nouveau callback
+*
+* @returns 0 si OK, 1 si aucun bind ne correspond, 3 erreur d'allocation
+*/
+int can_ctx_update_receive(struct can_ctx * ctx, canid_t ID, canid_t mask,
+    void * zone, unsigned short zone_length, can_callback_t callback)
+{
+    unsigned int i;
+    int ret = 1;
+
+    if(can_id_norm(&ID, &mask)) return 1;
+
+    pthread_mutex_lock(&ctx->rx_mutex);
+    for(i = 0; i < ctx->nb_binds_rx; i++)
+    {
+	if(ctx->binds_rx[i].id != ID || ctx->binds_rx[i].mask != mask)
+	    continue;
+	ctx->binds_rx[i].pmem = (zone_length > 0) ? zone : NULL;
+	ctx->binds_rx[i].len = zone_length;
+	ctx->binds_rx[i].callback = callback;
+	ret = 0;
+    }
+
+    if(ret == 0 && can_rx_binds_changed(ctx))
+	ret = 3;
+    pthread_mutex_unlock(&ctx->rx_mutex);
+    return ret;
+}
+
+
+/**
+* @brief Applique un bind à un message reçu
+*
+* @param ptr_bind Le bind correspondant
+* @param cf Le message reçu
+* @param tv Date d'arrivée du message
+*/
+static void can_rx_match(struct can_ctx * ctx, const struct bind_rx * ptr_bind, const struct canfd_frame * cf,
+                         const struct timeval * tv)
+{
+#ifdef DEBUG
+    printf("MATCH_RX! %#x, %#x, %p, %#x, %p\n", ptr_bind->id,
+	    ptr_bind->mask, ptr_bind->pmem, ptr_bind->len, ptr_bind->callback);
+#endif
+    /* Remplissage mémoire */
+    if(ptr_bind->pmem != NULL)
+	memcpy(ptr_bind->pmem, cf->data, MIN(ptr_bind->len, cf->len));
+
+    /* Appel callback */
+    if(ptr_bind->callback != NULL)
+	ptr_bind->callback(this, ctx, cf, tv);
+}
+
+
+/**
+* @brief Vérifie les binds sur reception d'un message CAN
+*
+* can_rx est appelée lors de la reception d'un message.
+* Elle cherche alors les binds qui correspondent au message reçu.
+* Pour chacun, elle rempli (si cela à lieu d'être) la zone mémoire
+* et appelle le callback du bind.
+*
+* Une trame standard trouve ses binds exacts par indexation directe ; pour
+* chaque groupe de masque, une recherche de identifiant & masque donne les
+* binds correspondants. Ces listes sont fusionnées par indice croissant : les
+* binds sont appliqués dans l'ordre d'enregistrement.
+*
+* @param tbl Table de dispatch
+* @param cf Le message reçu
+* @param tv Date d'arrivée du message
+*/
+static void can_rx(struct can_ctx * ctx, const struct rx_table * tbl, const struct canfd_frame * cf,
+                   const struct timeval * tv)
+{
+    canid_t can_id = cf->can_id;
+    unsigned int id = can_id & CAN_SFF_MASK;
+    unsigned int g, nb = 0, best, r;
+    const struct rx_slot * slot;
+    const unsigned int ** pos = tbl->run_pos, ** end = tbl->run_end;
+
+#ifdef DEBUG
+    int i;
+    printf("R%3x %d ", cf->can_id, cf->len);
+    for (i = 0; i<cf->len; i++)
+    {
+	printf("%02x ", cf->data[i]);
+    }
+    printf("\n");
+#endif /* DEBUG */
+
+    /* Chemin rapide : aucun bind pour cet ID */
+    if((can_id & CAN_EFF_FLAG) ? !tbl->eff : (tbl->nomatch[id / 8] & (1 << (id % 8))))
+    {
+	ctx->stats.rx_miss++;
+	return;
+    }
+
+    if(!(can_id & CAN_EFF_FLAG) && tbl->first[id + 1] > tbl->first[id])
+    {
+	pos[nb] = &tbl->exact[tbl->first[id]];
+	end[nb] = &tbl->exact[tbl->first[id + 1]];
+	nb++;
+    }
+    for(g = 0; g < tbl->nb_groups; g++)
+    {
+	slot = rx_group_find(tbl, &tbl->groups[g], can_id & tbl->groups[g].mask);
+	if(slot == NULL) continue;
+	pos[nb] = &tbl->members[slot->first];
+	end[nb] = pos[nb] + slot->nb;
+	nb++;
+    }
+
+    if(nb == 0)
+    {
+	ctx->stats.rx_miss++;
+	return;
+    }
+    ctx->stats.rx_match++;
+    lathist_record_since(&lathist_stage[LATHIST_DISPATCH], tv);
+
+    /* Fusion des listes par indice croissant */
+    while(nb > 0)
+    {
+	for(best = 0, r = 1; r < nb; r++)
+	    if(*pos[r] < *pos[best]) best = r;
+	can_rx_match(ctx, &tbl->binds[*pos[best]++], cf, tv);
+	if(pos[best] == end[best])
+	{
+	    nb--;
+	    pos[best] = pos[nb];
+	    end[best] = end[nb];
+	}
+    }
+}
+
+
+/**
+* @brief Vérifie les binds pour un lot de messages CAN reçus
+*
+* Point d'entrée de la réception par lots : la table de dispatch est lue une
+* fois pour tout le lot, puis chaque trame est traitée par can_rx dans l'ordre
+* de réception. L'époque est impaire pendant le dispatch.
+*
+* @param cf Tableau des messages reçus
+* @param tv Dates d'arrivée des messages
+* @param n Nombre de messages
+*/
+static void can_rx_batch(struct can_ctx * ctx, const struct canfd_frame * cf,
+                         const struct timeval * tv, int n)
+{
+    const struct rx_table * tbl;
+    struct rx_table * old;
+    int i;
+
+    atomic_fetch_add_explicit(&ctx->rx_epoch, 1, memory_order_seq_cst);
+    rx_dispatch_ctx = ctx;
+    tbl = atomic_load_explicit(&ctx->rx_table, memory_order_seq_cst);
+    if(tbl != NULL)
+	for(i = 0; i < n; i++)
+	    can_rx(ctx, tbl, &cf[i], &tv[i]);
+    rx_dispatch_ctx = NULL;
+    atomic_fetch_add_explicit(&ctx->rx_epoch, 1, memory_order_seq_cst);
+
+    /* Tables retirées par un callback pendant ce lot */
+    while((old = ctx->rx_retired) != NULL)
+    {
+	ctx->rx_retired = old->next;
+	rx_table_free(old);
+    }
+}
+
+
+/**
+* @brief Recompile le filtre noyau CAN_RAW_FILTER à partir des binds de réception
+*
+* Chaque bind ID+masque devient un struct can_filter, avec la même condition
+* "(ID_reçue & mask) == (ID_bind & mask)" que can_rx : le noyau élimine les
+* trames qu'aucun bind n'attend avant de réveiller le thread principal.
+* Un bind de masque nul (catch-all), ou trop de binds pour le noyau, donne un
+* filtre qui accepte tout.
+* Appelée avec rx_mutex verrouillé (ou avant le lancement du thread).
+*
+* @returns 0 si OK, 1 si erreur
+*/
+static int can_rx_filter_apply(struct can_ctx * ctx)
+{
+    struct can_filter * filters;
+    unsigned int i;
+    int nb = 0, j, all = 0, ret = 0;
+
+    filters = malloc((ctx->nb_binds_rx ? MIN(ctx->nb_binds_rx, CAN_RAW_FILTER_MAX) : 1)
+                     * sizeof(*filters));
+    if(filters == NULL)
+	return 1;
+
+    for(i = 0; i < ctx->nb_binds_rx; i++)
+    {
+	if(ctx->binds_rx[i].mask == 0)
+	{
+	    all = 1;
+	    break;
+	}
+
+	/* Elimination des doublons */
+	for(j = 0; j < nb; j++)
+	    if(filters[j].can_mask == ctx->binds_rx[i].mask
+	       && filters[j].can_id == (canid_t)(ctx->binds_rx[i].id & ctx->binds_rx[i].mask))
+		break;
+	if(j < nb) continue;
+
+	if(nb == CAN_RAW_FILTER_MAX)
+	{
+	    all = 1;
+	    break;
+	}
+	filters[nb].can_id = ctx->binds_rx[i].id & ctx->binds_rx[i].mask;
+	filters[nb].can_mask = ctx->binds_rx[i].mask;
+	nb++;
+    }
+
+    if(all)
+    {
+	filters[0].can_id = 0;
+	filters[0].can_mask = 0;
+	nb = 1;
+    }
+
+    /* Aucun filtre : le noyau ne délivre plus aucune trame */
+    if(setsockopt(ctx->socket_can, SOL_CAN_RAW, CAN_RAW_FILTER,
+                  nb ? filters : NULL, nb * sizeof(struct can_filter)) < 0)
+    {
+	perror("setsockopt CAN_RAW_FILTER");
+	ret = 1;
+    }
+    free(filters);
+    return ret;
+}
+
+
+/**
+* @brief Contexte des fonctions sans contexte, créé au premier appel
+*
+* @param iface_can Interface du contexte s'il doit être créé
+*
+* @returns Le contexte par défaut, NULL si erreur d'allocation
+*/
+static struct can_ctx * can_default_ctx(const char * iface_can)
+{
+    if(can_default == NULL)
+	can_default = can_ctx_new(iface_can);
+    return can_default;
+}
+
+
+/**
+* @brief Initialise la lib_can sur l'interface par défaut
+*
+* @param iface_can chaine pour l'interface CAN (ex : "can0")
+*
+* @returns 0 si OK, 1 si socket_can KO, 2 eventfd, 3 Thread can, 4 Ordonnanceur, 5 libcan active, 6 allocation
+*/
+int can_init(const char * iface_can)
+{
+    struct can_ctx * ctx = can_default_ctx(iface_can);
+
+    if(ctx == NULL) return 6;
+    if(ctx->can_ok) return 5;
+    if(iface_can != NULL)
+	snprintf(ctx->name, sizeof(ctx->name), "%s", iface_can);
+    return can_ctx_init(ctx);
+}
+
+
+/** @brief can_ctx_set_rx_batch sur l'interface par défaut */
+int can_set_rx_batch(unsigned int batch)
+{
+    struct can_ctx * ctx = can_default_ctx("can0");
+
+    return ctx ? can_ctx_set_rx_batch(ctx, batch) : 1;
+}
+
+
+/** @brief can_ctx_close sur l'interface par défaut */
+int can_close(void)
+{
+    return can_default ? can_ctx_close(can_default) : 0;
+}
+
+
+/** @brief can_ctx_isok sur l'interface par défaut */
+int can_isok(void)
+{
+    return can_default ? can_ctx_isok(can_default) : 0;
+}
+
+
+/** @brief can_ctx_send sur l'interface par défaut */
+int can_send(struct can_frame msg)
+{
+    return can_default ? can_ctx_send(can_default, msg) : 1;
+}
+
+
+/** @brief can_ctx_send_batch sur l'interface par défaut */
+unsigned int can_send_batch(const struct can_frame * msgs, unsigned int n)
+{
+    return can_default ? can_ctx_send_batch(can_default, msgs, n) : 0;
+}
+
+
+/** @brief can_ctx_send_fd sur l'interface par défaut */
+int can_send_fd(const struct canfd_frame * msg)
+{
+    return can_default ? can_ctx_send_fd(can_default, msg) : 1;
+}
+
+
+/** @brief can_ctx_send_batch_fd sur l'interface par défaut */
+unsigned int can_send_batch_fd(const struct canfd_frame * msgs, unsigned int n)
+{
+    return can_default ? can_ctx_send_batch_fd(can_default, msgs, n) : 0;
+}
+
+
+/** @brief can_ctx_bind_send sur l'interface par défaut */
+int can_bind_send(canid_t ID, void * zone, unsigned short zone_length, unsigned long period)
+{
+    struct can_ctx * ctx = can_default_ctx("can0");
+
+    return ctx ? can_ctx_bind_send(ctx, ID, zone, zone_length, period) : 3;
+}
+
+
+/** @brief can_ctx_set_tx_mode sur l'interface par défaut */
+int can_set_tx_mode(int mode)
+{
+    struct can_ctx * ctx = can_default_ctx("can0");
+
+    return ctx ? can_ctx_set_tx_mode(ctx, mode) : 1;
+}
+
+
+/** @brief can_ctx_bind_send_update sur l'interface par défaut */
+int can_bind_send_update(canid_t ID)
+{
+    return can_default ? can_ctx_bind_send_update(can_default, ID) : 1;
+}
+
+
+/** @brief can_ctx_bind_receive sur l'interface par défaut */
+int can_bind_receive(canid_t ID, canid_t mask,
+    void * zone, unsigned short zone_length, can_callback_t callback)
+{
+    struct can_ctx * ctx = can_default_ctx("can0");
+
+    return ctx ? can_ctx_bind_receive(ctx, ID, mask, zone, zone_length, callback) : 3;
+}
+
+
+/** @brief can_ctx_unbind_receive sur l'interface par défaut */
+int can_unbind_receive(canid_t ID, canid_t mask, void * zone,
+    can_callback_t callback)
+{
+    return can_default ? can_ctx_unbind_receive(can_default, ID, mask, zone, callback) : 1;
+}
+
+
+/** @brief can_ctx_update_receive sur l'interface par défaut */
+int can_update_receive(canid_t ID, canid_t mask, void * zone,
+    unsigned short zone_length, can_callback_t callback)
+{
+    return can_default
+	? can_ctx_update_receive(can_default, ID, mask, zone, zone_length, callback) : 1;
+}
@@ -8,6 +8,15 @@
  *
  * L'objectif est d'encapsuler la gestion du Bus CAN sous linux dans des
  * fonctions plus faciles d'utilisations.
+ *
+ * Chaque interface CAN est un contexte (struct can_ctx) avec son socket, ses
+ * threads et ses binds : un même processus peut servir plusieurs bus. Les
+ * fonctions can_ctx_* prennent le contexte en premier paramètre ; les
+ * fonctions historiques sans contexte (can_init, can_send...) agissent sur un
+ * contexte par défaut.
+ *
+ * Les trames sont des struct canfd_frame : une trame classique a len <= 8 et
+ * flags à 0, une trame CAN FD est marquée CANFD_FDF et porte jusqu'à 64 octets.
  */
 
 #ifndef __LIBCAN_H__
@@ -18,29 +27,202 @@ extern "C"{
 #endif
 
 #include <net/if.h>
+#include <sys/time.h>
 #include <linux/can.h>
 #include "CServerTcpIP.h"
 
+#ifndef CANFD_FDF
+/** @brief Marque une trame CAN FD dans struct canfd_frame (linux >= 5.14) */
+#define CANFD_FDF 0x04
+#endif
+
+/** @brief Contexte d'une interface CAN (opaque) */
+struct can_ctx;
+
+/**
+* @brief Callback d'un bind de réception
+*
+* @param this Le serveur TCP
+* @param ctx L'interface sur laquelle la trame a été reçue
+* @param cf La trame reçue, classique ou CAN FD (CANFD_FDF), valide pendant l'appel
+* @param tv Date d'arrivée de la trame, datée par le noyau (SO_TIMESTAMP)
+*/
+typedef void (*can_callback_t)(CServerTcpIP *this, struct can_ctx *ctx, const struct canfd_frame *cf,
+                               const struct timeval *tv);
+
+/**
+* @brief Compteurs d'une interface CAN, depuis sa création
+*
+* Chaque compteur n'est incrémenté que par un seul thread de l'interface
+* (atomiquement pour tx_full et tx_wake_errors, alimentés par tous les
+* appelants de can_ctx_send) : can_ctx_stats les relève sans verrou.
+*/
+struct can_stats
+{
+    unsigned long rx_frames;		/*!< Trames reçues */
+    unsigned long rx_short;		/*!< Lectures incomplètes, trames ignorées */
+    unsigned long rx_errors;		/*!< Erreurs de lecture sur le socket */
+    unsigned long rx_overflows;		/*!< Trames perdues par la file de réception du noyau */
+    unsigned long rx_match;		/*!< Trames traitées par au moins un bind */
+    unsigned long rx_miss;		/*!< Trames sans bind correspondant */
+    unsigned long tx_frames;		/*!< Trames émises */
+    unsigned long tx_errors;		/*!< Trames perdues sur erreur d'écriture */
+    unsigned long tx_full;		/*!< Trames refusées, anneau d'émission plein */
+    unsigned long tx_wake_errors;	/*!< Réveils du thread principal en échec */
+    unsigned long tx_deadline_misses;	/*!< Echéances manquées par l'ordonnanceur */
+};
+
+
+/**
+* @brief Crée le contexte d'une interface CAN
+*
+* Le contexte est créé arrêté : les binds et les réglages (can_ctx_set_rx_batch,
+* can_ctx_set_tx_mode, can_ctx_set_cpu) peuvent être faits avant can_ctx_init.
+*
+* @param iface_can chaine pour l'interface CAN (ex : "can0"), "can0" si NULL
+*
+* @returns Le contexte, NULL si erreur d'allocation
+*/
+struct can_ctx * can_ctx_new(const char * iface_can);
+
+/**
+* @brief Détruit le contexte d'une interface CAN
+*
+* Arrête l'interface si elle est active et libère ses binds.
+*
+* @param ctx L'interface
+*/
+void can_ctx_free(struct can_ctx * ctx);
+
+/**
+* @brief Donne le nom de l'interface CAN d'un contexte
+*
+* @param ctx L'interface
+*
+* @returns Le nom de l'interface (ex : "can0")
+*/
+const char * can_ctx_name(const struct can_ctx * ctx);
+
+/**
+* @brief Fixe les threads d'une interface sur un CPU
+*
+* Doit être appelée avant can_ctx_init.
+*
+* @param ctx L'interface
+* @param cpu Numéro du CPU, -1 pour ne pas fixer les threads (défaut)
+*
+* @returns 0 si OK, 1 si CPU invalide, 5 interface active
+*/
+int can_ctx_set_cpu(struct can_ctx * ctx, int cpu);
+
+/**
+* @brief Démarre une interface CAN
+*
+* Ouvre un socket can en lecture écriture sur l'interface du contexte. Crée le
+* thread principal de l'interface, l'anneau d'émission et son eventfd, le thread
+* d'ordonnancement des envois périodiques et son timerfd.
+* Si l'interface est déjà active, alors il ne se passera rien.
+*
+* @param ctx L'interface
+*
+* @returns 0 si OK, 1 si socket_can KO, 2 eventfd, 3 Thread can, 4 Ordonnanceur, 5 interface active, 6 allocation
+*/
+int can_ctx_init(struct can_ctx * ctx);
 
 /**
-* @brief Initialise la lib_can
+* @brief Arrête une interface CAN
+*
+* Attend la fin des threads. Ferme l'eventfd, le timerfd et le socket. Les
+* binds sont conservés pour le prochain can_ctx_init.
+*
+* @param ctx L'interface
+*
+* @returns 0
+*/
+int can_ctx_close(struct can_ctx * ctx);
+
+/**
+* @brief Relève les compteurs d'une interface
+*
+* @param ctx L'interface
+* @param st Reçoit les compteurs
+*/
+void can_ctx_stats(struct can_ctx * ctx, struct can_stats * st);
+
+/** @brief can_set_rx_batch pour une interface */
+int can_ctx_set_rx_batch(struct can_ctx * ctx, unsigned int batch);
+/** @brief can_isok pour une interface */
+int can_ctx_isok(struct can_ctx * ctx);
+
+/**
+* @brief Indique si une interface active accepte les trames CAN FD
+*
+* Vrai si l'interface a le MTU CANFD_MTU et que CAN_RAW_FD_FRAMES a été activé
+* à can_ctx_init. Sinon les trames FD émises sont perdues (tx_errors).
+*
+* @param ctx L'interface
+*
+* @returns 1 si l'interface est active en CAN FD, 0 sinon.
+*/
+int can_ctx_isfd(struct can_ctx * ctx);
+
+/** @brief can_send sur une interface */
+int can_ctx_send(struct can_ctx * ctx, struct can_frame msg);
+/** @brief can_send_batch sur une interface */
+unsigned int can_ctx_send_batch(struct can_ctx * ctx, const struct can_frame * msgs, unsigned int n);
+/** @brief can_send_fd sur une interface */
+int can_ctx_send_fd(struct can_ctx * ctx, const struct canfd_frame * msg);
+/** @brief can_send_batch_fd sur une interface */
+unsigned int can_ctx_send_batch_fd(struct can_ctx * ctx, const struct canfd_frame * msgs, unsigned int n);
+/** @brief can_bind_send sur une interface */
+int can_ctx_bind_send(struct can_ctx * ctx, canid_t ID, void * zone,
+                      unsigned short zone_length, unsigned long period);
+/** @brief can_set_tx_mode pour une interface */
+int can_ctx_set_tx_mode(struct can_ctx * ctx, int mode);
+/** @brief can_bind_send_update sur une interface */
+int can_ctx_bind_send_update(struct can_ctx * ctx, canid_t ID);
+/** @brief can_bind_receive sur une interface */
+int can_ctx_bind_receive(struct can_ctx * ctx, canid_t ID, canid_t mask,
+                         void * zone, unsigned short zone_length, can_callback_t callback);
+/** @brief can_unbind_receive sur une interface */
+int can_ctx_unbind_receive(struct can_ctx * ctx, canid_t ID, canid_t mask,
+                           void * zone, can_callback_t callback);
+/** @brief can_update_receive sur une interface */
+int can_ctx_update_receive(struct can_ctx * ctx, canid_t ID, canid_t mask,
+                           void * zone, unsigned short zone_length, can_callback_t callback);
+
+
+/**
+* @brief Initialise la lib_can sur l'interface par défaut
 *
 * Ouvre un socket can en lecture écriture. Crée le thread principal de la
-* lib_can. Crée une fifo pour la communication entre le programme appelant et la
-* lib_can. Crée un timer pour l'appel périodique à la fonction d'envoi.
+* lib_can. Crée l'anneau d'émission et son eventfd pour la communication entre
+* le programme appelant et la lib_can. Crée le thread d'ordonnancement des envois
+* périodiques et son timerfd.
 * Si la libcan est déjà active, alors il ne se passera rien.
 *
 * @param iface_can chaine pour l'interface CAN (ex : "/dev/can0")
 *
-* @returns 0 si OK, 1 si socket_can KO, 2 FIFO, 3 Thread can, 4 Timer, 5 libcan active
+* @returns 0 si OK, 1 si socket_can KO, 2 eventfd, 3 Thread can, 4 Ordonnanceur, 5 libcan active, 6 allocation
 */
 int can_init(const char * iface_can);
 
+/**
+* @brief Fixe le nombre maximum de trames lues par appel à recvmmsg()
+*
+* La réception lit les trames du socket CAN par lots afin de limiter le nombre
+* d'appels système. Doit être appelée avant can_init.
+*
+* @param batch Taille des lots de réception (>= 1, 32 par défaut)
+*
+* @returns 0 si OK, 1 si taille invalide, 5 libcan active
+*/
+int can_set_rx_batch(unsigned int batch);
+
 /**
 * @brief Termine la lib_can
 *
-* Attend la fin du thread. Ferme les fifos et le socket, supprime la fifo
-* utilisée.
+* Attend la fin des threads. Ferme l'eventfd, le timerfd et le socket.
 *
 * @returns 0
 */
@@ -58,39 +240,140 @@ int can_isok(void);
 /**
 * @brief Envoi directement un message
 *
+* Place le message dans l'anneau d'émission sans verrou : peut être appelée
+* depuis n'importe quel thread ou gestionnaire de signal. Trame classique
+* (8 octets au plus), passée par valeur comme dans les versions précédentes.
+*
 * @param msg message CAN à envoyer
 *
-* @returns 0 si OK, 1 si erreur
+* @returns 0 si OK, 1 si erreur (lib inactive ou anneau plein)
 */
 int can_send(struct can_frame msg);
 
 
+/**
+* @brief Envoi un lot de messages
+*
+* Place les messages dans l'anneau d'émission en une seule rafale : un seul
+* réveil du thread principal, qui les envoie par sendmmsg(). Si l'anneau se
+* remplit, les derniers messages sont refusés.
+*
+* @param msgs messages CAN à envoyer
+* @param n nombre de messages
+*
+* @returns Le nombre de messages placés dans l'anneau (les n premiers)
+*/
+unsigned int can_send_batch(const struct can_frame * msgs, unsigned int n);
+
+
+/**
+* @brief Envoi directement un message, classique ou CAN FD
+*
+* Comme can_send. Seuls l'en-tête et les len octets de données sont recopiés ;
+* une trame marquée CANFD_FDF est émise en CAN FD (len valide jusqu'à 64).
+*
+* @param msg message CAN à envoyer
+*
+* @returns 0 si OK, 1 si erreur (lib inactive ou anneau plein)
+*/
+int can_send_fd(const struct canfd_frame * msg);
+
+
+/**
+* @brief Envoi un lot de messages, classiques ou CAN FD
+*
+* Comme can_send_batch, pour des struct canfd_frame.
+*
+* @param msgs messages CAN à envoyer
+* @param n nombre de messages
+*
+* @returns Le nombre de messages placés dans l'anneau (les n premiers)
+*/
+unsigned int can_send_batch_fd(const struct canfd_frame * msgs, unsigned int n);
+
+
+/**
+* @brief Arrondit une longueur de données à la longueur CAN FD valide suivante
+*
+* Les longueurs CAN FD au-delà de 8 octets sont 12, 16, 20, 24, 32, 48 et 64.
+*
+* @param len Longueur des données (0 à 64)
+*
+* @returns La longueur valide, 64 au plus
+*/
+unsigned int can_fd_len(unsigned int len);
+
+
 /**
 * @brief Initialise le lancement périodique d'un message CAN
 *
 * Associe un couple identifiant + peride à une zone mémoire.
-* Après l'execution de cette fonction, toutes les période arrondie à 10 ms, la
-* librairie envoi le message CAN ID avec les donneés de la zone mémoire.
+* Après l'execution de cette fonction, toutes les périodes (à la milliseconde),
+* la librairie envoi le message CAN ID avec les donneés de la zone mémoire.
+* Une zone de plus de 8 octets (64 au plus) est envoyée en CAN FD. Un
+* identifiant avec CAN_EFF_FLAG ou au-delà de 0x7FF est émis en trame étendue.
+* Le nombre de binds n'est limité que par la mémoire disponible.
 *
 * @param ID Identifiant CAN
 * @param zone Zone mémoire à envoyer péridiquement
 * @param zone_length Longueur de la zone
-* @param period Période de l'envoi (granularité sur l'envoi : 10ms)
+* @param period Période de l'envoi en ms
 *
-* @returns 1 si OK, !=0 si KO.
+* @returns 0 si OK, 1 identifiant ou longueur invalide, 2 période nulle,
+* 3 allocation, 4 tâche refusée par le broadcast manager (le bind n'est pas créé)
 */
-int can_bind_send(unsigned short ID, void * zone, unsigned short zone_length,
+int can_bind_send(canid_t ID, void * zone, unsigned short zone_length,
                   unsigned long period);
 
 
+/** @brief Backend d'envoi périodique : ordonnanceur en espace utilisateur */
+#define CAN_TX_USER 0
+/** @brief Backend d'envoi périodique : broadcast manager du noyau (CAN_BCM) */
+#define CAN_TX_BCM 1
+
+/**
+* @brief Choisit le backend des envois périodiques
+*
+* Avec CAN_TX_BCM, chaque bind d'émission devient une tâche TX_SETUP du
+* broadcast manager : le noyau cadence l'envoi, sans timer en espace
+* utilisateur. Un seul bind par identifiant est alors pris en compte.
+* Doit être appelée avant can_init. Si le broadcast manager est indisponible
+* au démarrage, l'interface revient à CAN_TX_USER.
+*
+* @param mode CAN_TX_USER (défaut) ou CAN_TX_BCM
+*
+* @returns 0 si OK, 1 si mode invalide, 5 libcan active
+*/
+int can_set_tx_mode(int mode);
+
+
+/**
+* @brief Signale la mise à jour de la zone mémoire d'un bind d'émission
+*
+* Avec le backend CAN_TX_BCM, le contenu de la zone est recopié dans la tâche
+* du noyau par un TX_SETUP sans modification du timer. Avec CAN_TX_USER, la
+* zone est relue à chaque envoi et l'appel n'a pas d'effet.
+*
+* @param ID Identifiant CAN du bind
+*
+* @returns 0 si OK, 1 si aucun bind pour cet identifiant, 2 erreur BCM
+*/
+int can_bind_send_update(canid_t ID);
+
+
 /**
 * @brief Bind un ID+masque à un espace mémoire et/ou un callback
 *
 * Associe un couple identifiant + masque à une zone mémoire et/ou à un callback.
 * Après l'execution de cette fonction, si un message reçu respecte la condition
 * "(ID_reçue && mask) == (ID_bind && mask)" alors :
-* 	Si zone n'est pas NULL la mémoire est remplie
+* 	Si zone n'est pas NULL la mémoire est remplie (len octets de la trame,
+* 	64 au plus en CAN FD, dans la limite de zone_length)
 *	si callback n'est pas NULL, callback est appelé
+* Un identifiant avec CAN_EFF_FLAG ou au-delà de 0x7FF est étendu (29 bits) ;
+* un bind ne correspond qu'aux trames de son format, sauf avec un masque nul.
+* Le nombre de binds n'est limité que par la mémoire disponible. Peut être
+* appelée pendant que la lib reçoit des trames.
 *
 * @param ID l'identifiant CAN
 * @param mask le masque
@@ -101,9 +384,47 @@ int can_bind_send(unsigned short ID, void * zone, unsigned short zone_length,
 * @returns 0 si OK, !=0 si KO
 *
 */
-int can_bind_receive(unsigned short ID, unsigned short mask, void * zone,
+int can_bind_receive(canid_t ID, canid_t mask, void * zone,
                      unsigned short zone_length,
-		     void (*callback)(CServerTcpIP *this, struct can_frame cf));
+		     can_callback_t callback);
+
+
+/**
+* @brief Supprime un bind de reception
+*
+* Retire les binds correspondant exactement au quadruplet ID, masque, zone et
+* callback. Au retour, ni la zone ni le callback ne sont plus utilisés par la
+* lib (depuis un callback : à partir de la trame suivante). Peut être appelée
+* pendant que la lib reçoit des trames.
+*
+* @param ID l'identifiant CAN
+* @param mask le masque
+* @param zone la zone mémoire du bind
+* @param callback le callback du bind
+*
+* @returns 0 si OK, 1 si aucun bind ne correspond, 3 erreur d'allocation
+*/
+int can_unbind_receive(canid_t ID, canid_t mask, void * zone,
+                       can_callback_t callback);
+
+
+/**
+* @brief Modifie la zone mémoire et le callback d'un bind de reception
+*
+* Tous les binds ID+masque existants sont mis à jour. Peut être appelée pendant
+* que la lib reçoit des trames.
+*
+* @param ID l'identifiant CAN
+* @param mask le masque
+* @param zone la nouvelle zone mémoire à remplir
+* @param zone_length la taille de la zone mémoire disponible
+* @param callback le nouveau callback
+*
+* @returns 0 si OK, 1 si aucun bind ne correspond, 3 erreur d'allocation
+*/
+int can_update_receive(canid_t ID, canid_t mask, void * zone,
+                       unsigned short zone_length,
+		       can_callback_t callback);
 
 
 #ifdef __cplusplus
@@ -3,224 +3,727 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include "libcan.h"
+#include "canbin.h"
+#include "cancap.h"
+#include "canfilter.h"
+#include "cmdparse.h"
+#include "conflate.h"
+#include "frameenc.h"
+#include "lathist.h"
+#include "recorder.h"
 #include "CServerTcpIP.h"
 #include "debug.h"
 
 
-const char * can_iface_ptr = "can0";	
+/*
+ * Interfaces CAN servies, indexées par numéro de bus
+ */
+#define MAX_BUS		CANCAP_MAX_IFACES
+const char * bus_name[MAX_BUS] = { "can0" };
+struct can_ctx * bus[MAX_BUS];
+unsigned int nb_bus = 0;
+
+/* Trames d'une commande cansend placées ensemble dans l'anneau d'émission */
+#define CANSEND_LOT	64
+
 int serveur_running;
 CServerTcpIP *this = NULL;
 
 char fileRep[256];
 
+/*
+ * Etat associé à chaque client TCP
+ */
+struct session {
+	int mode;		/* Encodeur FRAMEENC_* négocié par la commande "mode" */
+	unsigned int buses;	/* Bus écoutés (bit n : bus n), choisis par la commande "bus" */
+	struct canfilter filtre;	/* Identifiants écoutés, commandes "subscribe" / "unsubscribe" */
+	int conflation;		/* Dernière valeur par identifiant si le client est en retard, commande "conflation" */
+	struct conflate attente;	/* Trames retenues pendant que la file d'émission du client se vide */
+	struct cmdparse entree;	/* Commande en cours de réception */
+};
 
 /*
- * crée un fichier si celui-ci n'existe pas
+ * Trame en cours de diffusion, encodée au plus une fois par encodeur
  */
-void initXML(){
-
-	FILE* xml = NULL;
-	if(fopen((const char *)fileRep, "r")==NULL){	//si le fichier n'existe pas
-		xml = fopen((const char *)fileRep, "a");	//le créer
-		if (xml != NULL){
-			fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>", xml);
-			fprintf(xml, "<%s>",can_iface_ptr);
-			fprintf(xml, "</%s>",can_iface_ptr);
-		}
-		else{
-			printf("Echec d'écriture du fichier xml");
+struct diffusion {
+	struct canfd_frame cf;				/* Trame, classique ou CAN FD */
+	struct timeval tv;				/* Date de la trame */
+	unsigned int bus;				/* Bus de la trame */
+	char enc[FRAMEENC_COUNT][FRAMEENC_MAX_SIZE];	/* Trame encodée par encodeur */
+	unsigned int len[FRAMEENC_COUNT];		/* 0 si pas encore encodée */
+};
+
+
+/*
+ * Numéro de bus d'une interface CAN, -1 si inconnue
+ */
+int busIndex(struct can_ctx *ctx){
+	unsigned int i;
+
+	for(i = 0; i < nb_bus; i++){
+		if(bus[i] == ctx)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Numéro de bus d'une interface désignée par son nom, -1 si inconnue
+ */
+int busFind(const char *nom, size_t len){
+	unsigned int i;
+
+	for(i = 0; i < nb_bus; i++){
+		if(strlen(bus_name[i]) == len && strncmp(bus_name[i], nom, len) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Démarre une interface CAN si elle ne l'est pas déjà
+ */
+void busStart(unsigned int n){
+	if(can_ctx_isok(bus[n]) == 0){
+		if(can_ctx_init(bus[n])){
+			printf("Il y a eu un erreur a l'init du CAN %s\n", bus_name[n]);
+			exit(1);
 		}
-		fclose(xml);
 	}
 }
 
 /*
- * Génère un timestamp a la milliseconde
+ * Affiche la trame CAN de maniere lisible sur le serveur
  */
-char *timestamp(){
-	struct timeval tv;
-	char *timestamp = malloc (sizeof (*timestamp) * 16);
-	gettimeofday(&tv,NULL);
-	sprintf(timestamp,"%d%d",tv.tv_sec, tv.tv_usec/1000);
-	return timestamp;
+
+void afficheTrame(const struct canfd_frame *cf){
+	int i = 0;	
+	printf("id=\"0x%X\" dlc=\"%d\" data=\"", cf->can_id, cf->len);
+	for(i = 0;i < cf->len;i++){
+		printf("%X ",cf->data[i]);
+	}
+}
+/*
+ * Envoie la trame en cours de diffusion à un client, dans l'encodage qu'il a négocié
+ */
+void envoiTrame(CServerTcpIP *this, Client *client, void *arg){
+	struct diffusion *d = arg;
+	struct session *s = client->pdata;
+	int mode = (s != NULL) ? s->mode : FRAMEENC_XML;
+
+	/* Filtrage avant tout encodage ou mise en file */
+	if(s != NULL && (!(s->buses & (1u << d->bus)) || !canfilter_match(&s->filtre, d->cf.can_id)))
+		return;
+
+	/*
+	 * Client en retard (file d'émission non vide) : seule la dernière trame de chaque
+	 * identifiant est gardée, jusqu'à ce que onDrain vide la table dans l'ordre des
+	 * identifiants. Tant que la table n'est pas vide, les trames y passent toutes afin
+	 * qu'une trame ancienne ne soit jamais envoyée après une plus récente.
+	 */
+	if(s != NULL && ((s->conflation && client->txq.len > 0) || conflate_pending(&s->attente) > 0)){
+		if(conflate_put(&s->attente, &d->cf, &d->tv, d->bus)){
+			DEBUG_FLOOD ("Conflation : table pleine, trame perdue\n");
+		}
+		return;
+	}
+
+	if(d->len[mode] == 0){
+		d->len[mode] = frameenc_table[mode].encode(d->enc[mode], &d->cf, &d->tv,
+		                                           bus_name[d->bus], d->bus);
+		lathist_record_since(&lathist_stage[LATHIST_ENCODE], &d->tv);
+	}
+	this->SendFrom (this, client, d->enc[mode], d->len[mode], &d->tv);
 }
 
 /*
- *	Mettre a jour le fichier can.xml
+ * File d'émission d'un client vidée : envoi des trames retenues par la conflation,
+ * jusqu'à ce que la socket soit de nouveau pleine
  */
+void onDrain(CServerTcpIP *this, Client *client, void *pdata){
+	struct session *s = client->pdata;
+	struct conflate_slot slot;
+	char enc[FRAMEENC_MAX_SIZE];
+	unsigned int len;
+
+	if(s == NULL)
+		return;
+	while(client->txq.len == 0 && !client->closing && conflate_pop(&s->attente, &slot) == 0){
+		len = frameenc_table[s->mode].encode(enc, &slot.cf, &slot.tv, bus_name[slot.bus], slot.bus);
+		lathist_record_since(&lathist_stage[LATHIST_ENCODE], &slot.tv);
+		this->SendFrom (this, client, enc, len, &slot.tv);
+	}
+}
 
-void ecrireXML(char *trame){
-	FILE* xml = NULL;
-	xml = fopen((const char *)fileRep, "r+");		
-	if (xml != NULL){
-		/* Permet de sauvegerder la fermeture de la balise racine*/
+/*
+ * Réponse de la commande "stats" en cours de construction
+ */
+struct rapport {
+	char *texte;
+	size_t len;
+	size_t taille;
+};
 
-		/*repositionne le pointeur av la balise racine ex(</can0>)*/
-		fseek(xml, -strlen(can_iface_ptr)-3, SEEK_END); 
-		
-		/*sauvegarde des données*/
-		fprintf(xml, "%s</%s>", trame, can_iface_ptr);
+/*
+ * Ajoute une ligne au rapport, agrandi à la demande
+ */
+void rapportAjoute(struct rapport *r, const char *format, ...){
+	va_list ap;
+	char *texte;
+	int len;
+
+	for(;;){
+		va_start(ap, format);
+		len = vsnprintf(r->texte + r->len, r->taille - r->len, format, ap);
+		va_end(ap);
+		if(len < 0)
+			return;
+		if(r->len + len < r->taille){
+			r->len += len;
+			return;
+		}
+		texte = realloc(r->texte, r->taille * 2 + len);
+		if(texte == NULL)
+			return;
+		r->texte = texte;
+		r->taille = r->taille * 2 + len;
 	}
-	else{
-		printf("Echec d'écriture du fichier xml");
+}
+
+/*
+ * Une ligne par client : la liste de son worker est verrouillée, le rapport
+ * n'est envoyé qu'après le parcours
+ */
+void statsClient(CServerTcpIP *this, Client *client, void *arg){
+	struct session *s = client->pdata;
+
+	rapportAjoute(arg, "stats client %s:%u bytes=%lu frames=%lu queue=%u drop_oldest=%lu drop_newest=%lu conflated_drop=%lu\n",
+	              client->adresseIP, client->port, client->tx_bytes, client->tx_msgs, client->txq.len,
+	              client->drop_oldest, client->drop_newest, (s != NULL) ? s->attente.dropped : 0);
+}
+
+/*
+ * Enregistre une trame CAN du bus n, datée tv, et la diffuse aux clients TCP
+ */
+
+void parseXML(CServerTcpIP *this, unsigned int n, const struct canfd_frame *cf, const struct timeval *tv){
+	struct diffusion d;
+
+	d.cf = *cf;
+	d.bus = n;
+	d.tv = *tv;
+	memset(d.len, 0, sizeof(d.len));
+
+	//Sauvegarde la trame courante (thread d'écriture de l'enregistreur)
+	if(recorder_push(cf, &d.tv, n) == 1){
+		DEBUG_FLOOD ("Enregistrement : trame perdue\n");
 	}
-	fclose(xml);
+
+	/* Diffusion à chaque client selon son encodage */
+	this->ForEach (this, envoiTrame, &d);
 }
 
+
 /*
- * Affiche la trame CAN de maniere lisible sur le serveur
+ * Envoie sur le bus CAN une trame reçue en enregistrement binaire
  */
+void enregistrementBinaire(CServerTcpIP *this, const unsigned char *rec){
+	struct canfd_frame msg;
+	struct timeval tv;
+	unsigned int n;
 
-void afficheTrame(struct can_frame cf){
-	int i = 0;	
-	printf("id=\"0x%X\" dlc=\"%d\" data=\"", cf.can_id, cf.can_dlc);
-	for(i = 0;i < cf.can_dlc;i++){
-		printf("%X ",cf.data[i]);
+	/* L'octet "bus" de l'enregistrement désigne l'interface d'émission */
+	if(canbin_unpack(rec, &msg, &n) || n >= nb_bus){
+		fprintf(stderr, "Enregistrement binaire invalide\n");
+		return;
 	}
+	busStart(n);
+	if((msg.flags & CANFD_FDF) && !can_ctx_isfd(bus[n])){
+		fprintf(stderr, "Trame CAN FD refusee : %s n'est pas en CAN FD\n", bus_name[n]);
+		return;
+	}
+	can_ctx_send_fd (bus[n], &msg);
+	gettimeofday(&tv, NULL);
+	parseXML(this, n, &msg, &tv);
 }
+
 /*
- * Converti une trame CAN au format XML 
+ * Valeur d'un chiffre hexadécimal, -1 si ce n'en est pas un
  */
+int hexval(char c){
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
 
-void parseXML(CServerTcpIP *this, struct can_frame cf){
-	int i = 0;
-	char *trame = malloc (sizeof (*trame) * 2048);
-	char *temp = malloc (sizeof (*temp) * 2048);	
-	
-		
-	//sprintf(trame, "reception CAN ok \n");	
-	sprintf(trame, "<trame><id>0x%X</id><dlc>%d</dlc><timestamp>%s</timestamp><data>", cf.can_id, cf.can_dlc, timestamp());
-	//sprintf(trame, "<trame><id>0x%X</id><dlc>%d</dlc><timestamp>0</timestamp><data>", cf.can_id, cf.can_dlc);
-	//Formatage des données	
-	for(i = 0;i < cf.can_dlc;i++){
-		sprintf(temp, "<data%d>0x%X</data%d>", i, cf.data[i], i);
-		strcat(trame, temp);
-		memset (temp, 0, sizeof (temp));
-	}
-	sprintf(temp, "</data></trame>");
-	strcat(trame, temp);
-	memset (temp, 0, sizeof (temp));
-	
+/*
+ * Lit un identifiant de chiffres caractères hexadécimaux, comme cansend : 3 chiffres au plus
+ * pour un identifiant standard, exactement 8 pour un identifiant étendu (CAN_EFF_FLAG ajouté)
+ * Retourne 0 si ok, -1 si l'identifiant est invalide
+ */
+int lireIdentifiant(const char *texte, unsigned int chiffres, canid_t *id){
+	unsigned int i;
+	int v;
+
+	*id = 0;
+	if(chiffres == 0 || (chiffres > 3 && chiffres != 8))
+		return -1;
+	for(i = 0; i < chiffres; i++){
+		if((v = hexval(texte[i])) < 0)
+			return -1;
+		*id = (*id << 4) | v;
+	}
+	if(chiffres == 8){
+		if(*id > CAN_EFF_MASK)
+			return -1;
+		*id |= CAN_EFF_FLAG;
+	}
+	else if(*id > CAN_SFF_MASK)
+		return -1;
+	return 0;
+}
 
-	//Sauvegarde la trame courante dans le fichier XML
-	ecrireXML(trame);
+/*
+ * Lit une trame "ID#DATA" (hexadécimal, au plus 8 octets de données) ou, comme cansend,
+ * une trame CAN FD "ID##<flags>DATA" : flags BRS (1) et ESI (2) sur un chiffre, au plus
+ * 64 octets de données, longueur complétée de zéros jusqu'à la longueur FD valide suivante
+ * ID lu par lireIdentifiant : 3 chiffres au plus en standard, 8 en étendu (29 bits)
+ * "ID#R" ou "ID#R<longueur>" : trame de demande (RTR), longueur de 0 à 8
+ * Retourne 0 si ok, -1 si la trame est invalide
+ */
+int lireTrame(const char *texte, unsigned int len, struct canfd_frame *msg){
+	unsigned int i = 0, chiffres = 0, max = 2 * CAN_MAX_DLEN;
+	int v;
+
+	memset(msg, 0, sizeof(*msg));
+	while(i < len && texte[i] != '#')
+		i++;
+	if(i >= len || lireIdentifiant(texte, i, &msg->can_id))
+		return -1;
+	i++;
+	if(i < len && (texte[i] == 'R' || texte[i] == 'r')){
+		msg->can_id |= CAN_RTR_FLAG;
+		if(i + 1 < len){
+			if(i + 2 < len || (v = hexval(texte[i + 1])) < 0 || v > CAN_MAX_DLEN)
+				return -1;
+			msg->len = v;
+		}
+		return 0;
+	}
+	if(i < len && texte[i] == '#'){
+		if(i + 1 >= len || (v = hexval(texte[i + 1])) < 0)
+			return -1;
+		msg->flags = CANFD_FDF | (v & (CANFD_BRS | CANFD_ESI));
+		max = 2 * CANFD_MAX_DLEN;
+		i += 2;
+	}
+	for(; i < len; i++, chiffres++){
+		if(chiffres >= max || (v = hexval(texte[i])) < 0)
+			return -1;
+		msg->data[chiffres / 2] |= v << ((chiffres % 2) ? 0 : 4);
+	}
+	msg->len = (chiffres + 1) / 2;
+	if(msg->flags & CANFD_FDF)
+		msg->len = can_fd_len(msg->len);
+	return 0;
+}
 
-	/*
- 	 * Pour l"envoi en TCP
- 	 */
-
-	//prologue et rajout des balise racines
-	sprintf(temp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?><%s>%s</%s>\n", can_iface_ptr, trame, can_iface_ptr); 
-	strcpy(trame, temp);
-	//printf("%s\n\n\n",trame);
-	this->Send (this, NULL, trame, strlen(trame));
-	free(temp);
-	free(trame);
+/*
+ * Mot suivant d'une commande à partir de la position *i, qui est avancée après le mot
+ * Retourne le début du mot, sa longueur dans *len (0 en fin de commande)
+ */
+const char *motSuivant(const char *buffer, unsigned int buffer_size, unsigned int *i, unsigned int *len){
+	unsigned int debut;
+
+	while(*i < buffer_size && buffer[*i] <= ' ')
+		(*i)++;
+	debut = *i;
+	while(*i < buffer_size && buffer[*i] > ' ')
+		(*i)++;
+	*len = *i - debut;
+	return buffer + debut;
 }
 
+void commande (CServerTcpIP *this, Client *expediteur, char *buffer, unsigned int buffer_size);
 
 /*
  * Fuction called back when TCP/IP Server received data
+ * Les données sont découpées en commandes par le parseur de la session du client : une commande
+ * peut arriver en plusieurs morceaux, et un morceau contenir plusieurs commandes.
  */
 void protocole (char *buffer, unsigned int buffer_size, CServerTcpIP *this, Client *expediteur, void *private_data){
+	struct session *s = expediteur->pdata;
+	unsigned int len;
+	char *cmd;
+	int type;
+
 	DEBUG_INFO ("Client %s:%d\n", expediteur->adresseIP, expediteur->port);
-	DEBUG_INFO ("%d octets recu : %s\n", buffer_size, buffer);
+	DEBUG_INFO ("%d octets recu : %.*s\n", buffer_size, (int)buffer_size, buffer);
+
+	/* La session est créée par onConnect avant toute réception : seul un échec d'allocation la laisse à NULL */
+	if (s == NULL) {
+		DEBUG ("Client %s:%d sans session, données ignorées\n", expediteur->adresseIP, expediteur->port);
+		return;
+	}
 
+	while ((type = cmdparse_next (&s->entree, &buffer, &buffer_size, &cmd, &len)) != CMDPARSE_NONE) {
+		if (type == CMDPARSE_RECORD)
+			enregistrementBinaire (this, (unsigned char *) cmd);
+		else if (type == CMDPARSE_LINE)
+			commande (this, expediteur, cmd, len);
+		else
+			this->Send (this, expediteur, "commande trop longue\n", sizeof ("commande trop longue\n") -1);
+	}
+}
+
+/*
+ * Exécute une commande texte d'un client, sans son '\n' et terminée par un 0
+ */
+/*
+ * Les commandes sont traitées par le worker du client, hors de son mutex, alors que le thread de
+ * réception CAN lit la session dans envoiTrame sous ce mutex (ForEach) : toute modification de la
+ * session se fait donc mutex du worker verrouillé. La lecture reste libre ici, seul ce worker écrit.
+ */
+void commande (CServerTcpIP *this, Client *expediteur, char *buffer, unsigned int buffer_size){
 	/* Echo */
 	//this->Send (this, expediteur, buffer, buffer_size);
-	//printf("Date : %d\n", timestamp());
+
+	/* Choix de l'encodage : "mode xml|json|candump|csv|bin" */
+
+	if (strncmp ("mode ", buffer, 5) == 0) {
+		struct session *s = expediteur->pdata;
+		unsigned int len = 5;
+		int mode;
+
+		while (len < buffer_size && buffer[len] > ' ')
+			len++;
+		mode = frameenc_find(buffer + 5, len - 5);
+		if (s != NULL && mode >= 0) {
+			this->Send (this, expediteur, buffer, len);
+			this->Send (this, expediteur, "\n", 1);
+			pthread_mutex_lock (&expediteur->worker->m_mutex);
+			s->mode = mode;
+			pthread_mutex_unlock (&expediteur->worker->m_mutex);
+		} else {
+			this->Send (this, expediteur, "mode inconnu\n", sizeof ("mode inconnu\n") -1);
+		}
+	}
+
+	/* Conflation pour les clients lents : "conflation on|off" */
+
+	if (strncmp ("conflation ", buffer, 11) == 0) {
+		struct session *s = expediteur->pdata;
+
+		if (s != NULL && strncmp (buffer + 11, "on", 2) == 0 && (buffer_size == 13 || buffer[13] <= ' ')) {
+			pthread_mutex_lock (&expediteur->worker->m_mutex);
+			s->conflation = 1;
+			pthread_mutex_unlock (&expediteur->worker->m_mutex);
+			this->Send (this, expediteur, "conflation on\n", sizeof ("conflation on\n") -1);
+		} else if (s != NULL && strncmp (buffer + 11, "off", 3) == 0 && (buffer_size == 14 || buffer[14] <= ' ')) {
+			/* Les trames déjà retenues partent au prochain vidage de la file */
+			pthread_mutex_lock (&expediteur->worker->m_mutex);
+			s->conflation = 0;
+			pthread_mutex_unlock (&expediteur->worker->m_mutex);
+			this->Send (this, expediteur, "conflation off\n", sizeof ("conflation off\n") -1);
+		} else {
+			this->Send (this, expediteur, "conflation invalide\n", sizeof ("conflation invalide\n") -1);
+		}
+	}
+
+	/* Compteurs : "stats" (interfaces CAN, serveur TCP, enregistreur, clients) */
+
+	if (strncmp ("stats", buffer, 5) == 0 && (buffer_size == 5 || buffer[5] <= ' ')) {
+		struct rapport r = { NULL, 0, 0 };
+		struct can_stats cs;
+		CServerTcpIP_stats_t ts;
+		unsigned int k;
+
+		for (k = 0; k < nb_bus; k++) {
+			can_ctx_stats (bus[k], &cs);
+			rapportAjoute (&r, "stats %s rx=%lu rx_short=%lu rx_err=%lu rx_overflow=%lu match=%lu miss=%lu"
+			               " tx=%lu tx_err=%lu tx_full=%lu tx_wake_err=%lu deadline_miss=%lu\n",
+			               bus_name[k], cs.rx_frames, cs.rx_short, cs.rx_errors, cs.rx_overflows,
+			               cs.rx_match, cs.rx_miss, cs.tx_frames, cs.tx_errors, cs.tx_full,
+			               cs.tx_wake_errors, cs.tx_deadline_misses);
+		}
+		this->GetStats (this, &ts);
+		rapportAjoute (&r, "stats tcp clients=%d bytes=%lu frames=%lu queued=%lu drop_oldest=%lu drop_newest=%lu"
+		               " disc_peer=%lu disc_error=%lu disc_queue=%lu disc_stop=%lu\n",
+		               ts.clients, ts.tx_bytes, ts.tx_msgs, ts.queued, ts.drop_oldest, ts.drop_newest,
+		               ts.disconnects[CSERVERTCPIP_DISCONNECT_PEER], ts.disconnects[CSERVERTCPIP_DISCONNECT_ERROR],
+		               ts.disconnects[CSERVERTCPIP_DISCONNECT_QUEUE], ts.disconnects[CSERVERTCPIP_DISCONNECT_STOP]);
+		rapportAjoute (&r, "stats recorder open=%d dropped=%lu\n", recorder_isopen (), recorder_dropped ());
+		this->ForEach (this, statsClient, &r);
+
+		if (r.texte != NULL)
+			this->Send (this, expediteur, r.texte, r.len);
+		free (r.texte);
+	}
+
+	/*
+	 * Latences depuis l'arrivée des trames : "latency" (percentiles par étape, en ns),
+	 * "latency reset" (remise à zéro)
+	 */
+
+	if (strncmp ("latency", buffer, 7) == 0 && (buffer_size == 7 || buffer[7] <= ' ')) {
+		const struct lathist *h;
+		char reponse[160];
+		int k, len;
+
+		if (buffer_size >= 13 && strncmp (buffer + 8, "reset", 5) == 0) {
+			for (k = 0; k < LATHIST_STAGES; k++)
+				lathist_reset (&lathist_stage[k]);
+		}
+		for (k = 0; k < LATHIST_STAGES; k++) {
+			h = &lathist_stage[k];
+			len = snprintf (reponse, sizeof (reponse),
+			                "latency %s count=%lu p50=%llu p99=%llu p999=%llu max=%llu\n",
+			                lathist_name[k], lathist_count (h), lathist_percentile (h, 0.50),
+			                lathist_percentile (h, 0.99), lathist_percentile (h, 0.999), lathist_max (h));
+			this->Send (this, expediteur, reponse, len);
+		}
+	}
+
+	/* Choix des bus écoutés : "bus" (liste), "bus all", "bus can0 can2" */
+
+	if (strncmp ("bus", buffer, 3) == 0 && (buffer_size == 3 || buffer[3] <= ' ')) {
+		struct session *s = expediteur->pdata;
+		char reponse[64];
+		unsigned int i = 3, debut, buses = 0;
+		int k, erreur = 0, len;
+
+		while (i < buffer_size) {
+			while (i < buffer_size && buffer[i] <= ' ')
+				i++;
+			debut = i;
+			while (i < buffer_size && buffer[i] > ' ')
+				i++;
+			if (i == debut)
+				break;
+			if (i - debut == 3 && strncmp (buffer + debut, "all", 3) == 0)
+				buses = ~0u;
+			else if ((k = busFind (buffer + debut, i - debut)) >= 0)
+				buses |= 1u << k;
+			else
+				erreur = 1;
+		}
+
+		if (erreur || s == NULL) {
+			this->Send (this, expediteur, "bus inconnu\n", sizeof ("bus inconnu\n") -1);
+		} else {
+			if (buses != 0) {
+				pthread_mutex_lock (&expediteur->worker->m_mutex);
+				s->buses = buses;
+				pthread_mutex_unlock (&expediteur->worker->m_mutex);
+			}
+			/* Liste des bus : numéro, nom, et '*' si écouté */
+			for (k = 0; k < (int)nb_bus; k++) {
+				len = snprintf (reponse, sizeof (reponse), "bus %d %s%s\n", k, bus_name[k],
+				                (s->buses & (1u << k)) ? " *" : "");
+				this->Send (this, expediteur, reponse, len);
+			}
+		}
+	}
 	
-	/* Enregistre le trafic CAN dans un fichier XML et envoi TCP */
+	/*
+	 * Abonnements : "subscribe <id> [mask]" (hexadécimal, masque 7FF par défaut ; identifiant
+	 * lu comme cansend par lireIdentifiant, étendu sur 8 chiffres, masque 1FFFFFFF par défaut),
+	 * "subscribe" (liste), "unsubscribe <id> [mask]", "unsubscribe" (toutes les trames).
+	 * Sans abonnement le client reçoit toutes les trames.
+	 */
 
-	if (strncmp ("enregistrer", buffer, 11) == 0) {
-		
-		
-		char	*separateur = "-\n";     //séparateurs
-		char    *Chaine_Entrante;
-		char 	*nom;
-		
-		nom = malloc (sizeof (*nom) * 256);
-
-		Chaine_Entrante = strdup(buffer);	// /!\ génere une malloc
-		nom = strtok(Chaine_Entrante, separateur);
-		nom = strtok(NULL, separateur);
-		//strncpy(fileRep, nom, sizeof(fileRep));
-		//fileRep[sizeof(fileRep) - 1] = '\0';
-		sprintf(fileRep, "/home/pi/xml/%s",nom);
-		printf("Répertoire du fichier : %s\n",fileRep);		
-		initXML();
-
-		free(Chaine_Entrante);
-
-		/* Initialisation CAN*/
-		if(can_isok() == 1){
-			can_close();
+	if ((strncmp ("subscribe", buffer, 9) == 0 && (buffer_size == 9 || buffer[9] <= ' '))
+	    || (strncmp ("unsubscribe", buffer, 11) == 0 && (buffer_size == 11 || buffer[11] <= ' '))) {
+		struct session *s = expediteur->pdata;
+		int retrait = (buffer[0] == 'u');
+		char commande[64], *debut, *fin;
+		unsigned int k, nb = 0;
+		canid_t valeurs[2];
+		char reponse[64];
+		int len, erreur = 0;
+
+		len = (buffer_size < sizeof (commande)) ? buffer_size : sizeof (commande) - 1;
+		memcpy (commande, buffer, len);
+		commande[len] = '\0';
+		fin = commande + (retrait ? 11 : 9);
+		while (nb < 2) {
+			while (*fin != '\0' && *fin <= ' ')
+				fin++;
+			if (*fin == '\0')
+				break;
+			debut = fin;
+			if (nb == 0) {
+				/* Identifiant : même règle que cansend */
+				while (*fin > ' ')
+					fin++;
+				erreur = lireIdentifiant (debut, fin - debut, &valeurs[0]);
+			} else {
+				valeurs[nb] = strtoul (fin, &fin, 16);
+				erreur = (*fin > ' ');
+			}
+			if (erreur)
+				break;
+			nb++;
 		}
-		void dump(CServerTcpIP *this, struct can_frame cf);
-		
-		if(can_init(can_iface_ptr)){
-			printf("Il y a eu un erreur a l'init du CAN\n");
-			exit(1);
+		if (nb == 1)
+			valeurs[1] = (valeurs[0] & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK;
+
+		if (s == NULL || erreur) {
+			erreur = 1;
+		} else {
+			pthread_mutex_lock (&expediteur->worker->m_mutex);
+			if (retrait && nb == 0)
+				canfilter_clear (&s->filtre);
+			else if (retrait)
+				erreur = canfilter_remove (&s->filtre, valeurs[0], valeurs[1]);
+			else if (nb > 0)
+				erreur = canfilter_add (&s->filtre, valeurs[0], valeurs[1]);
+			pthread_mutex_unlock (&expediteur->worker->m_mutex);
+		}
+
+		if (erreur) {
+			this->Send (this, expediteur, "abonnement invalide\n", sizeof ("abonnement invalide\n") -1);
+		} else {
+			/* Liste des abonnements */
+			for (k = 0; k < s->filtre.nb; k++) {
+				if (s->filtre.subs[k].id & CAN_EFF_FLAG)
+					len = snprintf (reponse, sizeof (reponse), "subscribe %08X %08X\n",
+					                s->filtre.subs[k].id & CAN_EFF_MASK,
+					                s->filtre.subs[k].mask & CAN_EFF_MASK);
+				else
+					len = snprintf (reponse, sizeof (reponse), "subscribe %X %X\n",
+					                s->filtre.subs[k].id, s->filtre.subs[k].mask & CAN_SFF_MASK);
+				this->Send (this, expediteur, reponse, len);
+			}
+			if (!s->filtre.active)
+				this->Send (this, expediteur, "subscribe all\n", sizeof ("subscribe all\n") -1);
+		}
+	}
+
+	/* Enregistre le trafic CAN dans un fichier XML et envoi TCP : "enregistrer-<nom>" */
+
+	if (strncmp ("enregistrer", buffer, 11) == 0) {
+		void dump(CServerTcpIP *this, struct can_ctx *ctx, const struct canfd_frame *cf, const struct timeval *tv);
+		const char *nom = (buffer_size > 12 && buffer[11] == '-') ? buffer + 12 : NULL;
+		struct recorder_config cfg;
+		unsigned int n;
+
+		/* Un seul enregistrement à la fois : le précédent est finalisé */
+		recorder_close();
+
+		/* Initialisation CAN : toutes les interfaces, un seul bind par interface */
+		recorder_default_config(&cfg);
+		for(n = 0; n < nb_bus; n++){
+			can_ctx_unbind_receive(bus[n], 0x000, 0x000, NULL, dump);
+			if(can_ctx_bind_receive(bus[n], 0x000, 0x000, NULL, 0, dump)){
+				fprintf(stderr, "Erreur au bind de reception\n");
+			}
+			busStart(n);
+			/* Une interface CAN FD impose une capture à enregistrements longs */
+			if(can_ctx_isfd(bus[n]))
+				cfg.fd = 1;
 		}
-		if(can_bind_receive(0x000, 0x000, NULL, 0, dump)){
-			fprintf(stderr, "Erreur au bind de reception\n");
+
+		if(nom != NULL){
+			snprintf(fileRep, sizeof(fileRep), "/home/pi/xml/%.*s", (int)strcspn(nom, "-"), nom);
+			printf("Répertoire du fichier : %s\n",fileRep);
+			if(recorder_open(fileRep, bus_name, nb_bus, &cfg)){
+				printf("Echec d'ouverture de l'enregistrement %s\n", fileRep);
+			}
 		}
 	}
 	
-	/* Envoi une trame sur le bus CAN */
-
-	if (strncmp ("cansend", buffer, 7) == 0) {
-		
-		
-		char	*separateur = " #\n";     //séparateurs
-		char    *Chaine_Entrante;
-		char 	*trame;
-		struct 	can_frame msg;
-		int 	i, j;
-		char	data[3];
-		
-		j =0;
-		trame = malloc (sizeof (*trame) * 256);
-		
-		Chaine_Entrante = strdup(buffer);	// /!\ génere une malloc
-		trame = strtok(Chaine_Entrante, separateur);
-		if(trame != NULL){
-			trame = strtok(NULL, separateur);
-			//printf("%s\n",trame);	
-			msg.can_id = (int)strtol(trame, NULL, 16);
+	/*
+	 * Envoi de trames sur le bus CAN : "cansend [-q] [iface] ID#DATA [ID##<flags>DATA ...]"
+	 * Les trames partent en rafale, acquittées par une seule réponse "OK <n>" (suivie de
+	 * "full=<m>" si l'anneau d'émission en a refusé). -q supprime leur diffusion aux clients.
+	 * Les trames CAN FD (ID##...) ne sont acceptées que sur une interface en CAN FD.
+	 */
+
+	if (strncmp ("cansend", buffer, 7) == 0 && (buffer_size == 7 || buffer[7] <= ' ')) {
+		struct 	canfd_frame lot[CANSEND_LOT];
+		struct	timeval tv;
+		const char *mot;
+		char reponse[64];
+		unsigned int i = 7, premier, len, nb = 0, k, envoyees = 0, refusees = 0, lot_nb, lot_ok;
+		int b, n = 0, silence = 0, erreur = 0, fd = 0;
+
+		mot = motSuivant (buffer, buffer_size, &i, &len);
+		if (len == 2 && strncmp (mot, "-q", 2) == 0) {
+			silence = 1;
+			mot = motSuivant (buffer, buffer_size, &i, &len);
 		}
-		
-		if(trame != NULL){
-			trame = strtok(NULL, separateur);
-			for(i=0;i<strlen(trame);i+=2){
-				sprintf(data, "%c%c", trame[i], trame[i+1]);
-				msg.data[j] = (int)strtol(data, NULL, 16);				
-				//printf("%s\n",data);
-				j++;
+		/* Interface optionnelle, le premier bus par défaut */
+		if ((b = busFind (mot, len)) >= 0) {
+			n = b;
+			mot = motSuivant (buffer, buffer_size, &i, &len);
+		}
+
+		/* Toutes les trames sont vérifiées avant le premier envoi */
+		premier = mot - buffer;
+		for (; len > 0; mot = motSuivant (buffer, buffer_size, &i, &len)) {
+			if (lireTrame (mot, len, &lot[0])) {
+				erreur = 1;
+				break;
 			}
+			fd |= lot[0].flags & CANFD_FDF;
+			nb++;
 		}
-		
-		msg.can_dlc = (strlen(trame)-1)/2+(strlen(trame)-1)%2;	
-
-		free(Chaine_Entrante);
-		if(can_isok() == 0){
-			if(can_init(can_iface_ptr)){
-				printf("Il y a eu un erreur a l'init du CAN\n");
-				exit(1);
+
+		if (!erreur && nb > 0)
+			busStart(n);
+		if (erreur || nb == 0) {
+			this->Send (this, expediteur, "trame invalide\n", sizeof ("trame invalide\n") -1);
+		} else if (fd && !can_ctx_isfd (bus[n])) {
+			this->Send (this, expediteur, "CAN FD non supporte\n", sizeof ("CAN FD non supporte\n") -1);
+		} else {
+			i = premier;
+			while (nb > 0) {
+				lot_nb = (nb < CANSEND_LOT) ? nb : CANSEND_LOT;
+				for (k = 0; k < lot_nb; k++) {
+					mot = motSuivant (buffer, buffer_size, &i, &len);
+					lireTrame (mot, len, &lot[k]);
+				}
+				nb -= lot_nb;
+
+				lot_ok = can_ctx_send_batch_fd (bus[n], lot, lot_nb);
+				envoyees += lot_ok;
+				refusees += lot_nb - lot_ok;
+
+				/* Trames émises : datées à leur mise en file d'émission */
+				if (!silence) {
+					gettimeofday(&tv, NULL);
+					for (k = 0; k < lot_ok; k++)
+						parseXML(this, n, &lot[k], &tv);
+				}
 			}
+
+			if (refusees > 0)
+				len = snprintf (reponse, sizeof (reponse), "OK %u full=%u\n", envoyees, refusees);
+			else
+				len = snprintf (reponse, sizeof (reponse), "OK %u\n", envoyees);
+			this->Send (this, expediteur, reponse, len);
 		}
-		can_send (msg);
-		parseXML(this, msg);
-			
 	}
 	
 	/* Ferme le socket CAN */
 
 	if (strncmp ("stop", buffer, 4) == 0) {
-		can_close();
+		unsigned int n;
+
+		for(n = 0; n < nb_bus; n++){
+			can_ctx_close(bus[n]);
+		}
+		recorder_close();
 	}	
 
 	/* Quit if receive 'exit' from a client */
@@ -232,15 +735,30 @@ void protocole (char *buffer, unsigned int buffer_size, CServerTcpIP *this, Clie
 
 void onConnect (CServerTcpIP *this, Client *from, void *pdata){
 	DEBUG_INFO ("New client %s:%d\n", from->adresseIP, from->port);
+	/* Les clients démarrent en XML sur tous les bus, le reste est négocié */
+	struct session *s = calloc(1, sizeof(struct session));
+
+	if(s != NULL){
+		s->buses = ~0u;
+	}
+	from->pdata = s;
+}
+
+void onDisconnect (CServerTcpIP *this, Client *from, void *pdata){
+	DEBUG_INFO ("Client %s:%d disconnected\n", from->adresseIP, from->port);
+	free(from->pdata);
+	from->pdata = NULL;
 }
 
 /*
- * Fonction de callback appeler lors de la récéption d'une trame CAN
+ * Fonction de callback appeler lors de la récéption d'une trame CAN, datée à son arrivée par le noyau
  */
 
-void dump(CServerTcpIP *this, struct can_frame cf){
-	if(cf.can_id != 0){		
-		parseXML(this, cf);
+void dump(CServerTcpIP *this, struct can_ctx *ctx, const struct canfd_frame *cf, const struct timeval *tv){
+	int n = busIndex(ctx);
+
+	if(cf->can_id != 0 && n >= 0){		
+		parseXML(this, n, cf, tv);
 	}
 }
 
@@ -261,6 +779,43 @@ int main(int argc, char * argv[]){
 
 	
 
+	/*
+	 *	Interfaces CAN : "CAN-TCP [-w workers] [iface[@cpu] ...]", can0 par défaut.
+	 *	Chaque interface a ses threads, fixés sur le CPU indiqué après '@'.
+	 *	-w répartit les clients TCP sur plusieurs threads d'écoute (SO_REUSEPORT).
+	 */
+	int i, bus_cpu[MAX_BUS];
+	unsigned int workers = 1;
+	char *cpu;
+
+	for(i = 1; i < argc && nb_bus < MAX_BUS; i++){
+		if(strcmp(argv[i], "-w") == 0 && i + 1 < argc){
+			workers = atoi(argv[++i]);
+			continue;
+		}
+		bus_cpu[nb_bus] = -1;
+		cpu = strchr(argv[i], '@');
+		if(cpu != NULL){
+			*cpu++ = '\0';
+			bus_cpu[nb_bus] = atoi(cpu);
+		}
+		bus_name[nb_bus] = argv[i];
+		nb_bus++;
+	}
+	if(nb_bus == 0){
+		bus_cpu[0] = -1;
+		nb_bus = 1;
+	}
+	for(i = 0; i < (int)nb_bus; i++){
+		if((bus[i] = can_ctx_new(bus_name[i])) == NULL){
+			fprintf(stderr, "Allocation de l'interface %s impossible\n", bus_name[i]);
+			return 1;
+		}
+		if(can_ctx_set_cpu(bus[i], bus_cpu[i])){
+			fprintf(stderr, "CPU invalide pour l'interface %s\n", bus_name[i]);
+		}
+	}
+
 	/* Initialisation Serveur TCP*/
 	int ret;
 	DEBUG_INFO ("Server is listening on port 1234.\nIf a client say \"exit\", he will stop the server.\n");
@@ -275,6 +830,11 @@ int main(int argc, char * argv[]){
 		DEBUG ("Can't create CServerTcpIP object\n");
 		return 0;
 	}
+	this->SetDisconnectCallback (this, onDisconnect);
+	this->SetDrainCallback (this, onDrain);
+	if (this->SetWorkers (this, workers) != 0) {
+		DEBUG ("Invalid number of workers, using one\n");
+	}
 	
 	/*
 	 *	Start the listen socket on port 1234
@@ -298,9 +858,10 @@ int main(int argc, char * argv[]){
 	/* 
 	 * Ferme le socket can si il est ouvert
 	 */	
-	if(can_isok() == 1){
-		can_close();
+	for(i = 0; i < (int)nb_bus; i++){
+		can_ctx_free(bus[i]);
 	}
+	recorder_close();
 	this->Free (this);
 	//free(nom);
 
@@ -0,0 +1,773 @@
+/**
+ * @file recorder.c
+ *
+ * @brief Enregistrement asynchrone du trafic CAN dans un fichier.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <net/if.h>
+
+#include "canbin.h"
+#include "cancap.h"
+#include "frameenc.h"
+#include "recorder.h"
+
+/** @brief Capacité par défaut du tampon mémoire en trames */
+#ifndef RECORDER_BUFFER_FRAMES
+#define RECORDER_BUFFER_FRAMES 65536
+#endif
+/** @brief Taille par défaut d'un groupe d'écriture en trames */
+#ifndef RECORDER_COMMIT_FRAMES
+#define RECORDER_COMMIT_FRAMES 4096
+#endif
+/** @brief Ancienneté maximale par défaut d'un groupe en ms */
+#ifndef RECORDER_COMMIT_MS
+#define RECORDER_COMMIT_MS 1000
+#endif
+/** @brief Politique fsync par défaut */
+#ifndef RECORDER_FSYNC
+#define RECORDER_FSYNC RECORDER_FSYNC_CLOSE
+#endif
+/** @brief Taille du tampon de sortie du thread d'écriture */
+#define RECORDER_OUT_SIZE (64*1024)
+
+/**
+* @brief Trame en attente d'écriture
+*/
+struct rec_entry
+{
+    struct canfd_frame cf;	/*!< La trame (en-tête et len octets de données) */
+    struct timeval tv;		/*!< Date de la trame */
+    unsigned int bus;		/*!< Numéro du bus de la trame */
+};
+
+/**
+* @brief Format de fichier d'enregistrement
+*/
+struct rec_format
+{
+    /** Prépare le fichier ouvert (en-tête, reprise d'un fichier existant) */
+    int (*begin)(int fd, unsigned long * bytes);
+    /** Formate une trame, retourne le nombre d'octets écrits dans out */
+    unsigned int (*encode)(char * out, const struct rec_entry * e);
+    /** Taille maximale d'une trame formatée */
+    unsigned int max_record;
+    /** Appelé après chaque écriture de données (NULL si inutile) */
+    void (*sync)(int fd);
+    /** Finalise le fichier */
+    int (*end)(int fd);
+};
+
+/** @brief Protège le tampon actif */
+static pthread_mutex_t rec_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** @brief Réveille le thread d'écriture */
+static pthread_cond_t rec_cond;
+/** @brief Tampon rempli par recorder_push */
+static struct rec_entry * rec_active = NULL;
+/** @brief Tampon en cours d'écriture par le thread */
+static struct rec_entry * rec_flush = NULL;
+/** @brief Nombre de trames dans le tampon actif */
+static unsigned int rec_count = 0;
+/** @brief Nombre de trames perdues (tampon plein, écriture impossible) */
+static unsigned long rec_dropped_count = 0;
+/** @brief 1 si un enregistrement est actif */
+static int rec_running = 0;
+/** @brief 1 si le fichier ne peut plus être écrit : les trames sont perdues */
+static int rec_failed = 0;
+/** @brief Demande d'arrêt du thread d'écriture */
+static int rec_stop = 0;
+/** @brief Thread d'écriture */
+static pthread_t rec_thread;
+/** @brief Paramètres de l'enregistrement en cours */
+static struct recorder_config rec_cfg;
+/** @brief Format de l'enregistrement en cours */
+static const struct rec_format * rec_fmt;
+
+/** @brief Chemin du fichier */
+static char rec_path[256];
+/** @brief Noms des interfaces enregistrées, par numéro de bus */
+static char rec_ifaces[CANCAP_MAX_IFACES][IFNAMSIZ];
+/** @brief Pointeurs sur rec_ifaces (en-tête de capture) */
+static const char * rec_iface[CANCAP_MAX_IFACES];
+/** @brief Nombre d'interfaces enregistrées */
+static unsigned int rec_nb_ifaces;
+/** @brief Descripteur du fichier ouvert */
+static int rec_fd = -1;
+/** @brief Taille courante du fichier */
+static unsigned long rec_bytes;
+/** @brief Numéro de la dernière rotation */
+static unsigned int rec_rotation;
+/** @brief Tampon de sortie du thread d'écriture */
+static char * rec_out = NULL;
+
+/** @brief Index temporel de la capture en cours */
+static int rec_idx_fd = -1;
+/** @brief Pas de l'index de la capture en cours */
+static unsigned int rec_idx_stride;
+/** @brief Nombre de trames dans la capture en cours */
+static unsigned long long rec_nrec;
+/** @brief Taille des enregistrements de la capture en cours */
+static unsigned int rec_record_size;
+/** @brief Entrées d'index en attente d'écriture (données pas encore écrites) */
+static unsigned char rec_idx_buf[(RECORDER_OUT_SIZE / CANBIN_RECORD_SIZE / CANCAP_IDX_STRIDE + 2)
+                                 * CANCAP_IDX_ENTRY_SIZE];
+/** @brief Taille des entrées d'index en attente */
+static unsigned int rec_idx_len;
+
+
+/**
+* @brief Ecrit entièrement un tampon
+*
+* @returns 0 si OK, 1 sinon
+*/
+static int rec_write_all(int fd, const char * buf, size_t len)
+{
+    ssize_t ret;
+
+    while(len > 0)
+    {
+	ret = write(fd, buf, len);
+	if(ret < 0)
+	{
+	    if(errno == EINTR) continue;
+	    perror("Ecriture enregistrement");
+	    return 1;
+	}
+	buf += ret;
+	len -= ret;
+    }
+    return 0;
+}
+
+
+/**
+* @brief Prépare un fichier XML : prologue et balise racine ouvrante s'il est
+* vide, sinon retrait de la balise racine fermante pour ajouter à la suite.
+*/
+static int xml_begin(int fd, unsigned long * bytes)
+{
+    char head[128], tail[80];
+    off_t size;
+    int len;
+
+    size = lseek(fd, 0, SEEK_END);
+    if(size < 0)
+	return 1;
+
+    if(size == 0)
+    {
+	len = snprintf(head, sizeof(head),
+	               "<?xml version=\"1.0\" encoding=\"UTF-8\"?><%s>", rec_ifaces[0]);
+	*bytes = len;
+	return rec_write_all(fd, head, len);
+    }
+
+    /* Fichier existant : les trames sont insérées avant </root> */
+    len = snprintf(tail, sizeof(tail), "</%s>", rec_ifaces[0]);
+    if(size >= len && pread(fd, head, len, size - len) == len
+       && memcmp(head, tail, len) == 0)
+    {
+	size -= len;
+	if(ftruncate(fd, size) < 0)
+	    return 1;
+	lseek(fd, size, SEEK_SET);
+    }
+    *bytes = size;
+    return 0;
+}
+
+
+/** @brief Formate une trame en élément XML <trame> */
+static unsigned int xml_encode(char * out, const struct rec_entry * e)
+{
+    /* Avec plusieurs interfaces, chaque trame porte la sienne */
+    return frameenc_xml_trame(out, &e->cf, &e->tv,
+                              (rec_nb_ifaces > 1 && e->bus < rec_nb_ifaces)
+                              ? rec_ifaces[e->bus] : NULL);
+}
+
+
+/** @brief Ferme la balise racine XML */
+static int xml_end(int fd)
+{
+    char tail[80];
+    int len;
+
+    len = snprintf(tail, sizeof(tail), "</%s>", rec_ifaces[0]);
+    return rec_write_all(fd, tail, len);
+}
+
+
+/** @brief Format XML historique (une balise <trame> par trame) */
+static const struct rec_format rec_format_xml =
+{
+    xml_begin,
+    xml_encode,
+    FRAMEENC_MAX_SIZE,
+    NULL,
+    xml_end
+};
+
+
+/**
+* @brief Ouvre l'index d'une capture et le complète jusqu'à la trame rec_nrec
+*
+* Un index absent, d'un autre pas ou en retard sur les données (arrêt brutal)
+* est reconstruit à partir des trames déjà enregistrées.
+*/
+static int cap_idx_begin(int fd)
+{
+    char name[sizeof(rec_path) + 8];
+    unsigned char hdr[CANCAP_IDX_HEADER_SIZE], rec[CANBIN_RECORD_SIZE];
+    unsigned char ent[CANCAP_IDX_ENTRY_SIZE];
+    unsigned long long n, expected;
+    off_t size;
+
+    snprintf(name, sizeof(name), "%s.idx", rec_path);
+    if((rec_idx_fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+    {
+	perror(name);
+	return 1;
+    }
+
+    size = lseek(rec_idx_fd, 0, SEEK_END);
+    cancap_idx_header(hdr, rec_idx_stride);
+    if(size < CANCAP_IDX_HEADER_SIZE
+       || pread(rec_idx_fd, rec, CANCAP_IDX_HEADER_SIZE, 0) != CANCAP_IDX_HEADER_SIZE
+       || memcmp(rec, hdr, CANCAP_IDX_HEADER_SIZE) != 0)
+    {
+	if(ftruncate(rec_idx_fd, 0) < 0
+	   || pwrite(rec_idx_fd, hdr, CANCAP_IDX_HEADER_SIZE, 0) != CANCAP_IDX_HEADER_SIZE)
+	    return 1;
+	size = CANCAP_IDX_HEADER_SIZE;
+    }
+
+    n = (size - CANCAP_IDX_HEADER_SIZE) / CANCAP_IDX_ENTRY_SIZE;
+    expected = (rec_nrec + rec_idx_stride - 1) / rec_idx_stride;
+    if(n > expected) n = expected;
+    if(ftruncate(rec_idx_fd, CANCAP_IDX_HEADER_SIZE + n * CANCAP_IDX_ENTRY_SIZE) < 0)
+	return 1;
+    lseek(rec_idx_fd, 0, SEEK_END);
+
+    for(; n < expected; n++)
+    {
+	if(pread(fd, rec, CANBIN_RECORD_SIZE,
+	         CANCAP_HEADER_SIZE + n * rec_idx_stride * rec_record_size) != CANBIN_RECORD_SIZE)
+	    return 1;
+	cancap_idx_entry(ent, cancap_record_time(rec), n * rec_idx_stride);
+	if(rec_write_all(rec_idx_fd, (char *)ent, CANCAP_IDX_ENTRY_SIZE))
+	    return 1;
+    }
+    return 0;
+}
+
+
+/**
+* @brief Prépare une capture binaire : en-tête si elle est vide, sinon reprise
+* après la dernière trame complète.
+*/
+static int cap_begin(int fd, unsigned long * bytes)
+{
+    unsigned char hdr[CANCAP_HEADER_SIZE];
+    off_t size;
+
+    rec_idx_len = 0;
+    size = lseek(fd, 0, SEEK_END);
+    if(size < 0)
+	return 1;
+
+    if(size == 0)
+    {
+	rec_idx_stride = CANCAP_IDX_STRIDE;
+	rec_record_size = rec_cfg.fd ? CANBIN_FD_RECORD_SIZE : CANBIN_RECORD_SIZE;
+	rec_nrec = 0;
+	cancap_header(hdr, rec_iface, rec_nb_ifaces, rec_idx_stride, rec_record_size);
+	if(rec_write_all(fd, (char *)hdr, CANCAP_HEADER_SIZE))
+	    return 1;
+	size = CANCAP_HEADER_SIZE;
+    }
+    else
+    {
+	if(size < CANCAP_HEADER_SIZE
+	   || pread(fd, hdr, CANCAP_HEADER_SIZE, 0) != CANCAP_HEADER_SIZE
+	   || memcmp(hdr, CANCAP_MAGIC, 8) != 0)
+	{
+	    fprintf(stderr, "%s n'est pas une capture\n", rec_path);
+	    return 1;
+	}
+	rec_record_size = ((unsigned int)hdr[8] << 24) | ((unsigned int)hdr[9] << 16)
+	    | ((unsigned int)hdr[10] << 8) | hdr[11];
+	rec_idx_stride = ((unsigned int)hdr[12] << 24) | ((unsigned int)hdr[13] << 16)
+	    | ((unsigned int)hdr[14] << 8) | hdr[15];
+	if(rec_idx_stride == 0
+	   || (rec_record_size != CANBIN_RECORD_SIZE && rec_record_size != CANBIN_FD_RECORD_SIZE))
+	    return 1;
+
+	/* Une trame incomplète (arrêt brutal) est écrasée */
+	rec_nrec = (size - CANCAP_HEADER_SIZE) / rec_record_size;
+	size = CANCAP_HEADER_SIZE + rec_nrec * rec_record_size;
+	if(ftruncate(fd, size) < 0)
+	    return 1;
+	lseek(fd, size, SEEK_SET);
+    }
+
+    *bytes = size;
+    if(cap_idx_begin(fd))
+    {
+	if(rec_idx_fd >= 0) close(rec_idx_fd);
+	rec_idx_fd = -1;
+	return 1;
+    }
+    return 0;
+}
+
+
+/** @brief Encode une trame en enregistrement canbin, et note l'entrée d'index */
+static unsigned int cap_encode(char * out, const struct rec_entry * e)
+{
+    if(rec_record_size == CANBIN_FD_RECORD_SIZE)
+	canbin_pack_fd((unsigned char *)out, &e->cf, &e->tv, e->bus);
+    else if(e->cf.len > CAN_MAX_DLEN)
+    {
+	/* Trame CAN FD trop longue pour les enregistrements de la capture */
+	pthread_mutex_lock(&rec_mutex);
+	rec_dropped_count++;
+	pthread_mutex_unlock(&rec_mutex);
+	return 0;
+    }
+    else
+	canbin_pack((unsigned char *)out, &e->cf, &e->tv, e->bus);
+    if(rec_nrec % rec_idx_stride == 0)
+    {
+	cancap_idx_entry(rec_idx_buf + rec_idx_len, cancap_record_time((unsigned char *)out),
+	                 rec_nrec);
+	rec_idx_len += CANCAP_IDX_ENTRY_SIZE;
+    }
+    rec_nrec++;
+    return rec_record_size;
+}
+
+
+/** @brief Ecrit les entrées d'index dont les trames sont écrites */
+static void cap_sync(int fd)
+{
+    fd = fd;
+    if(rec_idx_len == 0) return;
+    rec_write_all(rec_idx_fd, (char *)rec_idx_buf, rec_idx_len);
+    rec_idx_len = 0;
+}
+
+
+/** @brief Ferme l'index ; la zone de données n'a pas de fin à écrire */
+static int cap_end(int fd)
+{
+    fd = fd;
+    if(rec_idx_fd < 0) return 0;
+    if(rec_cfg.fsync_policy != RECORDER_FSYNC_NEVER)
+	fsync(rec_idx_fd);
+    close(rec_idx_fd);
+    rec_idx_fd = -1;
+    return 0;
+}
+
+
+/** @brief Capture binaire à enregistrements fixes et index temporel (cancap.h) */
+static const struct rec_format rec_format_cap =
+{
+    cap_begin,
+    cap_encode,
+    CANBIN_MAX_RECORD_SIZE,
+    cap_sync,
+    cap_end
+};
+
+
+/**
+* @brief Finalise et ferme le fichier courant
+*/
+static void rec_file_close(void)
+{
+    if(rec_fd < 0) return;
+    rec_fmt->end(rec_fd);
+    if(rec_cfg.fsync_policy != RECORDER_FSYNC_NEVER)
+	fsync(rec_fd);
+    close(rec_fd);
+    rec_fd = -1;
+}
+
+
+/**
+* @brief Ouvre le fichier d'enregistrement et le prépare
+*
+* @returns 0 si OK, 1 sinon
+*/
+static int rec_file_open(void)
+{
+    if((rec_fd = open(rec_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+    {
+	perror(rec_path);
+	return 1;
+    }
+    if(rec_fmt->begin(rec_fd, &rec_bytes))
+    {
+	close(rec_fd);
+	rec_fd = -1;
+	return 1;
+    }
+    return 0;
+}
+
+
+/**
+* @brief Rotation : le fichier finalisé est renommé en <path>.<n>
+*/
+static void rec_rotate(void)
+{
+    char name[sizeof(rec_path) + 16], from[sizeof(rec_path) + 8], to[sizeof(name) + 8];
+
+    rec_file_close();
+    snprintf(name, sizeof(name), "%s.%u", rec_path, ++rec_rotation);
+    if(rename(rec_path, name) < 0)
+	perror("Rotation enregistrement");
+    if(rec_fmt == &rec_format_cap)
+    {
+	snprintf(from, sizeof(from), "%s.idx", rec_path);
+	snprintf(to, sizeof(to), "%s.idx", name);
+	rename(from, to);
+    }
+    rec_file_open();
+}
+
+
+/**
+* @brief Compte des trames perdues faute de fichier, et arrête l'enregistrement
+*
+* Le premier échec est signalé ; recorder_push refuse ensuite les trames en les
+* comptant, recorder_isopen répond 0 jusqu'à recorder_close.
+*
+* @param n Nombre de trames perdues
+*/
+static void rec_fail(unsigned int n)
+{
+    pthread_mutex_lock(&rec_mutex);
+    rec_dropped_count += n;
+    if(!rec_failed)
+	fprintf(stderr, "Enregistrement %s interrompu : fichier impossible à écrire\n", rec_path);
+    rec_failed = 1;
+    pthread_mutex_unlock(&rec_mutex);
+}
+
+
+/**
+* @brief Formate et écrit un groupe de trames
+*
+* Les trames d'un tampon qui ne peut être écrit, et les suivantes, sont perdues
+* et comptées (rec_fail).
+*
+* @param e Les trames
+* @param n Nombre de trames
+*/
+static void rec_commit(const struct rec_entry * e, unsigned int n)
+{
+    unsigned int i, len = 0, first = 0;
+    int full;
+
+    if(rec_fd < 0)
+    {
+	rec_fail(n);
+	return;
+    }
+
+    for(i = 0; i < n; i++)
+    {
+	len += rec_fmt->encode(rec_out + len, &e[i]);
+	full = rec_cfg.max_bytes && rec_bytes + len >= rec_cfg.max_bytes;
+	if(full || len + rec_fmt->max_record > RECORDER_OUT_SIZE || i == n - 1)
+	{
+	    if(rec_write_all(rec_fd, rec_out, len))
+	    {
+		/* Le tampon et le reste du groupe sont perdus, le fichier est finalisé tel quel */
+		rec_file_close();
+		rec_fail(n - first);
+		return;
+	    }
+	    rec_bytes += len;
+	    len = 0;
+	    first = i + 1;
+	    if(rec_fmt->sync != NULL)
+		rec_fmt->sync(rec_fd);
+	    if(full)
+	    {
+		rec_rotate();
+		if(rec_fd < 0)
+		{
+		    rec_fail(n - first);
+		    return;
+		}
+	    }
+	}
+    }
+
+    if(rec_cfg.fsync_policy == RECORDER_FSYNC_COMMIT && rec_fd >= 0)
+	fsync(rec_fd);
+}
+
+
+/**
+* @brief Thread d'écriture : échange les tampons et écrit les groupes
+*
+* Un groupe est écrit dès qu'il atteint commit_frames trames ou que son
+* ancienneté dépasse commit_ms. Le thread finalise le fichier à l'arrêt.
+*/
+static void * rec_thread_fct(void * args)
+{
+    struct rec_entry * tmp;
+    struct timespec deadline;
+    unsigned int n;
+    int stop;
+    args = args;
+
+    pthread_mutex_lock(&rec_mutex);
+    for(;;)
+    {
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += rec_cfg.commit_ms / 1000;
+	deadline.tv_nsec += (rec_cfg.commit_ms % 1000) * 1000000L;
+	if(deadline.tv_nsec >= 1000000000L)
+	{
+	    deadline.tv_sec++;
+	    deadline.tv_nsec -= 1000000000L;
+	}
+
+	while(!rec_stop && rec_count < rec_cfg.commit_frames)
+	    if(pthread_cond_timedwait(&rec_cond, &rec_mutex, &deadline) == ETIMEDOUT)
+		break;
+
+	/* Echange des tampons : les producteurs ne sont jamais bloqués par l'écriture */
+	n = rec_count;
+	tmp = rec_active;
+	rec_active = rec_flush;
+	rec_flush = tmp;
+	rec_count = 0;
+	stop = rec_stop;
+	pthread_mutex_unlock(&rec_mutex);
+
+	if(n > 0)
+	    rec_commit(rec_flush, n);
+	if(stop)
+	    break;
+
+	pthread_mutex_lock(&rec_mutex);
+    }
+
+    rec_file_close();
+    pthread_exit(NULL);
+}
+
+
+/**
+* @brief Remplit une configuration avec les valeurs par défaut
+*
+* @param cfg Configuration à remplir
+*/
+void recorder_default_config(struct recorder_config * cfg)
+{
+    cfg->buffer_frames = RECORDER_BUFFER_FRAMES;
+    cfg->commit_frames = RECORDER_COMMIT_FRAMES;
+    cfg->commit_ms = RECORDER_COMMIT_MS;
+    cfg->fsync_policy = RECORDER_FSYNC;
+    cfg->max_bytes = 0;
+    cfg->fd = 0;
+}
+
+
+/**
+* @brief Démarre l'enregistrement dans un fichier XML ou une capture binaire
+*
+* @param path Chemin du fichier
+* @param ifaces Noms des interfaces CAN, par numéro de bus
+* @param nb_ifaces Nombre d'interfaces (au plus CANCAP_MAX_IFACES)
+* @param cfg Paramètres, ou NULL pour les valeurs par défaut
+*
+* @returns 0 si OK, 1 fichier, 2 allocation, 3 thread, 5 enregistrement déjà actif
+*/
+int recorder_open(const char * path, const char * const * ifaces, unsigned int nb_ifaces,
+                  const struct recorder_config * cfg)
+{
+    pthread_condattr_t attr;
+    unsigned int i;
+    size_t len;
+
+    if(rec_running) return 5;
+
+    if(cfg != NULL) rec_cfg = *cfg;
+    else recorder_default_config(&rec_cfg);
+    if(rec_cfg.buffer_frames == 0) rec_cfg.buffer_frames = 1;
+    if(rec_cfg.commit_frames == 0 || rec_cfg.commit_frames > rec_cfg.buffer_frames)
+	rec_cfg.commit_frames = rec_cfg.buffer_frames;
+
+    snprintf(rec_path, sizeof(rec_path), "%s", path);
+    rec_nb_ifaces = 0;
+    for(i = 0; i < nb_ifaces && i < CANCAP_MAX_IFACES; i++)
+    {
+	snprintf(rec_ifaces[i], IFNAMSIZ, "%s", ifaces[i]);
+	rec_iface[i] = rec_ifaces[i];
+	rec_nb_ifaces++;
+    }
+    if(rec_nb_ifaces == 0)
+    {
+	rec_ifaces[0][0] = '\0';
+	rec_iface[0] = rec_ifaces[0];
+	rec_nb_ifaces = 1;
+    }
+    len = strlen(rec_path);
+    if(len >= 4 && strcmp(rec_path + len - 4, ".xml") == 0)
+	rec_fmt = &rec_format_xml;
+    else
+	rec_fmt = &rec_format_cap;
+    rec_rotation = 0;
+
+    if(rec_file_open())
+	return 1;
+
+    rec_active = malloc(rec_cfg.buffer_frames * sizeof(*rec_active));
+    rec_flush = malloc(rec_cfg.buffer_frames * sizeof(*rec_flush));
+    rec_out = malloc(RECORDER_OUT_SIZE);
+    if(rec_active == NULL || rec_flush == NULL || rec_out == NULL)
+    {
+	free(rec_active);
+	free(rec_flush);
+	free(rec_out);
+	rec_active = rec_flush = NULL;
+	rec_out = NULL;
+	rec_file_close();
+	return 2;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&rec_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    rec_count = 0;
+    rec_dropped_count = 0;
+    rec_failed = 0;
+    rec_stop = 0;
+    if(pthread_create(&rec_thread, NULL, rec_thread_fct, NULL))
+    {
+	perror("erreur pthread");
+	pthread_cond_destroy(&rec_cond);
+	rec_file_close();
+	return 3;
+    }
+
+    pthread_mutex_lock(&rec_mutex);
+    rec_running = 1;
+    pthread_mutex_unlock(&rec_mutex);
+    return 0;
+}
+
+
+/**
+* @brief Ajoute une trame à enregistrer
+*
+* @param cf La trame
+* @param tv Date de la trame
+* @param bus Numéro du bus de la trame (rang dans la liste de recorder_open)
+*
+* @returns 0 si OK, 1 si la trame est perdue, 2 si l'enregistrement est inactif
+*/
+int recorder_push(const struct canfd_frame * cf, const struct timeval * tv, unsigned int bus)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&rec_mutex);
+    if(!rec_running)
+	ret = 2;
+    else if(rec_failed || rec_count == rec_cfg.buffer_frames)
+    {
+	rec_dropped_count++;
+	ret = 1;
+    }
+    else
+    {
+	memcpy(&rec_active[rec_count].cf, cf, offsetof(struct canfd_frame, data)
+	       + (cf->len > CANFD_MAX_DLEN ? CANFD_MAX_DLEN : cf->len));
+	rec_active[rec_count].tv = *tv;
+	rec_active[rec_count].bus = bus;
+	if(++rec_count == rec_cfg.commit_frames)
+	    pthread_cond_signal(&rec_cond);
+    }
+    pthread_mutex_unlock(&rec_mutex);
+    return ret;
+}
+
+
+/**
+* @brief Arrête l'enregistrement
+*
+* @returns 0
+*/
+int recorder_close(void)
+{
+    pthread_mutex_lock(&rec_mutex);
+    if(!rec_running)
+    {
+	pthread_mutex_unlock(&rec_mutex);
+	return 0;
+    }
+    rec_running = 0;
+    rec_stop = 1;
+    pthread_cond_signal(&rec_cond);
+    pthread_mutex_unlock(&rec_mutex);
+
+    pthread_join(rec_thread, NULL);
+    pthread_cond_destroy(&rec_cond);
+
+    free(rec_active);
+    free(rec_flush);
+    free(rec_out);
+    rec_active = rec_flush = NULL;
+    rec_out = NULL;
+    return 0;
+}
+
+
+/**
+* @brief Donne l'état de l'enregistreur
+*
+* @returns 1 si un enregistrement est actif, 0 sinon
+*/
+int recorder_isopen(void)
+{
+    int ret;
+
+    pthread_mutex_lock(&rec_mutex);
+    ret = rec_running && !rec_failed;
+    pthread_mutex_unlock(&rec_mutex);
+    return ret;
+}
+
+
+/**
+* @brief Nombre de trames perdues depuis recorder_open
+*/
+unsigned long recorder_dropped(void)
+{
+    unsigned long ret;
+
+    pthread_mutex_lock(&rec_mutex);
+    ret = rec_dropped_count;
+    pthread_mutex_unlock(&rec_mutex);
+    return ret;
+}
@@ -0,0 +1,128 @@
+/**
+ * @file recorder.h
+ *
+ * @brief Enregistrement asynchrone du trafic CAN dans un fichier.
+ *
+ * Les trames sont copiées dans un tampon mémoire par recorder_push, sans
+ * appel système ni accès au système de fichiers : c'est un thread d'écriture
+ * dédié qui les formate et les écrit par groupes (group commit), dès que le
+ * groupe atteint une taille ou une ancienneté seuil. Le fichier n'est finalisé
+ * (balise racine fermante) qu'à la rotation ou à l'arrêt.
+ */
+
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#include <sys/time.h>
+#include <linux/can.h>
+
+/** @brief Pas de fsync */
+#define RECORDER_FSYNC_NEVER 0
+/** @brief fsync à la finalisation du fichier (rotation ou arrêt) */
+#define RECORDER_FSYNC_CLOSE 1
+/** @brief fsync après chaque groupe écrit */
+#define RECORDER_FSYNC_COMMIT 2
+
+/**
+* @brief Paramètres de l'enregistreur
+*/
+struct recorder_config
+{
+    unsigned int buffer_frames;	/*!< Capacité du tampon mémoire en trames */
+    unsigned int commit_frames;	/*!< Ecriture dès que ce nombre de trames est atteint */
+    unsigned int commit_ms;	/*!< Ecriture au plus tard après ce délai en ms */
+    int fsync_policy;		/*!< RECORDER_FSYNC_* */
+    unsigned long max_bytes;	/*!< Taille déclenchant une rotation (0 : jamais) */
+    int fd;			/*!< Capture binaire à enregistrements longs (trames CAN FD) */
+};
+
+
+/**
+* @brief Remplit une configuration avec les valeurs par défaut
+*
+* @param cfg Configuration à remplir
+*/
+void recorder_default_config(struct recorder_config * cfg);
+
+
+/**
+* @brief Démarre l'enregistrement dans un fichier XML ou une capture binaire
+*
+* Le format dépend de l'extension : un chemin en ".xml" donne le document XML
+* historique, tout autre chemin une capture binaire indexée (cancap.h).
+* Crée le fichier s'il n'existe pas. Si le fichier existe, les nouvelles
+* trames sont ajoutées à la suite (avant la balise racine fermante en XML).
+*
+* Avec plusieurs interfaces, la balise racine XML est la première et chaque
+* trame XML porte un élément <iface> ; la capture binaire liste les noms dans
+* son en-tête et chaque enregistrement porte son numéro de bus.
+*
+* Une nouvelle capture binaire a des enregistrements longs si cfg->fd est
+* vrai ; sinon ses trames CAN FD de plus de 8 octets sont perdues et comptées.
+* Une capture existante garde la taille d'enregistrement de son en-tête.
+*
+* @param path Chemin du fichier
+* @param ifaces Noms des interfaces CAN, par numéro de bus
+* @param nb_ifaces Nombre d'interfaces (au plus CANCAP_MAX_IFACES)
+* @param cfg Paramètres, ou NULL pour les valeurs par défaut
+*
+* @returns 0 si OK, 1 fichier, 2 allocation, 3 thread, 5 enregistrement déjà actif
+*/
+int recorder_open(const char * path, const char * const * ifaces, unsigned int nb_ifaces,
+                  const struct recorder_config * cfg);
+
+
+/**
+* @brief Ajoute une trame à enregistrer
+*
+* Ne bloque jamais et ne touche pas le système de fichiers : la trame est copiée
+* dans le tampon mémoire. Si le tampon est plein, la trame est perdue et comptée.
+* L'état de l'enregistreur est testé sous son verrou : inutile d'appeler
+* recorder_isopen avant.
+*
+* @param cf La trame
+* @param tv Date de la trame
+* @param bus Numéro du bus de la trame (rang dans la liste de recorder_open)
+*
+* @returns 0 si OK, 1 si la trame est perdue, 2 si l'enregistrement est inactif
+*/
+int recorder_push(const struct canfd_frame * cf, const struct timeval * tv, unsigned int bus);
+
+
+/**
+* @brief Arrête l'enregistrement
+*
+* Ecrit les trames en attente, finalise et ferme le fichier.
+*
+* @returns 0
+*/
+int recorder_close(void);
+
+
+/**
+* @brief Donne l'état de l'enregistreur
+*
+* Un enregistrement dont le fichier ne peut plus être écrit (écriture ou
+* rotation en échec) est interrompu : ses trames sont perdues et comptées
+* jusqu'à recorder_close.
+*
+* @returns 1 si un enregistrement est actif, 0 sinon
+*/
+int recorder_isopen(void);
+
+
+/**
+* @brief Nombre de trames perdues (tampon plein, fichier en échec) depuis recorder_open
+*/
+unsigned long recorder_dropped(void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif